@@ -0,0 +1,141 @@
+/*
+ *	Tiny File System
+ *
+ *	File:	arena.c
+ *
+ *	Per-thread scratch memory, see arena.h
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "arena.h"
+
+struct arena_chunk {
+	struct arena_chunk	*prev;	/* older chunk, NULL for the thread's first */
+	size_t				size;	/* bytes in data */
+	size_t				used;
+	char				data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+static __thread struct arena_chunk *arena_head;	/* newest chunk of this thread */
+static pthread_key_t arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+//Free every chunk of an exiting thread
+static void arena_exit(void *head) {
+	struct arena_chunk *chunk = head;
+	while (chunk != NULL) {
+		struct arena_chunk *prev = chunk->prev;
+		free(chunk);
+		chunk = prev;
+	}
+}
+
+static void arena_key_init() {
+	pthread_key_create(&arena_key, arena_exit);
+}
+
+static struct arena_chunk *arena_chunk_new(struct arena_chunk *prev, size_t size) {
+	struct arena_chunk *chunk;
+	if (posix_memalign((void **)&chunk, ARENA_ALIGN, sizeof(struct arena_chunk) + size) != 0) {
+		return NULL;
+	}
+	chunk->prev = prev;
+	chunk->size = size;
+	chunk->used = 0;
+	return chunk;
+}
+
+//The calling thread's newest chunk, created on its first allocation
+static struct arena_chunk *arena_get() {
+	if (arena_head == NULL) {
+		pthread_once(&arena_once, arena_key_init);
+		arena_head = arena_chunk_new(NULL, ARENA_CHUNK);
+		pthread_setspecific(arena_key, arena_head);
+	}
+	return arena_head;
+}
+
+//size bytes aligned to ARENA_ALIGN, good until the request ends or the
+//enclosing arena_release(). NULL if memory is exhausted.
+void *arena_alloc(size_t size) {
+	struct arena_chunk *chunk = arena_get();
+	size_t need = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+	if (chunk == NULL) {
+		return NULL;
+	}
+
+	// Step 1: Bump within the newest chunk
+	if (chunk->size - chunk->used >= need) {
+		void *p = chunk->data + chunk->used;
+		chunk->used += need;
+		return p;
+	}
+
+	// Step 2: Start a new chunk, big enough for this allocation
+	chunk = arena_chunk_new(chunk, need > ARENA_CHUNK ? need : ARENA_CHUNK);
+	if (chunk == NULL) {
+		return NULL;
+	}
+	arena_head = chunk;
+	pthread_setspecific(arena_key, arena_head);
+	chunk->used = need;
+	return chunk->data;
+}
+
+void *arena_zalloc(size_t size) {
+	void *p = arena_alloc(size);
+	if (p != NULL) {
+		memset(p, 0, size);
+	}
+	return p;
+}
+
+struct arena_pos arena_mark() {
+	struct arena_pos pos;
+	pos.chunk = arena_get();
+	pos.used = pos.chunk != NULL ? pos.chunk->used : 0;
+	return pos;
+}
+
+//Give back everything allocated since pos was marked, freeing the chunks
+//started after it
+void arena_release(struct arena_pos pos) {
+	struct arena_chunk *chunk = arena_head;
+
+	while (chunk != NULL && chunk != pos.chunk) {
+		struct arena_chunk *prev = chunk->prev;
+		free(chunk);
+		chunk = prev;
+	}
+	if (arena_head != chunk) {
+		arena_head = chunk;
+		pthread_setspecific(arena_key, arena_head);
+	}
+	if (chunk != NULL) {
+		chunk->used = pos.used;
+	}
+}
+
+//End of a request: give back everything but the first chunk
+void arena_reset() {
+	struct arena_chunk *chunk = arena_head;
+
+	if (chunk == NULL) {
+		return;
+	}
+	while (chunk->prev != NULL) {
+		struct arena_chunk *prev = chunk->prev;
+		free(chunk);
+		chunk = prev;
+	}
+	chunk->used = 0;
+	if (arena_head != chunk) {
+		arena_head = chunk;
+		pthread_setspecific(arena_key, arena_head);
+	}
+}
@@ -0,0 +1,45 @@
+/*
+ *	Tiny File System
+ *
+ *	File:	arena.h
+ *
+ *	Per-thread scratch memory for the duration of one request
+ *
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+/*
+ * Each thread has its own arena: a bump allocator over a chunk of
+ * ARENA_CHUNK bytes that lives as long as the thread, plus extra chunks
+ * while a request needs more. Block buffers, extent maps and the other
+ * scratch space a request uses come from it, and all of it goes away at once
+ * when the request ends with arena_reset(), so requests don't call malloc()
+ * and free() and nothing they forget can leak.
+ *
+ * Functions that allocate in a loop, or that are called in one, take an
+ * arena_mark() on entry and arena_release() it on the way out, giving back
+ * everything allocated since, so a long request doesn't pile up scratch.
+ * Memory that must outlive the request still comes from malloc().
+ */
+#define ARENA_CHUNK		(64 * 1024)
+#define ARENA_ALIGN		64
+
+struct arena_chunk;
+
+//A point to release back to, see arena_mark()
+struct arena_pos {
+	struct arena_chunk	*chunk;
+	size_t				used;
+};
+
+void *arena_alloc(size_t size);
+void *arena_zalloc(size_t size);
+struct arena_pos arena_mark();
+void arena_release(struct arena_pos pos);
+void arena_reset();
+
+#endif
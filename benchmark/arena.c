@@ -0,0 +1,123 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "../arena.h"
+
+/*
+ * Scratch allocation microbenchmark.
+ *
+ * Each thread runs requests shaped like a small tfs read: an extent map, an
+ * inode block and a directory block, then block number and buffer arrays and
+ * two bounce buffers, written to so the pages are really used. The scratch
+ * comes from malloc()/free() in one run and from the per-thread arena, reset
+ * after every request, in the other. Reports the time per request and the
+ * resident set size after each run.
+ *
+ * usage: ./arena [threads] [requests per thread]
+ */
+
+#define DEFAULT_THREADS 4
+#define DEFAULT_REQUESTS 1000000
+#define BLOCK 4096
+#define EXTENT_MAP (340 * 12)
+#define REQUEST_BLOCKS 32
+
+static int requests;
+
+static double now_sec() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long rss_kb() {
+	long size = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f != NULL) {
+		if (fscanf(f, "%ld %ld", &size, &resident) != 2) {
+			resident = 0;
+		}
+		fclose(f);
+	}
+	return resident * 4;
+}
+
+static void *run_malloc(void *arg) {
+	int i;
+	for (i = 0; i < requests; i++) {
+		char *ext = malloc(EXTENT_MAP);
+		char *inode = malloc(BLOCK);
+		char *dir = malloc(BLOCK);
+		int *nums = malloc(REQUEST_BLOCKS * sizeof(int));
+		void **bufs = malloc(REQUEST_BLOCKS * sizeof(void *));
+		char *head = malloc(BLOCK);
+		char *tail = malloc(BLOCK);
+		ext[0] = inode[0] = dir[0] = head[0] = tail[0] = (char)i;
+		nums[0] = i;
+		bufs[0] = head;
+		free(ext);
+		free(inode);
+		free(dir);
+		free(nums);
+		free(bufs);
+		free(head);
+		free(tail);
+	}
+	return NULL;
+}
+
+static void *run_arena(void *arg) {
+	int i;
+	for (i = 0; i < requests; i++) {
+		char *ext = arena_alloc(EXTENT_MAP);
+		char *inode = arena_alloc(BLOCK);
+		char *dir = arena_alloc(BLOCK);
+		int *nums = arena_alloc(REQUEST_BLOCKS * sizeof(int));
+		void **bufs = arena_alloc(REQUEST_BLOCKS * sizeof(void *));
+		char *head = arena_alloc(BLOCK);
+		char *tail = arena_alloc(BLOCK);
+		ext[0] = inode[0] = dir[0] = head[0] = tail[0] = (char)i;
+		nums[0] = i;
+		bufs[0] = head;
+		arena_reset();
+	}
+	return NULL;
+}
+
+static double run(void *(*fn)(void *), int nthreads) {
+	pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+	int t;
+
+	double start = now_sec();
+	for (t = 0; t < nthreads; t++) {
+		pthread_create(&threads[t], NULL, fn, NULL);
+	}
+	for (t = 0; t < nthreads; t++) {
+		pthread_join(threads[t], NULL);
+	}
+	double secs = now_sec() - start;
+
+	free(threads);
+	return secs;
+}
+
+int main(int argc, char **argv) {
+
+	int nthreads = argc > 1 ? atoi(argv[1]) : DEFAULT_THREADS;
+	requests = argc > 2 ? atoi(argv[2]) : DEFAULT_REQUESTS;
+	double total = (double)nthreads * requests;
+
+	double with_malloc = run(run_malloc, nthreads);
+	long rss_malloc = rss_kb();
+	double with_arena = run(run_arena, nthreads);
+	long rss_arena = rss_kb();
+
+	printf("%-10s %12s %10s\n", "scratch", "ns/request", "rss kB");
+	printf("%-10s %12.1f %10ld\n", "malloc", with_malloc * 1e9 / total, rss_malloc);
+	printf("%-10s %12.1f %10ld\n", "arena", with_arena * 1e9 / total, rss_arena);
+	printf("Benchmark completed \n");
+	return 0;
+}
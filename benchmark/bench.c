@@ -0,0 +1,531 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <stdint.h>
+
+/*
+ * File system benchmark.
+ *
+ * Runs one or more workloads against a tfs mount with N worker threads, each
+ * in its own directory, and reports throughput and latency percentiles for
+ * every phase. Every system call a phase times is one sample, so p50/p99/p999
+ * are per-operation latencies across all threads.
+ *
+ *   seqwrite   pwrite io_size chunks front to back over a file_size file
+ *   seqread    pread them back in order
+ *   randwrite  pwrite io_size chunks at random aligned offsets
+ *   randread   pread at random aligned offsets
+ *   files      create, stat and unlink storms over many small files
+ *   tree       mkdir a depth-deep directory chain, stat its leaf, rmdir it
+ *   all        everything above, in that order
+ *
+ * Read workloads write their file first, untimed. With -j the results come
+ * out as one JSON object per line, to be collected across builds.
+ *
+ * usage: ./bench [-d mountdir] [-w workload[,workload..]] [-t threads]
+ *                [-s io_size] [-f file_size] [-n ops] [-D depth] [-j]
+ */
+
+/* Default TFS mount point, can be overridden with -d */
+#define TESTDIR "/tmp/mountdir"
+
+#define FSPATHLEN 4096
+#define FILEPERM 0666
+#define DIRPERM 0755
+
+#define DEFAULT_IO_SIZE 4096
+#define DEFAULT_FILE_SIZE (16 * 1024 * 1024)
+#define DEFAULT_OPS 1000
+#define DEFAULT_DEPTH 32
+#define MAX_THREADS 64
+
+struct config {
+	const char *testdir;
+	int threads;
+	size_t io_size;
+	size_t file_size;
+	long ops;			/* operations per thread and phase */
+	int depth;
+	int json;
+};
+
+/* One timed phase, run by every worker between two barriers */
+struct phase {
+	const char *name;
+	int (*run)(struct config *cfg, int id, uint64_t *lat, long *bytes);
+};
+
+struct worker {
+	pthread_t thread;
+	struct config *cfg;
+	struct phase *phase;
+	int id;
+	uint64_t *lat;		/* ns per operation, cfg->ops of them */
+	uint64_t start;		/* when the worker left the start line */
+	uint64_t end;
+	long bytes;
+	int failed;
+};
+
+static pthread_barrier_t start_line;
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void worker_path(char *path, struct config *cfg, int id, const char *name) {
+	snprintf(path, FSPATHLEN, "%s/bench_t%d/%s", cfg->testdir, id, name);
+}
+
+/* -----------------
+ * data workloads
+ -------------------*/
+
+static long chunks(struct config *cfg) {
+	return cfg->file_size / cfg->io_size;
+}
+
+static int data_io(struct config *cfg, int id, uint64_t *lat, long *bytes, int write, int random) {
+	char path[FSPATHLEN];
+	char *buf = malloc(cfg->io_size);
+	unsigned int seed = id * 7919 + 1;
+	long i, n = chunks(cfg);
+	int fd, ret = 0;
+
+	memset(buf, 'a' + id % 26, cfg->io_size);
+	worker_path(path, cfg, id, "data");
+	if ((fd = open(path, write ? O_CREAT | O_WRONLY : O_RDONLY, FILEPERM)) < 0) {
+		perror("open");
+		free(buf);
+		return -1;
+	}
+
+	for (i = 0; i < cfg->ops; i++) {
+		long chunk = random ? rand_r(&seed) % n : i % n;
+		off_t off = (off_t)chunk * cfg->io_size;
+		uint64_t t = now_ns();
+		ssize_t done = write ? pwrite(fd, buf, cfg->io_size, off) : pread(fd, buf, cfg->io_size, off);
+		lat[i] = now_ns() - t;
+		if (done != (ssize_t)cfg->io_size) {
+			perror(write ? "pwrite" : "pread");
+			ret = -1;
+			break;
+		}
+		*bytes += done;
+	}
+
+	close(fd);
+	free(buf);
+	return ret;
+}
+
+static int run_seqwrite(struct config *cfg, int id, uint64_t *lat, long *bytes) {
+	return data_io(cfg, id, lat, bytes, 1, 0);
+}
+
+static int run_seqread(struct config *cfg, int id, uint64_t *lat, long *bytes) {
+	return data_io(cfg, id, lat, bytes, 0, 0);
+}
+
+static int run_randwrite(struct config *cfg, int id, uint64_t *lat, long *bytes) {
+	return data_io(cfg, id, lat, bytes, 1, 1);
+}
+
+static int run_randread(struct config *cfg, int id, uint64_t *lat, long *bytes) {
+	return data_io(cfg, id, lat, bytes, 0, 1);
+}
+
+/* Untimed: give every worker a full file_size data file to read from */
+static int prepare_data(struct config *cfg, int id) {
+	char path[FSPATHLEN];
+	char *buf = malloc(cfg->io_size);
+	long i;
+	int fd, ret = 0;
+
+	memset(buf, 'a' + id % 26, cfg->io_size);
+	worker_path(path, cfg, id, "data");
+	if ((fd = open(path, O_CREAT | O_WRONLY, FILEPERM)) < 0) {
+		perror("open");
+		free(buf);
+		return -1;
+	}
+	for (i = 0; i < chunks(cfg); i++) {
+		if (pwrite(fd, buf, cfg->io_size, (off_t)i * cfg->io_size) != (ssize_t)cfg->io_size) {
+			perror("pwrite");
+			ret = -1;
+			break;
+		}
+	}
+	close(fd);
+	free(buf);
+	return ret;
+}
+
+/* -----------------
+ * metadata workloads
+ -------------------*/
+
+static int run_create(struct config *cfg, int id, uint64_t *lat, long *bytes) {
+	char path[FSPATHLEN], name[32];
+	long i;
+
+	for (i = 0; i < cfg->ops; i++) {
+		snprintf(name, sizeof(name), "f%ld", i);
+		worker_path(path, cfg, id, name);
+		uint64_t t = now_ns();
+		int fd = open(path, O_CREAT | O_WRONLY, FILEPERM);
+		if (fd >= 0)
+			close(fd);
+		lat[i] = now_ns() - t;
+		if (fd < 0) {
+			perror("create");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int run_stat(struct config *cfg, int id, uint64_t *lat, long *bytes) {
+	char path[FSPATHLEN], name[32];
+	struct stat st;
+	long i;
+
+	for (i = 0; i < cfg->ops; i++) {
+		snprintf(name, sizeof(name), "f%ld", i);
+		worker_path(path, cfg, id, name);
+		uint64_t t = now_ns();
+		int ret = stat(path, &st);
+		lat[i] = now_ns() - t;
+		if (ret < 0) {
+			perror("stat");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int run_unlink(struct config *cfg, int id, uint64_t *lat, long *bytes) {
+	char path[FSPATHLEN], name[32];
+	long i;
+
+	for (i = 0; i < cfg->ops; i++) {
+		snprintf(name, sizeof(name), "f%ld", i);
+		worker_path(path, cfg, id, name);
+		uint64_t t = now_ns();
+		int ret = unlink(path);
+		lat[i] = now_ns() - t;
+		if (ret < 0) {
+			perror("unlink");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Path of level 0..depth-1 of a worker's directory chain */
+static void tree_path(char *path, struct config *cfg, int id, int level) {
+	int i, len;
+
+	worker_path(path, cfg, id, "tree");
+	len = strlen(path);
+	for (i = 1; i <= level && len < FSPATHLEN - 16; i++) {
+		len += snprintf(path + len, FSPATHLEN - len, "/d%d", i);
+	}
+}
+
+/* Levels in a worker's chain: depth, or fewer when there are fewer ops to time */
+static int tree_levels(struct config *cfg) {
+	return cfg->ops < cfg->depth ? cfg->ops : cfg->depth;
+}
+
+/* The chain is rebuilt as often as it takes to time cfg->ops mkdirs, and is
+ * left complete for the stat and rmdir phases */
+static int run_mkdir_deep(struct config *cfg, int id, uint64_t *lat, long *bytes) {
+	char path[FSPATHLEN];
+	int levels = tree_levels(cfg);
+	int l;
+	long i;
+
+	for (i = 0; i < cfg->ops; i++) {
+		int level = i % levels;
+		if (level == 0 && i > 0) {
+			/* untimed: tear the finished chain down again */
+			for (l = levels - 1; l >= 0; l--) {
+				tree_path(path, cfg, id, l);
+				rmdir(path);
+			}
+		}
+		tree_path(path, cfg, id, level);
+		uint64_t t = now_ns();
+		int ret = mkdir(path, DIRPERM);
+		lat[i] = now_ns() - t;
+		if (ret < 0) {
+			perror("mkdir");
+			return -1;
+		}
+	}
+
+	for (l = cfg->ops % levels; l > 0 && l < levels; l++) {
+		tree_path(path, cfg, id, l);
+		mkdir(path, DIRPERM);
+	}
+	return 0;
+}
+
+static int run_stat_deep(struct config *cfg, int id, uint64_t *lat, long *bytes) {
+	char path[FSPATHLEN];
+	struct stat st;
+	long i;
+
+	tree_path(path, cfg, id, tree_levels(cfg) - 1);
+	for (i = 0; i < cfg->ops; i++) {
+		uint64_t t = now_ns();
+		int ret = stat(path, &st);
+		lat[i] = now_ns() - t;
+		if (ret < 0) {
+			perror("stat");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int run_rmdir_deep(struct config *cfg, int id, uint64_t *lat, long *bytes) {
+	char path[FSPATHLEN];
+	int levels = tree_levels(cfg);
+	long i;
+
+	for (i = 0; i < cfg->ops; i++) {
+		int level = levels - 1 - i % levels;
+		if (level == levels - 1 && i > 0) {
+			/* untimed: build the chain back up */
+			int l;
+			for (l = 0; l < levels; l++) {
+				tree_path(path, cfg, id, l);
+				mkdir(path, DIRPERM);
+			}
+		}
+		tree_path(path, cfg, id, level);
+		uint64_t t = now_ns();
+		int ret = rmdir(path);
+		lat[i] = now_ns() - t;
+		if (ret < 0) {
+			perror("rmdir");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* -----------------
+ * driver
+ -------------------*/
+
+static void *run_worker(void *arg) {
+	struct worker *w = arg;
+
+	pthread_barrier_wait(&start_line);
+	w->start = now_ns();
+	if (w->phase->run(w->cfg, w->id, w->lat, &w->bytes) < 0)
+		w->failed = 1;
+	w->end = now_ns();
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(uint64_t *sorted, long n, double p) {
+	long i = (long)(p * n);
+	if (i >= n)
+		i = n - 1;
+	return sorted[i] / 1000.0;
+}
+
+static void report(struct config *cfg, const char *workload, const char *name,
+		double secs, long nops, long bytes, uint64_t *lat) {
+	double ops = nops / secs;
+	double mbs = bytes / secs / (1024 * 1024);
+
+	qsort(lat, nops, sizeof(uint64_t), cmp_u64);
+	if (cfg->json) {
+		printf("{\"workload\":\"%s\",\"phase\":\"%s\",\"threads\":%d,\"io_size\":%zu,"
+			"\"file_size\":%zu,\"depth\":%d,\"ops\":%ld,\"seconds\":%.6f,\"ops_per_sec\":%.1f,"
+			"\"mb_per_sec\":%.2f,\"lat_us\":{\"p50\":%.2f,\"p99\":%.2f,\"p999\":%.2f,\"max\":%.2f}}\n",
+			workload, name, cfg->threads, cfg->io_size, cfg->file_size, cfg->depth, nops, secs, ops,
+			mbs, percentile(lat, nops, 0.5), percentile(lat, nops, 0.99), percentile(lat, nops, 0.999),
+			lat[nops - 1] / 1000.0);
+	} else {
+		printf("%-10s %-11s %8ld %12.0f %10.2f %10.2f %10.2f %10.2f\n", workload, name, nops, ops, mbs,
+			percentile(lat, nops, 0.5), percentile(lat, nops, 0.99), percentile(lat, nops, 0.999));
+	}
+	fflush(stdout);
+}
+
+/* Run one phase on every worker at once and report it */
+static int run_phase(struct config *cfg, const char *workload, struct phase *phase) {
+	struct worker workers[MAX_THREADS];
+	long nops = (long)cfg->threads * cfg->ops;
+	uint64_t *lat = calloc(nops, sizeof(uint64_t));
+	long bytes = 0;
+	int i, failed = 0;
+
+	pthread_barrier_init(&start_line, NULL, cfg->threads + 1);
+	for (i = 0; i < cfg->threads; i++) {
+		workers[i].cfg = cfg;
+		workers[i].phase = phase;
+		workers[i].id = i;
+		workers[i].lat = lat + (long)i * cfg->ops;
+		workers[i].bytes = 0;
+		workers[i].failed = 0;
+		pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+	}
+
+	/* The phase lasts from the first worker starting to the last one finishing */
+	pthread_barrier_wait(&start_line);
+	uint64_t start = UINT64_MAX, end = 0;
+	for (i = 0; i < cfg->threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		bytes += workers[i].bytes;
+		failed |= workers[i].failed;
+		start = workers[i].start < start ? workers[i].start : start;
+		end = workers[i].end > end ? workers[i].end : end;
+	}
+	double secs = (end - start) / 1e9;
+	pthread_barrier_destroy(&start_line);
+
+	if (!failed)
+		report(cfg, workload, phase->name, secs, nops, bytes, lat);
+	free(lat);
+	return failed ? -1 : 0;
+}
+
+static struct phase seqwrite_phases[] = { { "write", run_seqwrite }, { NULL } };
+static struct phase seqread_phases[] = { { "read", run_seqread }, { NULL } };
+static struct phase randwrite_phases[] = { { "write", run_randwrite }, { NULL } };
+static struct phase randread_phases[] = { { "read", run_randread }, { NULL } };
+static struct phase files_phases[] = {
+	{ "create", run_create }, { "stat", run_stat }, { "unlink", run_unlink }, { NULL }
+};
+static struct phase tree_phases[] = {
+	{ "mkdir", run_mkdir_deep }, { "stat", run_stat_deep }, { "rmdir", run_rmdir_deep }, { NULL }
+};
+
+static struct {
+	const char *name;
+	struct phase *phases;
+	int needs_data;		/* read workloads write their files first */
+} workloads[] = {
+	{ "seqwrite", seqwrite_phases, 0 },
+	{ "seqread", seqread_phases, 1 },
+	{ "randwrite", randwrite_phases, 0 },
+	{ "randread", randread_phases, 1 },
+	{ "files", files_phases, 0 },
+	{ "tree", tree_phases, 0 },
+	{ NULL }
+};
+
+static int run_workload(struct config *cfg, int w) {
+	struct phase *p;
+	char path[FSPATHLEN];
+	int i;
+
+	for (i = 0; i < cfg->threads; i++) {
+		snprintf(path, FSPATHLEN, "%s/bench_t%d", cfg->testdir, i);
+		if (mkdir(path, DIRPERM) < 0 && errno != EEXIST) {
+			perror("mkdir");
+			return -1;
+		}
+		if (workloads[w].needs_data && prepare_data(cfg, i) < 0)
+			return -1;
+	}
+
+	for (p = workloads[w].phases; p->name != NULL; p++) {
+		if (run_phase(cfg, workloads[w].name, p) < 0)
+			return -1;
+	}
+
+	/* Leave the mount as it was found */
+	for (i = 0; i < cfg->threads; i++) {
+		int l;
+		for (l = tree_levels(cfg) - 1; l >= 0; l--) {
+			tree_path(path, cfg, i, l);
+			rmdir(path);
+		}
+		worker_path(path, cfg, i, "data");
+		unlink(path);
+		snprintf(path, FSPATHLEN, "%s/bench_t%d", cfg->testdir, i);
+		rmdir(path);
+	}
+	return 0;
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-d mountdir] [-w workload[,workload..]] [-t threads]\n"
+		"       [-s io_size] [-f file_size] [-n ops] [-D depth] [-j]\n"
+		"workloads: seqwrite seqread randwrite randread files tree all\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	struct config cfg = {
+		.testdir = TESTDIR,
+		.threads = 1,
+		.io_size = DEFAULT_IO_SIZE,
+		.file_size = DEFAULT_FILE_SIZE,
+		.ops = DEFAULT_OPS,
+		.depth = DEFAULT_DEPTH,
+		.json = 0,
+	};
+	char *which = "all";
+	int opt, w;
+
+	while ((opt = getopt(argc, argv, "d:w:t:s:f:n:D:j")) != -1) {
+		switch (opt) {
+		case 'd': cfg.testdir = optarg; break;
+		case 'w': which = optarg; break;
+		case 't': cfg.threads = atoi(optarg); break;
+		case 's': cfg.io_size = strtoul(optarg, NULL, 0); break;
+		case 'f': cfg.file_size = strtoul(optarg, NULL, 0); break;
+		case 'n': cfg.ops = atol(optarg); break;
+		case 'D': cfg.depth = atoi(optarg); break;
+		case 'j': cfg.json = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (cfg.threads < 1 || cfg.threads > MAX_THREADS || cfg.io_size == 0 || cfg.ops < 1 ||
+			cfg.depth < 1 || cfg.file_size < cfg.io_size)
+		usage(argv[0]);
+
+	if (!cfg.json)
+		printf("%-10s %-11s %8s %12s %10s %10s %10s %10s\n", "workload", "phase", "ops", "ops/sec",
+			"MB/s", "p50 us", "p99 us", "p999 us");
+
+	for (w = 0; workloads[w].name != NULL; w++) {
+		char list[256];
+		char *tok, *save;
+		int selected = 0;
+
+		snprintf(list, sizeof(list), "%s", which);
+		for (tok = strtok_r(list, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+			if (strcmp(tok, "all") == 0 || strcmp(tok, workloads[w].name) == 0)
+				selected = 1;
+		}
+		if (selected && run_workload(&cfg, w) < 0) {
+			fprintf(stderr, "%s failed\n", workloads[w].name);
+			return 1;
+		}
+	}
+	return 0;
+}
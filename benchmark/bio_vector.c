@@ -0,0 +1,122 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "../block.h"
+
+/*
+ * Block layer vectored I/O benchmark.
+ *
+ * Streams a file-sized range of blocks through the block layer, once with
+ * one bio_read()/bio_write() per block and then with bio_readv()/bio_writev()
+ * in requests of increasing size (32 blocks is a 128KB FUSE request). Reports
+ * system calls per MB and throughput. The block cache is disabled so every
+ * block reaches the disk file.
+ *
+ * It then reads every other block ("scatter"), which preadv can't merge, once
+ * with the pread backend and once with the io_uring backend ("uring"), where
+ * a whole request goes to the kernel in one submission.
+ *
+ * usage: ./bio_vector [diskfile] [MB]
+ */
+
+#define DISKFILE "/tmp/bio_vector.disk"
+#define DEFAULT_MB 16
+
+static double now_sec() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, int per_request, unsigned long syscalls, double secs, int mb) {
+	printf("%-8s %8d %14.1f %10.1f\n", name, per_request, (double)syscalls / mb, mb / secs);
+}
+
+int main(int argc, char **argv) {
+
+	const char *diskfile = argc > 1 ? argv[1] : DISKFILE;
+	int mb = argc > 2 ? atoi(argv[2]) : DEFAULT_MB;
+	int nblocks = mb * (1024 * 1024 / BLOCK_SIZE);
+	int sizes[] = { 1, 8, 32, 256 };
+	int i, j, s, b;
+
+	char *data = malloc((size_t)nblocks * BLOCK_SIZE);
+	int *block_nums = malloc(nblocks * sizeof(int));
+	void **bufs = malloc(nblocks * sizeof(void *));
+	memset(data, 0x61, (size_t)nblocks * BLOCK_SIZE);
+	for (i = 0; i < nblocks; i++) {
+		block_nums[i] = i;
+		bufs[i] = data + (size_t)i * BLOCK_SIZE;
+	}
+
+	unlink(diskfile);
+	dev_set_cache_size(0);
+	dev_init(diskfile);
+
+	printf("%-8s %8s %14s %10s\n", "op", "blocks", "syscalls/MB", "MB/s");
+
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		int per_request = sizes[s];
+		unsigned long before = bio_syscall_count();
+		double start = now_sec();
+		for (i = 0; i < nblocks; i += per_request) {
+			if (per_request == 1) {
+				bio_write(i, bufs[i]);
+			} else {
+				bio_writev(&block_nums[i], (const void *const *)&bufs[i], per_request);
+			}
+		}
+		report("write", per_request, bio_syscall_count() - before, now_sec() - start, mb);
+	}
+
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		int per_request = sizes[s];
+		unsigned long before = bio_syscall_count();
+		double start = now_sec();
+		for (i = 0; i < nblocks; i += per_request) {
+			if (per_request == 1) {
+				bio_read(i, bufs[i]);
+			} else {
+				bio_readv(&block_nums[i], &bufs[i], per_request);
+			}
+		}
+		report("read", per_request, bio_syscall_count() - before, now_sec() - start, mb);
+	}
+
+	int nscatter = nblocks / 2;
+	int backends[] = { BIO_BACKEND_PREAD, BIO_BACKEND_URING };
+	const char *names[] = { "scatter", "uring" };
+	for (i = 0; i < nscatter; i++) {
+		block_nums[i] = 2 * i;
+	}
+	for (b = 0; b < 2; b++) {
+		dev_close();
+		dev_set_backend(backends[b]);
+		dev_open(diskfile);
+		for (s = 1; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+			int per_request = sizes[s];
+			unsigned long before = bio_syscall_count();
+			double start = now_sec();
+			for (i = 0; i < nscatter; i += per_request) {
+				int n = nscatter - i < per_request ? nscatter - i : per_request;
+				bio_readv(&block_nums[i], &bufs[i], n);
+			}
+			report(names[b], per_request, bio_syscall_count() - before, now_sec() - start, mb / 2);
+		}
+	}
+
+	for (j = 0; j < (size_t)nblocks * BLOCK_SIZE; j++) {
+		if (data[j] != 0x61) {
+			printf("read back mismatch at byte %d\n", j);
+			exit(1);
+		}
+	}
+
+	dev_close();
+	unlink(diskfile);
+	printf("Benchmark completed \n");
+	return 0;
+}
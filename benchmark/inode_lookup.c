@@ -0,0 +1,90 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Inode lookup microbenchmark.
+ *
+ * Times stat() on a single probe file while more and more inodes are
+ * allocated elsewhere in the file system. readi()/writei() locate an inode
+ * directly from its number, so the cost per lookup should stay flat as the
+ * inode count grows.
+ *
+ * Mount tfs with "-o attr_timeout=0,entry_timeout=0" so every stat() reaches
+ * the file system instead of the kernel's attribute cache.
+ *
+ * usage: ./inode_lookup [mountdir]
+ */
+
+/* Default TFS mount point, can be overridden on the command line */
+#define TESTDIR "/tmp/mountdir"
+
+#define ROUNDS 8
+#define FILES_PER_ROUND 100
+#define LOOKUPS 10000
+#define FSPATHLEN 256
+#define FILEPERM 0666
+#define DIRPERM 0755
+
+static double now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+
+	const char *testdir = argc > 1 ? argv[1] : TESTDIR;
+	char path[FSPATHLEN];
+	char probe[FSPATHLEN];
+	struct stat st;
+	int i, r, fd;
+
+	snprintf(probe, FSPATHLEN, "%s/probe", testdir);
+	if ((fd = creat(probe, FILEPERM)) < 0) {
+		perror("creat");
+		exit(1);
+	}
+	close(fd);
+
+	printf("%10s %14s\n", "inodes", "ns/lookup");
+
+	for (r = 0; r <= ROUNDS; r++) {
+
+		/* Allocate another batch of inodes away from the probe's directory */
+		if (r > 0) {
+			snprintf(path, FSPATHLEN, "%s/fill%d", testdir, r);
+			if (mkdir(path, DIRPERM) < 0) {
+				perror("mkdir");
+				exit(1);
+			}
+			for (i = 0; i < FILES_PER_ROUND; i++) {
+				snprintf(path, FSPATHLEN, "%s/fill%d/f%d", testdir, r, i);
+				if ((fd = creat(path, FILEPERM)) < 0) {
+					perror("creat");
+					exit(1);
+				}
+				close(fd);
+			}
+		}
+
+		double start = now_ns();
+		for (i = 0; i < LOOKUPS; i++) {
+			if (stat(probe, &st) < 0) {
+				perror("stat");
+				exit(1);
+			}
+		}
+		double elapsed = now_ns() - start;
+
+		printf("%10d %14.0f\n", 2 + r * (FILES_PER_ROUND + 1), elapsed / LOOKUPS);
+	}
+
+	printf("Benchmark completed \n");
+	return 0;
+}
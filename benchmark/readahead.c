@@ -0,0 +1,131 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "../block.h"
+#include "../readahead.h"
+
+/*
+ * Sequential readahead benchmark.
+ *
+ * Writes a file-sized range of blocks, drops it from the page cache, and
+ * streams it back cold the way tfs_read() does: 128KB requests through
+ * bio_readv(), each followed by a copy of the request into a reply buffer
+ * standing in for the copy to FUSE. It runs once with readahead off and once
+ * with the per-file window driving bio_prefetch(), so the prefetch thread
+ * reads the next blocks into the block cache while the copy happens.
+ * Kernel readahead on the disk file is turned off for both runs, so only the
+ * block layer reads ahead. Reports throughput, how many blocks were read
+ * ahead and how many of them a request then found in the cache.
+ *
+ * usage: ./readahead [diskfile] [MB]
+ */
+
+#define DISKFILE "/tmp/readahead.disk"
+#define DEFAULT_MB 64
+#define REQUEST_BLOCKS 32
+#define CACHE_MB 16
+#define WINDOW_KB DEFAULT_READAHEAD_KB
+
+static double now_sec() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//Evict the disk file from the page cache so the next reads reach the device
+static void drop_cache(const char *diskfile) {
+	int fd = open(diskfile, O_RDONLY);
+	if (fd >= 0) {
+		fdatasync(fd);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+}
+
+static double stream(const char *diskfile, int nblocks, int ra_on, char *reply) {
+	struct ra_state ra;
+	int block_nums[REQUEST_BLOCKS];
+	void *bufs[REQUEST_BLOCKS];
+	char *data = malloc((size_t)REQUEST_BLOCKS * BLOCK_SIZE);
+	uint32_t max = ra_on ? WINDOW_KB / (BLOCK_SIZE / 1024) : 0;
+	int i, j;
+
+	drop_cache(diskfile);
+	dev_open(diskfile);
+	bio_advise(0, nblocks, BIO_ADVICE_RANDOM);
+	bio_stats_reset();
+	ra_init(&ra);
+
+	double start = now_sec();
+	for (i = 0; i < nblocks; i += REQUEST_BLOCKS) {
+		uint32_t from;
+		uint32_t count = ra_advance(&ra, i, REQUEST_BLOCKS, max, nblocks, &from);
+		if (count > 0) {
+			bio_prefetch(from, count);
+		}
+
+		for (j = 0; j < REQUEST_BLOCKS; j++) {
+			block_nums[j] = i + j;
+			bufs[j] = data + (size_t)j * BLOCK_SIZE;
+		}
+		bio_readv(block_nums, bufs, REQUEST_BLOCKS);
+		memcpy(reply, data, (size_t)REQUEST_BLOCKS * BLOCK_SIZE);
+	}
+	double secs = now_sec() - start;
+
+	bio_stats(stdout);
+	ra_destroy(&ra);
+	dev_close();
+	free(data);
+	return secs;
+}
+
+int main(int argc, char **argv) {
+
+	const char *diskfile = argc > 1 ? argv[1] : DISKFILE;
+	int mb = argc > 2 ? atoi(argv[2]) : DEFAULT_MB;
+	int nblocks = mb * (1024 * 1024 / BLOCK_SIZE);
+	int block_nums[REQUEST_BLOCKS];
+	const void *bufs[REQUEST_BLOCKS];
+	int i, j;
+
+	char *data = malloc((size_t)REQUEST_BLOCKS * BLOCK_SIZE);
+	char *reply = malloc((size_t)REQUEST_BLOCKS * BLOCK_SIZE);
+	memset(data, 0x61, (size_t)REQUEST_BLOCKS * BLOCK_SIZE);
+
+	unlink(diskfile);
+	dev_set_size((uint64_t)mb * 1024 * 1024);
+	dev_set_cache_size(0);
+	dev_init(diskfile);
+	for (i = 0; i < nblocks; i += REQUEST_BLOCKS) {
+		for (j = 0; j < REQUEST_BLOCKS; j++) {
+			block_nums[j] = i + j;
+			bufs[j] = data + (size_t)j * BLOCK_SIZE;
+		}
+		bio_writev(block_nums, bufs, REQUEST_BLOCKS);
+	}
+	dev_close();
+
+	dev_set_cache_size((size_t)CACHE_MB * 1024 * 1024);
+	double off = stream(diskfile, nblocks, 0, reply);
+	double on = stream(diskfile, nblocks, 1, reply);
+
+	printf("%-10s %10s\n", "readahead", "MB/s");
+	printf("%-10s %10.1f\n", "off", mb / off);
+	printf("%-10s %10.1f\n", "on", mb / on);
+
+	for (i = 0; i < (size_t)REQUEST_BLOCKS * BLOCK_SIZE; i++) {
+		if (reply[i] != 0x61) {
+			printf("read back mismatch at byte %d\n", i);
+			exit(1);
+		}
+	}
+
+	unlink(diskfile);
+	printf("Benchmark completed \n");
+	return 0;
+}
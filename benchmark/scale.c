@@ -0,0 +1,222 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Scale test for large images.
+ *
+ * Fills a tfs mount until it runs out of space. First it writes DATA_FILE_SIZE
+ * files until the data region is full, then it creates empty files,
+ * FILES_PER_DIR to a directory, until there are no inodes left. The file
+ * system has to keep up bitmaps that span many blocks and inode numbers past
+ * 16 bits, and files have to read back intact afterwards. Progress and rates
+ * are printed as it goes; statfs() is checked at the start and the end.
+ *
+ * Format and mount a large image first, for example
+ *   ./tfs --mkfs -o disk_mb=204800,inodes=4000000
+ *   ./tfs -s /tmp/mountdir
+ *
+ * usage: ./scale [mountdir] [data|inodes|all]
+ */
+
+/* Default TFS mount point, can be overridden on the command line */
+#define TESTDIR "/tmp/mountdir"
+
+#define FSPATHLEN 256
+#define FILEPERM 0666
+#define DIRPERM 0755
+
+#define CHUNK_SIZE (1024 * 1024)
+#define DATA_FILE_SIZE (1024L * 1024 * 1024)
+#define FILES_PER_DIR 1000
+#define REPORT_EVERY 100000
+
+static double now_sec() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report_statfs(const char *testdir, const char *when) {
+	struct statvfs st;
+	if (statvfs(testdir, &st) < 0) {
+		perror("statvfs");
+		return;
+	}
+	printf("%s: %lu of %lu blocks free (%.1f GB), %lu of %lu inodes free\n", when,
+		(unsigned long)st.f_bfree, (unsigned long)st.f_blocks,
+		(double)st.f_bfree * st.f_frsize / (1024.0 * 1024 * 1024),
+		(unsigned long)st.f_ffree, (unsigned long)st.f_files);
+}
+
+/* Chunk c of data file f starts with its own coordinates so misplaced blocks show up */
+static void fill_chunk(char *buf, long f, long c) {
+	memset(buf, (int)((f + c) & 0xff), CHUNK_SIZE);
+	memcpy(buf, &f, sizeof(f));
+	memcpy(buf + sizeof(f), &c, sizeof(c));
+}
+
+/* Write data files until the disk is full, returns the number of files touched */
+static long fill_data(const char *testdir) {
+	char path[FSPATHLEN];
+	char *buf = malloc(CHUNK_SIZE);
+	long f, c, written = 0;
+	double start = now_sec();
+
+	sprintf(path, "%s/data", testdir);
+	if (mkdir(path, DIRPERM) < 0 && errno != EEXIST) {
+		perror("mkdir data");
+		exit(1);
+	}
+
+	for (f = 0; ; f++) {
+		sprintf(path, "%s/data/f%ld", testdir, f);
+		int fd = open(path, O_CREAT | O_WRONLY, FILEPERM);
+		if (fd < 0) {
+			if (errno != ENOSPC)
+				perror("open data file");
+			break;
+		}
+		for (c = 0; c < DATA_FILE_SIZE / CHUNK_SIZE; c++) {
+			fill_chunk(buf, f, c);
+			ssize_t n = write(fd, buf, CHUNK_SIZE);
+			if (n > 0)
+				written += n;
+			if (n != CHUNK_SIZE)
+				break;
+		}
+		close(fd);
+		printf("  data file %ld, %.1f GB written, %.1f MB/s\n", f,
+			written / (1024.0 * 1024 * 1024), written / (1024.0 * 1024) / (now_sec() - start));
+		if (c < DATA_FILE_SIZE / CHUNK_SIZE)
+			break;
+	}
+
+	printf("data: %.1f GB in %ld files, %.1f s\n", written / (1024.0 * 1024 * 1024), f + 1, now_sec() - start);
+	free(buf);
+	return f + 1;
+}
+
+/* Read back the first and last chunk of every data file */
+static int verify_data(const char *testdir, long nfiles) {
+	char path[FSPATHLEN];
+	char *want = malloc(CHUNK_SIZE);
+	char *got = malloc(CHUNK_SIZE);
+	struct stat st;
+	long f, bad = 0;
+
+	for (f = 0; f < nfiles; f++) {
+		sprintf(path, "%s/data/f%ld", testdir, f);
+		int fd = open(path, O_RDONLY);
+		if (fd < 0 || fstat(fd, &st) < 0) {
+			bad++;
+			continue;
+		}
+		long last = st.st_size / CHUNK_SIZE - 1;
+		long c;
+		for (c = 0; c <= last; c += last > 0 ? last : 1) {
+			fill_chunk(want, f, c);
+			if (pread(fd, got, CHUNK_SIZE, (off_t)c * CHUNK_SIZE) != CHUNK_SIZE ||
+				memcmp(want, got, CHUNK_SIZE) != 0) {
+				printf("data file %ld chunk %ld does not match\n", f, c);
+				bad++;
+				break;
+			}
+		}
+		close(fd);
+	}
+
+	free(want);
+	free(got);
+	return bad;
+}
+
+/* Create empty files until the inodes run out, returns the number created */
+static long fill_inodes(const char *testdir) {
+	char path[FSPATHLEN];
+	long n = 0;
+	double start = now_sec(), last = start;
+
+	for (;;) {
+		if (n % FILES_PER_DIR == 0) {
+			sprintf(path, "%s/d%ld", testdir, n / FILES_PER_DIR);
+			if (mkdir(path, DIRPERM) < 0 && errno != EEXIST) {
+				if (errno != ENOSPC)
+					perror("mkdir");
+				break;
+			}
+		}
+		sprintf(path, "%s/d%ld/f%ld", testdir, n / FILES_PER_DIR, n % FILES_PER_DIR);
+		int fd = open(path, O_CREAT | O_WRONLY, FILEPERM);
+		if (fd < 0) {
+			if (errno != ENOSPC)
+				perror("create");
+			break;
+		}
+		close(fd);
+		n++;
+
+		if (n % REPORT_EVERY == 0) {
+			double t = now_sec();
+			printf("  %ld files, %.0f creates/s\n", n, REPORT_EVERY / (t - last));
+			last = t;
+		}
+	}
+
+	printf("inodes: %ld files in %ld directories, %.1f s\n", n,
+		(n + FILES_PER_DIR - 1) / FILES_PER_DIR, now_sec() - start);
+	return n;
+}
+
+/* stat() a sample of the created files, including the last one */
+static int verify_inodes(const char *testdir, long n) {
+	char path[FSPATHLEN];
+	struct stat st;
+	long i, bad = 0;
+	long step = n / 1000 + 1;
+
+	for (i = 0; i < n; i += step) {
+		sprintf(path, "%s/d%ld/f%ld", testdir, i / FILES_PER_DIR, i % FILES_PER_DIR);
+		if (stat(path, &st) < 0)
+			bad++;
+	}
+	if (n > 0) {
+		sprintf(path, "%s/d%ld/f%ld", testdir, (n - 1) / FILES_PER_DIR, (n - 1) % FILES_PER_DIR);
+		if (stat(path, &st) < 0)
+			bad++;
+	}
+	return bad;
+}
+
+int main(int argc, char **argv) {
+	const char *testdir = argc > 1 ? argv[1] : TESTDIR;
+	const char *what = argc > 2 ? argv[2] : "all";
+	int bad = 0;
+
+	report_statfs(testdir, "start");
+
+	if (strcmp(what, "data") == 0 || strcmp(what, "all") == 0) {
+		long nfiles = fill_data(testdir);
+		report_statfs(testdir, "data full");
+		bad += verify_data(testdir, nfiles);
+	}
+
+	if (strcmp(what, "inodes") == 0 || strcmp(what, "all") == 0) {
+		long n = fill_inodes(testdir);
+		report_statfs(testdir, "inodes full");
+		bad += verify_inodes(testdir, n);
+	}
+
+	if (bad) {
+		printf("%d checks failed\n", bad);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}
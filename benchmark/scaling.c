@@ -0,0 +1,164 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/*
+ * Multithreaded scaling benchmark.
+ *
+ * Runs 1, 2, 4 and 8 client threads against a tfs mount. Each thread works in
+ * its own directory, repeatedly creating a file, writing and reading it back,
+ * stat()ing it and unlinking it, and a shared directory sees a create from
+ * every round so directory locking is exercised too. The high-level FUSE loop
+ * starts a worker thread per outstanding request, so N busy clients keep N
+ * FUSE threads busy. Reports operations per second and the speedup over one
+ * thread.
+ *
+ * Mount tfs multithreaded (without -s) and with
+ * "-o attr_timeout=0,entry_timeout=0" so every operation reaches the file
+ * system. Running it against a "-s" mount gives the single-threaded baseline.
+ *
+ * usage: ./scaling [mountdir] [rounds]
+ */
+
+/* Default TFS mount point, can be overridden on the command line */
+#define TESTDIR "/tmp/mountdir"
+
+#define DEFAULT_ROUNDS 200
+#define MAX_THREADS 8
+#define FILE_SIZE (16 * 1024)
+#define FSPATHLEN 256
+#define FILEPERM 0666
+#define DIRPERM 0755
+
+/* open, write, close, open, read, close, stat, unlink, then creat and close in the shared directory */
+#define OPS_PER_ROUND 10
+
+struct worker {
+	pthread_t thread;
+	const char *testdir;
+	int id;
+	int pass;
+	int rounds;
+	int failed;
+};
+
+static double now_sec() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *run_worker(void *arg) {
+	struct worker *w = arg;
+	char path[FSPATHLEN];
+	char *buf = malloc(FILE_SIZE);
+	char *rbuf = malloc(FILE_SIZE);
+	struct stat st;
+	int r, fd;
+
+	memset(buf, 'a' + w->id, FILE_SIZE);
+
+	for (r = 0; r < w->rounds; r++) {
+		snprintf(path, FSPATHLEN, "%s/p%d_t%d/file", w->testdir, w->pass, w->id);
+
+		if ((fd = open(path, O_CREAT | O_WRONLY, FILEPERM)) < 0 || write(fd, buf, FILE_SIZE) != FILE_SIZE) {
+			perror("write");
+			w->failed = 1;
+			break;
+		}
+		close(fd);
+
+		if ((fd = open(path, O_RDONLY)) < 0 || read(fd, rbuf, FILE_SIZE) != FILE_SIZE) {
+			perror("read");
+			w->failed = 1;
+			break;
+		}
+		close(fd);
+		if (memcmp(buf, rbuf, FILE_SIZE) != 0) {
+			fprintf(stderr, "thread %d: data mismatch\n", w->id);
+			w->failed = 1;
+			break;
+		}
+
+		if (stat(path, &st) < 0 || unlink(path) < 0) {
+			perror("stat/unlink");
+			w->failed = 1;
+			break;
+		}
+
+		snprintf(path, FSPATHLEN, "%s/p%d_shared/t%d_%d", w->testdir, w->pass, w->id, r);
+		if ((fd = creat(path, FILEPERM)) < 0) {
+			perror("creat");
+			w->failed = 1;
+			break;
+		}
+		close(fd);
+	}
+
+	free(buf);
+	free(rbuf);
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+
+	const char *testdir = argc > 1 ? argv[1] : TESTDIR;
+	int rounds = argc > 2 ? atoi(argv[2]) : DEFAULT_ROUNDS;
+	int counts[] = { 1, 2, 4, 8 };
+	struct worker workers[MAX_THREADS];
+	char path[FSPATHLEN];
+	double base = 0;
+	int c, i;
+
+	printf("%8s %12s %10s\n", "threads", "ops/sec", "speedup");
+
+	for (c = 0; c < 4; c++) {
+		int nthreads = counts[c];
+
+		/* Fresh directories for every pass */
+		snprintf(path, FSPATHLEN, "%s/p%d_shared", testdir, c);
+		if (mkdir(path, DIRPERM) < 0) {
+			perror("mkdir");
+			exit(1);
+		}
+		for (i = 0; i < nthreads; i++) {
+			snprintf(path, FSPATHLEN, "%s/p%d_t%d", testdir, c, i);
+			if (mkdir(path, DIRPERM) < 0) {
+				perror("mkdir");
+				exit(1);
+			}
+		}
+
+		double start = now_sec();
+		for (i = 0; i < nthreads; i++) {
+			workers[i].testdir = testdir;
+			workers[i].id = i;
+			workers[i].pass = c;
+			workers[i].rounds = rounds;
+			workers[i].failed = 0;
+			pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+		}
+		for (i = 0; i < nthreads; i++) {
+			pthread_join(workers[i].thread, NULL);
+			if (workers[i].failed) {
+				exit(1);
+			}
+		}
+		double elapsed = now_sec() - start;
+
+		double ops = (double)nthreads * rounds * OPS_PER_ROUND / elapsed;
+		if (c == 0) {
+			base = ops;
+		}
+		printf("%8d %12.0f %9.2fx\n", nthreads, ops, ops / base);
+	}
+
+	printf("Benchmark completed \n");
+	return 0;
+}
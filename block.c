@@ -14,16 +14,190 @@
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdint.h>
 
-#include "block.h"
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE	/* linux/fs.h has its own, ours comes from block.h */
+#define BIO_HAVE_URING
+#endif
+#endif
 
-//Disk size set to 32MB
-#define DISK_SIZE	32*1024*1024
+#include "block.h"
 
 int diskfile = -1;
 
+//Size dev_init() gives a new disk file, see dev_set_size()
+uint64_t disk_size = DEFAULT_DISK_SIZE;
+
+/*
+ * Block buffer cache. bio_read()/bio_write() go through a write-back cache
+ * of BLOCK_SIZE buffers split into CACHE_SHARDS shards by block number, each
+ * with its own lock, hash table and CLOCK hand, so concurrent callers only
+ * contend when they touch the same shard. Dirty buffers reach the disk file
+ * when they are evicted or on bio_sync().
+ */
+#define CACHE_SHARDS	16
+
+struct cache_buf {
+	int					block_num;	/* cached block, -1 if the buffer is free */
+	int					dirty;		/* newer than the disk file */
+	int					referenced;	/* CLOCK second-chance bit */
+	int					filling;	/* being read in by the prefetch thread */
+	int					prefetched;	/* read ahead and not used yet */
+	char				*data;		/* BLOCK_SIZE bytes inside cache_mem */
+	struct cache_buf	*next;		/* hash bucket chain */
+};
+
+struct cache_shard {
+	pthread_mutex_t		lock;
+	struct cache_buf	*bufs;
+	int					nbufs;
+	int					hand;
+	struct cache_buf	**buckets;
+	int					nbuckets;
+	int					nfilling;	/* buffers with filling set */
+	pthread_cond_t		filled;		/* broadcast when a prefetch completes */
+	unsigned long		hits;
+	unsigned long		misses;
+	unsigned long		evictions;
+	unsigned long		writebacks;
+};
+
+size_t cache_size = DEFAULT_CACHE_SIZE;
+char *cache_mem = NULL;
+struct cache_shard cache_shards[CACHE_SHARDS];
+int cache_enabled = 0;
+
+//Most buffers handed to one preadv/pwritev (Linux UIO_MAXIOV)
+#define BIO_IOV_MAX	1024
+
+//Number of read/write system calls issued against the disk file
+unsigned long bio_syscalls = 0;
+
+/*
+ * Block-layer counters, kept by the bio_read/bio_write entry points whatever
+ * the backend. Blocks moved through bio_readv()/bio_writev() count one op per
+ * block; time is spent inside the call, cache hits included. Updated with
+ * relaxed atomics so concurrent callers never wait on them.
+ */
+struct bio_counters {
+	unsigned long	reads;
+	unsigned long	writes;
+	unsigned long	read_bytes;
+	unsigned long	write_bytes;
+	unsigned long	read_ns;
+	unsigned long	write_ns;
+	unsigned long	prefetched;		/* blocks read into the cache ahead of use */
+	unsigned long	prefetch_hits;	/* of those, blocks a read then found there */
+	unsigned long	prefetch_dropped;	/* bio_prefetch() calls refused, queue full */
+} __attribute__((aligned(64)));
+
+struct bio_counters bio_counters;
+
+/*
+ * Memory-mapped backend. With BIO_BACKEND_MMAP the whole disk file is mapped
+ * at open time: block reads and writes become memcpy()s to and from the
+ * mapping, bio_map() hands out pointers into it, and bio_sync() msync()s it.
+ * The kernel page cache does the caching, so the block cache is not used.
+ * Blocks past the end of the mapping fall back to pread/pwrite.
+ */
+int backend = BIO_BACKEND_PREAD;
+char *disk_map = NULL;
+size_t disk_map_len = 0;
+
+/*
+ * io_uring backend. With BIO_BACKEND_URING a submission/completion ring is
+ * set up at open time (raw system calls, no liburing) and bio_submit() queues
+ * any number of block requests with a single io_uring_enter(). The block
+ * cache stays in front of it, and its slab is registered as a fixed buffer
+ * so write-back uses READ_FIXED/WRITE_FIXED without per-I/O page pinning.
+ * Without kernel support everything falls back to pread/pwrite.
+ *
+ * The ring is shared by all threads: lock covers the SQ, and one thread at a
+ * time (the reaper) waits in the kernel for completions, marking the
+ * bio_reqs they belong to done and waking the other waiters.
+ */
+#define BIO_URING_DEPTH	256
+
+struct bio_uring {
+	int						fd;			/* ring fd, -1 when not in use */
+	unsigned				*sq_head;
+	unsigned				*sq_tail;
+	unsigned				sq_mask;
+	unsigned				sq_entries;
+	unsigned				*sq_array;
+	unsigned				*cq_head;
+	unsigned				*cq_tail;
+	unsigned				cq_mask;
+	unsigned				cq_entries;
+	struct io_uring_sqe		*sqes;
+	struct io_uring_cqe		*cqes;
+	void					*sq_ring;
+	void					*cq_ring;
+	size_t					sq_ring_len;
+	size_t					cq_ring_len;
+	size_t					sqes_len;
+	char					*fixed;		/* registered buffer (the cache slab) or NULL */
+	size_t					fixed_len;
+	unsigned				inflight;	/* submitted, not yet reaped */
+	int						reaping;	/* a thread is waiting in the kernel */
+	pthread_mutex_t			lock;
+	pthread_cond_t			reaped;
+};
+
+#ifdef BIO_HAVE_URING
+struct bio_uring uring = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER, .reaped = PTHREAD_COND_INITIALIZER };
+#else
+struct bio_uring uring = { .fd = -1 };
+#endif
+
+/*
+ * Prefetch thread. bio_prefetch() queues runs of blocks that a caller expects
+ * to read soon; one background thread claims cache buffers for the ones not
+ * cached yet, marking them filling, and reads each run into them with a
+ * single preadv while the caller goes on. A reader or writer that finds a
+ * filling buffer waits on the shard's filled condition. At most half the
+ * buffers of a shard are ever filling, so cache_alloc() has a victim unless
+ * write-backs fail; then the prefetch is given up.
+ * When the queue is full requests are dropped: readahead is only a hint.
+ */
+#define PREFETCH_QUEUE	64
+
+struct prefetch_req {
+	int		block_num;
+	int		count;
+};
+
+struct prefetch_queue {
+	pthread_mutex_t		lock;
+	pthread_cond_t		wake;
+	struct prefetch_req	reqs[PREFETCH_QUEUE];
+	unsigned			head;		/* next request to run */
+	unsigned			tail;		/* next free slot */
+	int					running;	/* the thread is started */
+	int					stop;
+	pthread_t			thread;
+};
+
+struct prefetch_queue prefetch = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+static void cache_init();
+static void cache_free();
+static void prefetch_start();
+static void prefetch_stop();
+static void dev_setup();
+static void uring_init();
+static void uring_exit();
+
 //Creates a file which is your new emulated disk
 void dev_init(const char* diskfile_path) {
     if (diskfile >= 0) {
@@ -36,7 +210,13 @@ void dev_init(const char* diskfile_path) {
 		exit(EXIT_FAILURE);
     }
 	
-    ftruncate(diskfile, DISK_SIZE);
+    // drop whatever an earlier disk file held, then grow it back sparse so
+    // every block reads as zeros until it is written
+    if (ftruncate(diskfile, 0) < 0 || ftruncate(diskfile, (off_t)disk_size) < 0) {
+		perror("disk resize failed");
+		exit(EXIT_FAILURE);
+    }
+    dev_setup();
 }
 
 //Function to open the disk file
@@ -50,22 +230,700 @@ int dev_open(const char* diskfile_path) {
 		perror("disk_open failed");
 		return -1;
     }
+    dev_setup();
 	return 0;
 }
 
 void dev_close() {
     if (diskfile >= 0) {
+		prefetch_stop();
+		bio_sync();
+		uring_exit();
+		cache_free();
+		if (disk_map != NULL) {
+			munmap(disk_map, disk_map_len);
+			disk_map = NULL;
+		}
 		close(diskfile);
+		diskfile = -1;
     }
 }
 
+//Choose how the disk file is accessed (BIO_BACKEND_PREAD, _MMAP or _URING).
+//Takes effect the next time the disk file is opened.
+void dev_set_backend(int which) {
+	backend = which;
+}
+
+//Set up the selected backend on a freshly opened disk file
+static void dev_setup() {
+	struct stat st;
+
+	if (backend == BIO_BACKEND_MMAP && fstat(diskfile, &st) == 0 && st.st_size > 0) {
+		disk_map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, diskfile, 0);
+		if (disk_map == MAP_FAILED) {
+			perror("disk mmap failed, using pread");
+			disk_map = NULL;
+		} else {
+			disk_map_len = st.st_size;
+			// metadata access is scattered: skip the kernel's readaround by default
+			madvise(disk_map, disk_map_len, MADV_RANDOM);
+			return;
+		}
+	}
+	cache_init();
+	if (backend == BIO_BACKEND_URING) {
+		uring_init();
+	}
+	prefetch_start();
+}
+
+//Pointer to block_num inside the disk mapping, or NULL when the block is not mapped
+//(pread backend, or past the end of the mapping). Valid until dev_close().
+void *bio_map(const int block_num) {
+	if (disk_map == NULL || block_num < 0 || (size_t)(block_num + 1) * BLOCK_SIZE > disk_map_len) {
+		return NULL;
+	}
+	return disk_map + (size_t)block_num * BLOCK_SIZE;
+}
+
+//Tell the kernel how count blocks starting at block_num are about to be used
+//(BIO_ADVICE_*). madvise() on the mapping, posix_fadvise() for the pread backend.
+void bio_advise(const int block_num, int count, int advice) {
+	static const int madv[] = { MADV_NORMAL, MADV_RANDOM, MADV_SEQUENTIAL, MADV_WILLNEED };
+	static const int fadv[] = { POSIX_FADV_NORMAL, POSIX_FADV_RANDOM, POSIX_FADV_SEQUENTIAL, POSIX_FADV_WILLNEED };
+
+	if (advice < BIO_ADVICE_NORMAL || advice > BIO_ADVICE_WILLNEED || count <= 0) {
+		return;
+	}
+
+	char *start = bio_map(block_num);
+	if (start != NULL) {
+		size_t len = (size_t)count * BLOCK_SIZE;
+		if (start + len > disk_map + disk_map_len) {
+			len = disk_map + disk_map_len - start;
+		}
+		madvise(start, len, madv[advice]);
+	} else if (diskfile >= 0) {
+		posix_fadvise(diskfile, (off_t)block_num * BLOCK_SIZE, (off_t)count * BLOCK_SIZE, fadv[advice]);
+	}
+}
+
+//Set the size in bytes of the disk file created by dev_init().
+//The file is sparse, so only blocks that get written take space.
+void dev_set_size(uint64_t bytes) {
+	disk_size = bytes;
+}
+
+//Size of the open disk file in blocks, 0 if it is not open
+uint64_t dev_blocks() {
+	struct stat st;
+	if (diskfile < 0 || fstat(diskfile, &st) < 0) {
+		return 0;
+	}
+	return (uint64_t)st.st_size / BLOCK_SIZE;
+}
+
+//Set the memory budget of the block cache in bytes, 0 disables it.
+//Takes effect the next time the disk file is opened.
+void dev_set_cache_size(size_t bytes) {
+	cache_size = bytes;
+}
+
+/* -----------------
+ * block cache
+ -------------------*/
+
+static void cache_init() {
+	int nbufs = cache_size / BLOCK_SIZE;
+	int perShard = nbufs / CACHE_SHARDS;
+	int i, j;
+
+	if (cache_enabled || perShard == 0) {
+		return;
+	}
+
+	// one slab for all buffers, carved up between the shards
+	cache_mem = malloc((size_t)perShard * CACHE_SHARDS * BLOCK_SIZE);
+	if (cache_mem == NULL) {
+		perror("block cache allocation failed");
+		return;
+	}
+
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		struct cache_shard *shard = &cache_shards[i];
+		memset(shard, 0, sizeof(struct cache_shard));
+		pthread_mutex_init(&shard->lock, NULL);
+		pthread_cond_init(&shard->filled, NULL);
+
+		shard->nbufs = perShard;
+		shard->bufs = calloc(perShard, sizeof(struct cache_buf));
+		shard->nbuckets = 2 * perShard;
+		shard->buckets = calloc(shard->nbuckets, sizeof(struct cache_buf *));
+
+		for (j = 0; j < perShard; j++) {
+			shard->bufs[j].block_num = -1;
+			shard->bufs[j].data = cache_mem + ((size_t)i * perShard + j) * BLOCK_SIZE;
+		}
+	}
+	cache_enabled = 1;
+}
+
+static void cache_free() {
+	int i;
+
+	if (!cache_enabled) {
+		return;
+	}
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		free(cache_shards[i].bufs);
+		free(cache_shards[i].buckets);
+		pthread_mutex_destroy(&cache_shards[i].lock);
+		pthread_cond_destroy(&cache_shards[i].filled);
+	}
+	free(cache_mem);
+	cache_mem = NULL;
+	cache_enabled = 0;
+}
+
+static struct cache_shard *cache_shard_of(int block_num) {
+	return &cache_shards[block_num % CACHE_SHARDS];
+}
+
+static struct cache_buf **cache_bucket(struct cache_shard *shard, int block_num) {
+	return &shard->buckets[(block_num / CACHE_SHARDS) % shard->nbuckets];
+}
+
+static struct cache_buf *cache_lookup(struct cache_shard *shard, int block_num) {
+	struct cache_buf *buf;
+	for (buf = *cache_bucket(shard, block_num); buf != NULL; buf = buf->next) {
+		if (buf->block_num == block_num) {
+			return buf;
+		}
+	}
+	return NULL;
+}
+
+//cache_lookup() for callers that use the buffer's data: if the prefetch thread is
+//still reading the block in, wait until it is done. Called with the shard lock held.
+static struct cache_buf *cache_lookup_filled(struct cache_shard *shard, int block_num) {
+	struct cache_buf *buf;
+	while ((buf = cache_lookup(shard, block_num)) != NULL && buf->filling) {
+		pthread_cond_wait(&shard->filled, &shard->lock);
+	}
+	return buf;
+}
+
+//Count a hit on a buffer, and the first hit on a prefetched one. Called with the shard lock held.
+static void cache_hit(struct cache_shard *shard, struct cache_buf *buf) {
+	shard->hits++;
+	buf->referenced = 1;
+	if (buf->prefetched) {
+		buf->prefetched = 0;
+		__atomic_fetch_add(&bio_counters.prefetch_hits, 1, __ATOMIC_RELAXED);
+	}
+}
+
+//Take buf out of its hash chain. Called with the shard lock held.
+static void cache_unhash(struct cache_shard *shard, struct cache_buf *buf) {
+	struct cache_buf **link = cache_bucket(shard, buf->block_num);
+	while (*link != buf) {
+		link = &(*link)->next;
+	}
+	*link = buf->next;
+	buf->block_num = -1;
+}
+
+static int cache_writeback(struct cache_shard *shard, struct cache_buf *buf) {
+	int retstat = pwrite(diskfile, buf->data, BLOCK_SIZE, (off_t)buf->block_num * BLOCK_SIZE);
+	__atomic_fetch_add(&bio_syscalls, 1, __ATOMIC_RELAXED);
+	if (retstat < 0) {
+		perror("block_write failed");
+		return retstat;
+	}
+	buf->dirty = 0;
+	shard->writebacks++;
+	return retstat;
+}
+
+//Find a buffer to hold block_num in the shard, evicting with CLOCK. A dirty victim
+//that can't be written back stays cached and another one is tried; returns NULL if
+//every buffer of the shard failed that way. Called with the shard lock held.
+static struct cache_buf *cache_alloc(struct cache_shard *shard, int block_num) {
+	struct cache_buf *buf;
+	struct cache_buf **link;
+	int failed = 0;
+
+	for (;;) {
+		buf = &shard->bufs[shard->hand];
+		shard->hand = (shard->hand + 1) % shard->nbufs;
+
+		if (buf->block_num < 0) {
+			break;
+		}
+		if (buf->filling) {
+			continue;
+		}
+		if (buf->referenced) {
+			buf->referenced = 0;
+			continue;
+		}
+
+		if (buf->dirty && cache_writeback(shard, buf) < 0) {
+			if (++failed >= shard->nbufs) {
+				return NULL;
+			}
+			continue;
+		}
+		cache_unhash(shard, buf);
+		shard->evictions++;
+		break;
+	}
+
+	link = cache_bucket(shard, block_num);
+	buf->block_num = block_num;
+	buf->dirty = 0;
+	buf->referenced = 1;
+	buf->prefetched = 0;
+	buf->next = *link;
+	*link = buf;
+	return buf;
+}
+
+/* -----------------
+ * io_uring
+ -------------------*/
+
+#ifdef BIO_HAVE_URING
+
+static int uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+	int ret = syscall(__NR_io_uring_enter, uring.fd, to_submit, min_complete, flags, NULL, 0);
+	__atomic_fetch_add(&bio_syscalls, 1, __ATOMIC_RELAXED);
+	return ret;
+}
+
+//Set up the ring on the open disk file. Leaves uring.fd at -1 (pread fallback) if
+//the kernel refuses.
+static void uring_init() {
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	int fd = syscall(__NR_io_uring_setup, BIO_URING_DEPTH, &p);
+	if (fd < 0) {
+		perror("io_uring unavailable, using pread");
+		return;
+	}
+
+	// Step 1: Map the SQ and CQ rings (one mapping on kernels that share it) and the SQEs
+	uring.sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	uring.cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (uring.cq_ring_len > uring.sq_ring_len) {
+			uring.sq_ring_len = uring.cq_ring_len;
+		}
+		uring.cq_ring_len = uring.sq_ring_len;
+	}
+	uring.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	uring.sq_ring = mmap(NULL, uring.sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		uring.cq_ring = uring.sq_ring;
+	} else {
+		uring.cq_ring = mmap(NULL, uring.cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	}
+	uring.sqes = mmap(NULL, uring.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (uring.sq_ring == MAP_FAILED || uring.cq_ring == MAP_FAILED || uring.sqes == MAP_FAILED) {
+		perror("io_uring mmap failed, using pread");
+		if (uring.sq_ring != MAP_FAILED) {
+			munmap(uring.sq_ring, uring.sq_ring_len);
+		}
+		if (uring.cq_ring != MAP_FAILED && uring.cq_ring != uring.sq_ring) {
+			munmap(uring.cq_ring, uring.cq_ring_len);
+		}
+		if (uring.sqes != MAP_FAILED) {
+			munmap(uring.sqes, uring.sqes_len);
+		}
+		close(fd);
+		return;
+	}
+
+	char *sq = uring.sq_ring;
+	char *cq = uring.cq_ring;
+	uring.sq_head = (unsigned *)(sq + p.sq_off.head);
+	uring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	uring.sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	uring.sq_entries = p.sq_entries;
+	uring.sq_array = (unsigned *)(sq + p.sq_off.array);
+	uring.cq_head = (unsigned *)(cq + p.cq_off.head);
+	uring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	uring.cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	uring.cq_entries = p.cq_entries;
+	uring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	uring.inflight = 0;
+	uring.reaping = 0;
+	uring.fd = fd;
+
+	// Step 2: Register the block cache slab so write-back and cache fills can use fixed buffers
+	uring.fixed = NULL;
+	if (cache_enabled) {
+		struct iovec iov = { cache_mem, (size_t)cache_shards[0].nbufs * CACHE_SHARDS * BLOCK_SIZE };
+		if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0) {
+			uring.fixed = iov.iov_base;
+			uring.fixed_len = iov.iov_len;
+		}
+	}
+}
+
+static void uring_exit() {
+	if (uring.fd < 0) {
+		return;
+	}
+	munmap(uring.sqes, uring.sqes_len);
+	if (uring.cq_ring != uring.sq_ring) {
+		munmap(uring.cq_ring, uring.cq_ring_len);
+	}
+	munmap(uring.sq_ring, uring.sq_ring_len);
+	close(uring.fd);
+	uring.fd = -1;
+	uring.fixed = NULL;
+}
+
+//Mark every completion in the CQ done. Called with uring.lock held.
+static void uring_reap() {
+	unsigned head = *uring.cq_head;
+	unsigned tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &uring.cqes[head & uring.cq_mask];
+		struct bio_req *req = (struct bio_req *)(uintptr_t)cqe->user_data;
+
+		req->result = cqe->res;
+		if (cqe->res < 0) {
+			fprintf(stderr, "%s failed: %s\n", req->write ? "block_write" : "block_read", strerror(-cqe->res));
+		} else if (!req->write && cqe->res < BLOCK_SIZE) {
+			// short read at the end of the disk file
+			memset((char *)req->buf + cqe->res, 0, BLOCK_SIZE - cqe->res);
+			req->result = BLOCK_SIZE;
+		}
+		__atomic_store_n(&req->done, 1, __ATOMIC_RELEASE);
+		uring.inflight--;
+		head++;
+	}
+	__atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+//Wait for at least one more completion. Called with uring.lock held; one thread
+//sleeps in the kernel while the others wait for it on the condition variable.
+static void uring_wait_locked() {
+	if (uring.reaping) {
+		pthread_cond_wait(&uring.reaped, &uring.lock);
+		return;
+	}
+
+	uring.reaping = 1;
+	if (*uring.cq_head == __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_unlock(&uring.lock);
+		uring_enter(0, 1, IORING_ENTER_GETEVENTS);
+		pthread_mutex_lock(&uring.lock);
+	}
+	uring_reap();
+	uring.reaping = 0;
+	pthread_cond_broadcast(&uring.reaped);
+}
+
+//Queue one request in the SQ. Called with uring.lock held and a free SQ slot.
+static void uring_queue(struct bio_req *req) {
+	unsigned tail = *uring.sq_tail;
+	unsigned index = tail & uring.sq_mask;
+	struct io_uring_sqe *sqe = &uring.sqes[index];
+	char *buf = req->buf;
+
+	memset(sqe, 0, sizeof(*sqe));
+	if (uring.fixed != NULL && buf >= uring.fixed && buf + BLOCK_SIZE <= uring.fixed + uring.fixed_len) {
+		sqe->opcode = req->write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->buf_index = 0;
+	} else {
+		sqe->opcode = req->write ? IORING_OP_WRITE : IORING_OP_READ;
+	}
+	sqe->fd = diskfile;
+	sqe->off = (off_t)req->block_num * BLOCK_SIZE;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = BLOCK_SIZE;
+	sqe->user_data = (uintptr_t)req;
+
+	uring.sq_array[index] = index;
+	__atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+#else
+
+static void uring_init() {
+	fprintf(stderr, "io_uring not supported by this build, using pread\n");
+}
+
+static void uring_exit() {
+}
+
+#endif
+
+//Start count block requests without waiting for them. With the io_uring backend they
+//are queued and handed to the kernel with one io_uring_enter() per ring's worth;
+//otherwise each one is carried out right away through bio_read()/bio_write().
+//reqs must stay in place until bio_wait() returns for them.
+int bio_submit(struct bio_req *reqs, int count) {
+	int i;
+
+#ifdef BIO_HAVE_URING
+	if (uring.fd >= 0) {
+		int queued = 0;
+
+		pthread_mutex_lock(&uring.lock);
+		for (i = 0; i < count; i++) {
+			reqs[i].done = 0;
+			reqs[i].result = 0;
+
+			// keep completions within what the CQ can hold
+			while (uring.inflight >= uring.cq_entries) {
+				if (queued) {
+					uring_enter(queued, 0, 0);
+					queued = 0;
+				}
+				uring_wait_locked();
+			}
+			if (queued == (int)uring.sq_entries) {
+				uring_enter(queued, 0, 0);
+				queued = 0;
+			}
+			uring_queue(&reqs[i]);
+			uring.inflight++;
+			queued++;
+		}
+		if (queued) {
+			uring_enter(queued, 0, 0);
+		}
+		pthread_mutex_unlock(&uring.lock);
+		return 0;
+	}
+#endif
+
+	for (i = 0; i < count; i++) {
+		reqs[i].result = reqs[i].write ? bio_write(reqs[i].block_num, reqs[i].buf) : bio_read(reqs[i].block_num, reqs[i].buf);
+		reqs[i].done = 1;
+	}
+	return 0;
+}
+
+//Wait until every one of count submitted requests has completed. Returns -1 if any of
+//them failed (its result is then negative), 0 otherwise.
+int bio_wait(struct bio_req *reqs, int count) {
+	int i;
+	int retstat = 0;
+
+#ifdef BIO_HAVE_URING
+	if (uring.fd >= 0) {
+		pthread_mutex_lock(&uring.lock);
+		for (i = 0; i < count; i++) {
+			while (!__atomic_load_n(&reqs[i].done, __ATOMIC_ACQUIRE)) {
+				uring_wait_locked();
+			}
+		}
+		pthread_mutex_unlock(&uring.lock);
+	}
+#endif
+
+	for (i = 0; i < count; i++) {
+		if (reqs[i].result < 0) {
+			retstat = -1;
+		}
+	}
+	return retstat;
+}
+
+//Write every dirty cached block to the disk file and flush it to stable storage
+int bio_sync() {
+	int i, j;
+	int retstat = 0;
+
+	if (diskfile < 0) {
+		return -1;
+	}
+
+	if (cache_enabled && uring.fd >= 0) {
+		// queue every dirty buffer at once, holding all shards (always in index order)
+		struct bio_req *reqs = malloc((size_t)cache_shards[0].nbufs * CACHE_SHARDS * sizeof(struct bio_req));
+		struct cache_buf **dirty = malloc((size_t)cache_shards[0].nbufs * CACHE_SHARDS * sizeof(struct cache_buf *));
+		int count = 0;
+
+		for (i = 0; i < CACHE_SHARDS; i++) {
+			pthread_mutex_lock(&cache_shards[i].lock);
+			for (j = 0; j < cache_shards[i].nbufs; j++) {
+				struct cache_buf *buf = &cache_shards[i].bufs[j];
+				if (buf->block_num >= 0 && buf->dirty) {
+					reqs[count].block_num = buf->block_num;
+					reqs[count].buf = buf->data;
+					reqs[count].write = 1;
+					dirty[count++] = buf;
+				}
+			}
+		}
+		bio_submit(reqs, count);
+		if (bio_wait(reqs, count) < 0) {
+			retstat = -1;
+		}
+		for (j = 0; j < count; j++) {
+			if (reqs[j].result == BLOCK_SIZE) {
+				dirty[j]->dirty = 0;
+				cache_shard_of(dirty[j]->block_num)->writebacks++;
+			}
+		}
+		for (i = CACHE_SHARDS - 1; i >= 0; i--) {
+			pthread_mutex_unlock(&cache_shards[i].lock);
+		}
+		free(reqs);
+		free(dirty);
+	} else if (cache_enabled) {
+		for (i = 0; i < CACHE_SHARDS; i++) {
+			struct cache_shard *shard = &cache_shards[i];
+			pthread_mutex_lock(&shard->lock);
+			for (j = 0; j < shard->nbufs; j++) {
+				struct cache_buf *buf = &shard->bufs[j];
+				if (buf->block_num >= 0 && buf->dirty && cache_writeback(shard, buf) < 0) {
+					retstat = -1;
+				}
+			}
+			pthread_mutex_unlock(&shard->lock);
+		}
+	}
+
+	if (disk_map != NULL && msync(disk_map, disk_map_len, MS_SYNC) < 0) {
+		perror("block_msync failed");
+		retstat = -1;
+	}
+
+	if (fdatasync(diskfile) < 0) {
+		perror("block_sync failed");
+		retstat = -1;
+	}
+	return retstat;
+}
+
+//Flush blocks already written to the disk file to stable storage, without writing
+//back the block cache. Used to order journal writes.
+int bio_flush() {
+	int retstat = 0;
+
+	if (diskfile < 0) {
+		return -1;
+	}
+	if (disk_map != NULL && msync(disk_map, disk_map_len, MS_SYNC) < 0) {
+		perror("block_msync failed");
+		retstat = -1;
+	}
+	if (fdatasync(diskfile) < 0) {
+		perror("block_sync failed");
+		retstat = -1;
+	}
+	return retstat;
+}
+
+//Print hit/miss/eviction/write-back counters for every cache shard
+void bio_cache_stats(FILE *out) {
+	int i;
+
+	if (!cache_enabled) {
+		fprintf(out, "block cache: disabled\n");
+		return;
+	}
+
+	fprintf(out, "block cache: %d shards x %d blocks\n", CACHE_SHARDS, cache_shards[0].nbufs);
+	fprintf(out, "%6s %10s %10s %10s %10s\n", "shard", "hits", "misses", "evictions", "writebacks");
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		struct cache_shard *shard = &cache_shards[i];
+		pthread_mutex_lock(&shard->lock);
+		fprintf(out, "%6d %10lu %10lu %10lu %10lu\n", i,
+			shard->hits, shard->misses, shard->evictions, shard->writebacks);
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
 //for dev_read, void *buf = where you want the data you're reading to be stored
 //for dev_write, void *buf = block of data you want to write to the specified block in the disk(file)
 
+static uint64_t bio_clock() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//Add count blocks moved in one call that started at start to the counters
+static void bio_count(int write, int count, uint64_t start) {
+	uint64_t ns = bio_clock() - start;
+	if (write) {
+		__atomic_fetch_add(&bio_counters.writes, count, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&bio_counters.write_bytes, (unsigned long)count * BLOCK_SIZE, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&bio_counters.write_ns, ns, __ATOMIC_RELAXED);
+	} else {
+		__atomic_fetch_add(&bio_counters.reads, count, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&bio_counters.read_bytes, (unsigned long)count * BLOCK_SIZE, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&bio_counters.read_ns, ns, __ATOMIC_RELAXED);
+	}
+}
+
 //Read a block from the disk
-int bio_read(const int block_num, void *buf) {
+static int bio_read_block(const int block_num, void *buf) {
     int retstat = 0;
-    retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+    void *mapped = bio_map(block_num);
+
+    if (mapped != NULL) {
+		memcpy(buf, mapped, BLOCK_SIZE);
+		return BLOCK_SIZE;
+    }
+
+    if (cache_enabled) {
+		struct cache_shard *shard = cache_shard_of(block_num);
+		pthread_mutex_lock(&shard->lock);
+
+		struct cache_buf *cached = cache_lookup_filled(shard, block_num);
+		if (cached != NULL) {
+			cache_hit(shard, cached);
+			memcpy(buf, cached->data, BLOCK_SIZE);
+			pthread_mutex_unlock(&shard->lock);
+			return BLOCK_SIZE;
+		}
+
+		shard->misses++;
+		cached = cache_alloc(shard, block_num);
+		if (cached == NULL) {
+			// no buffer can be freed: read around the cache, still under the
+			// lock so a write to the block can't slip in between
+			retstat = pread(diskfile, buf, BLOCK_SIZE, (off_t)block_num * BLOCK_SIZE);
+			__atomic_fetch_add(&bio_syscalls, 1, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&shard->lock);
+			if (retstat <= 0) {
+				memset(buf, 0, BLOCK_SIZE);
+				if (retstat < 0)
+					perror("block_read failed");
+			}
+			return retstat;
+		}
+		retstat = pread(diskfile, cached->data, BLOCK_SIZE, (off_t)block_num * BLOCK_SIZE);
+		__atomic_fetch_add(&bio_syscalls, 1, __ATOMIC_RELAXED);
+		if (retstat <= 0) {
+			// nothing was read: don't leave the zeroed buffer cached as the block
+			if (retstat < 0)
+				perror("block_read failed");
+			cache_unhash(shard, cached);
+			pthread_mutex_unlock(&shard->lock);
+			memset(buf, 0, BLOCK_SIZE);
+			return retstat;
+		}
+		memcpy(buf, cached->data, BLOCK_SIZE);
+		pthread_mutex_unlock(&shard->lock);
+		return retstat;
+    }
+
+    retstat = pread(diskfile, buf, BLOCK_SIZE, (off_t)block_num * BLOCK_SIZE);
+    __atomic_fetch_add(&bio_syscalls, 1, __ATOMIC_RELAXED);
     if (retstat <= 0) {
 		memset (buf, 0, BLOCK_SIZE);
 		if (retstat < 0)
@@ -76,12 +934,465 @@ int bio_read(const int block_num, void *buf) {
 }
 
 //Write a block to the disk
-int bio_write(const int block_num, const void *buf) {
+static int bio_write_block(const int block_num, const void *buf) {
     int retstat = 0;
-    retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+    void *mapped = bio_map(block_num);
+
+    if (mapped != NULL) {
+		memcpy(mapped, buf, BLOCK_SIZE);
+		return BLOCK_SIZE;
+    }
+
+    if (cache_enabled) {
+		struct cache_shard *shard = cache_shard_of(block_num);
+		pthread_mutex_lock(&shard->lock);
+
+		struct cache_buf *cached = cache_lookup_filled(shard, block_num);
+		if (cached != NULL) {
+			cache_hit(shard, cached);
+		} else {
+			// the whole block is overwritten, so a miss needs no read
+			shard->misses++;
+			cached = cache_alloc(shard, block_num);
+			if (cached == NULL) {
+				// no buffer can be freed: write around the cache
+				retstat = pwrite(diskfile, buf, BLOCK_SIZE, (off_t)block_num * BLOCK_SIZE);
+				__atomic_fetch_add(&bio_syscalls, 1, __ATOMIC_RELAXED);
+				pthread_mutex_unlock(&shard->lock);
+				if (retstat < 0) {
+					perror("block_write failed");
+				}
+				return retstat;
+			}
+		}
+		memcpy(cached->data, buf, BLOCK_SIZE);
+		cached->dirty = 1;
+		pthread_mutex_unlock(&shard->lock);
+		return BLOCK_SIZE;
+    }
+
+    retstat = pwrite(diskfile, buf, BLOCK_SIZE, (off_t)block_num * BLOCK_SIZE);
+    __atomic_fetch_add(&bio_syscalls, 1, __ATOMIC_RELAXED);
     if (retstat < 0) {
 		    perror("block_write failed");
     }
     return retstat;
 }
 
+/* -----------------
+ * vectored I/O
+ -------------------*/
+
+//Read or write count blocks of a run of adjacent disk blocks with one preadv/pwritev
+//per BIO_IOV_MAX buffers. Reads past the end of the disk file come back as zeros.
+static int bio_run(int write, int first_block, void *const *bufs, int count) {
+    struct iovec iov[BIO_IOV_MAX];
+    int done = 0;
+
+    while (done < count) {
+		int n = count - done;
+		int i;
+		if (n > BIO_IOV_MAX) {
+			n = BIO_IOV_MAX;
+		}
+		for (i = 0; i < n; i++) {
+			iov[i].iov_base = bufs[done + i];
+			iov[i].iov_len = BLOCK_SIZE;
+		}
+
+		off_t pos = (off_t)(first_block + done) * BLOCK_SIZE;
+		ssize_t retstat = write ? pwritev(diskfile, iov, n, pos) : preadv(diskfile, iov, n, pos);
+		__atomic_fetch_add(&bio_syscalls, 1, __ATOMIC_RELAXED);
+		if (retstat < 0) {
+			perror(write ? "block_writev failed" : "block_readv failed");
+			return -1;
+		}
+
+		if (!write && retstat < (ssize_t)n * BLOCK_SIZE) {
+			// short read at the end of the disk file
+			for (i = retstat / BLOCK_SIZE; i < n; i++) {
+				size_t filled = (i == retstat / BLOCK_SIZE) ? retstat % BLOCK_SIZE : 0;
+				memset((char *)bufs[done + i] + filled, 0, BLOCK_SIZE - filled);
+			}
+		} else if (write && retstat < (ssize_t)n * BLOCK_SIZE) {
+			fprintf(stderr, "block_writev: short write\n");
+			return -1;
+		}
+		done += n;
+    }
+    return 0;
+}
+
+//Read count blocks, block_nums[i] into bufs[i]. Blocks found in the block cache are
+//copied from it; runs of adjacent uncached blocks are read with one preadv each
+//straight into the caller's buffers, without passing through the cache. With the
+//io_uring backend all uncached blocks are submitted together instead.
+static int bio_readv_blocks(const int *block_nums, void *const *bufs, int count) {
+    int i = 0;
+    int retstat = 0;
+    struct bio_req *reqs = uring.fd >= 0 ? malloc(count * sizeof(struct bio_req)) : NULL;
+    int nreqs = 0;
+
+    while (i < count) {
+		void *mapped = bio_map(block_nums[i]);
+		if (mapped != NULL) {
+			memcpy(bufs[i], mapped, BLOCK_SIZE);
+			i++;
+			continue;
+		}
+
+		if (cache_enabled) {
+			struct cache_shard *shard = cache_shard_of(block_nums[i]);
+			pthread_mutex_lock(&shard->lock);
+			struct cache_buf *cached = cache_lookup_filled(shard, block_nums[i]);
+			if (cached != NULL) {
+				cache_hit(shard, cached);
+				memcpy(bufs[i], cached->data, BLOCK_SIZE);
+				pthread_mutex_unlock(&shard->lock);
+				i++;
+				continue;
+			}
+			shard->misses++;
+			pthread_mutex_unlock(&shard->lock);
+		}
+
+		// extend the run while the next block is adjacent on disk and not cached
+		// (or being prefetched, which the next pass waits for)
+		int run = 1;
+		while (i + run < count && block_nums[i + run] == block_nums[i] + run) {
+			if (cache_enabled) {
+				struct cache_shard *shard = cache_shard_of(block_nums[i + run]);
+				pthread_mutex_lock(&shard->lock);
+				int hit = cache_lookup(shard, block_nums[i + run]) != NULL;
+				pthread_mutex_unlock(&shard->lock);
+				if (hit) {
+					break;
+				}
+			}
+			run++;
+		}
+
+		if (reqs != NULL) {
+			int j;
+			for (j = i; j < i + run; j++) {
+				reqs[nreqs].block_num = block_nums[j];
+				reqs[nreqs].buf = bufs[j];
+				reqs[nreqs].write = 0;
+				nreqs++;
+			}
+		} else if (bio_run(0, block_nums[i], &bufs[i], run) < 0) {
+			retstat = -1;
+		}
+		i += run;
+    }
+
+    if (reqs != NULL) {
+		bio_submit(reqs, nreqs);
+		if (bio_wait(reqs, nreqs) < 0) {
+			retstat = -1;
+		}
+		free(reqs);
+    }
+    return retstat;
+}
+
+//Copy bufs[i] over the cached copy of block_nums[i], for blocks that are cached,
+//and mark them clean: the caller writes them to the disk file itself
+static void cache_refresh(const int *block_nums, const void *const *bufs, int count) {
+	int i;
+
+	for (i = 0; i < count; i++) {
+		struct cache_shard *shard = cache_shard_of(block_nums[i]);
+		pthread_mutex_lock(&shard->lock);
+		struct cache_buf *cached = cache_lookup_filled(shard, block_nums[i]);
+		if (cached != NULL) {
+			memcpy(cached->data, bufs[i], BLOCK_SIZE);
+			cached->dirty = 0;
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+//Write count blocks, bufs[i] to block_nums[i]. Runs of adjacent blocks go out with
+//one pwritev each (all together with the io_uring backend); cached copies of the
+//blocks are refreshed so the cache never holds older data than the disk file.
+static int bio_writev_blocks(const int *block_nums, const void *const *bufs, int count) {
+    int i = 0;
+    int j;
+    int retstat = 0;
+    struct bio_req *reqs = uring.fd >= 0 ? malloc(count * sizeof(struct bio_req)) : NULL;
+    int nreqs = 0;
+
+    while (i < count) {
+		void *mapped = bio_map(block_nums[i]);
+		if (mapped != NULL) {
+			memcpy(mapped, bufs[i], BLOCK_SIZE);
+			i++;
+			continue;
+		}
+
+		int run = 1;
+		while (i + run < count && block_nums[i + run] == block_nums[i] + run) {
+			run++;
+		}
+
+		if (cache_enabled) {
+			cache_refresh(&block_nums[i], &bufs[i], run);
+		}
+
+		if (reqs != NULL) {
+			for (j = i; j < i + run; j++) {
+				reqs[nreqs].block_num = block_nums[j];
+				reqs[nreqs].buf = (void *)bufs[j];
+				reqs[nreqs].write = 1;
+				nreqs++;
+			}
+		} else if (bio_run(1, block_nums[i], (void *const *)&bufs[i], run) < 0) {
+			retstat = -1;
+		}
+		i += run;
+    }
+
+    if (reqs != NULL) {
+		bio_submit(reqs, nreqs);
+		if (bio_wait(reqs, nreqs) < 0) {
+			retstat = -1;
+		}
+		free(reqs);
+    }
+
+    // the prefetch thread may have read some of the blocks in while they were
+    // being written, before the new data reached the disk file
+    if (cache_enabled && prefetch.running) {
+		for (i = 0; i < count; i++) {
+			if (bio_map(block_nums[i]) == NULL) {
+				cache_refresh(&block_nums[i], &bufs[i], 1);
+			}
+		}
+    }
+    return retstat;
+}
+
+/* -----------------
+ * prefetch
+ -------------------*/
+
+//Read count adjacent blocks from block_num into the block cache, skipping the ones
+//already there. Runs on the prefetch thread.
+static void prefetch_run(int block_num, int count) {
+	struct cache_buf *claimed[BIO_IOV_MAX];
+	void *datas[BIO_IOV_MAX];
+	int i = 0;
+	int j;
+
+	while (i < count) {
+		// Step 1: Claim buffers for a run of blocks that are not cached yet
+		int n = 0;
+		while (i + n < count && n < BIO_IOV_MAX) {
+			struct cache_shard *shard = cache_shard_of(block_num + i + n);
+			pthread_mutex_lock(&shard->lock);
+			if (cache_lookup(shard, block_num + i + n) != NULL || shard->nfilling >= shard->nbufs / 2) {
+				pthread_mutex_unlock(&shard->lock);
+				break;
+			}
+			struct cache_buf *buf = cache_alloc(shard, block_num + i + n);
+			if (buf == NULL) {
+				pthread_mutex_unlock(&shard->lock);
+				break;
+			}
+			buf->filling = 1;
+			shard->nfilling++;
+			pthread_mutex_unlock(&shard->lock);
+			claimed[n] = buf;
+			datas[n] = buf->data;
+			n++;
+		}
+		if (n == 0) {
+			i++;
+			continue;
+		}
+
+		// Step 2: Read the run straight into the buffers, outside the shard locks
+		int ret = bio_run(0, block_num + i, datas, n);
+
+		// Step 3: Publish them and wake whoever is waiting; drop them if the read failed
+		for (j = 0; j < n; j++) {
+			struct cache_shard *shard = cache_shard_of(block_num + i + j);
+			pthread_mutex_lock(&shard->lock);
+			claimed[j]->filling = 0;
+			shard->nfilling--;
+			if (ret < 0) {
+				cache_unhash(shard, claimed[j]);
+			} else {
+				claimed[j]->prefetched = 1;
+			}
+			pthread_cond_broadcast(&shard->filled);
+			pthread_mutex_unlock(&shard->lock);
+		}
+		if (ret == 0) {
+			__atomic_fetch_add(&bio_counters.prefetched, n, __ATOMIC_RELAXED);
+		}
+		i += n;
+	}
+}
+
+static void *prefetch_thread(void *arg) {
+	pthread_mutex_lock(&prefetch.lock);
+	while (!prefetch.stop) {
+		if (prefetch.head == prefetch.tail) {
+			pthread_cond_wait(&prefetch.wake, &prefetch.lock);
+			continue;
+		}
+		struct prefetch_req req = prefetch.reqs[prefetch.head % PREFETCH_QUEUE];
+		prefetch.head++;
+		pthread_mutex_unlock(&prefetch.lock);
+		prefetch_run(req.block_num, req.count);
+		pthread_mutex_lock(&prefetch.lock);
+	}
+	pthread_mutex_unlock(&prefetch.lock);
+	return NULL;
+}
+
+//Start the prefetch thread on a freshly opened disk file. Only the block cache
+//needs it: without one bio_prefetch() leaves readahead to the kernel.
+static void prefetch_start() {
+	if (!cache_enabled || prefetch.running) {
+		return;
+	}
+	prefetch.head = prefetch.tail = 0;
+	prefetch.stop = 0;
+	if (pthread_create(&prefetch.thread, NULL, prefetch_thread, NULL) != 0) {
+		perror("prefetch thread");
+		return;
+	}
+	prefetch.running = 1;
+}
+
+//Stop the prefetch thread, dropping requests it has not started
+static void prefetch_stop() {
+	if (!prefetch.running) {
+		return;
+	}
+	pthread_mutex_lock(&prefetch.lock);
+	prefetch.stop = 1;
+	pthread_cond_signal(&prefetch.wake);
+	pthread_mutex_unlock(&prefetch.lock);
+	pthread_join(prefetch.thread, NULL);
+	prefetch.running = 0;
+}
+
+//Most blocks bio_prefetch() reads ahead in one call: a quarter of the block cache,
+//0 when there is no cache
+int bio_prefetch_max() {
+	return cache_enabled ? cache_shards[0].nbufs * CACHE_SHARDS / 4 : 0;
+}
+
+//Start reading count adjacent blocks from block_num in the background, so a later
+//bio_read()/bio_readv() of them finds them in the block cache. With the disk file
+//mapped, or with no block cache, the kernel is asked to read them ahead instead.
+//Returns without waiting; the request is dropped (-1) if too many are queued.
+int bio_prefetch(const int block_num, int count) {
+	if (diskfile < 0 || block_num < 0 || count <= 0) {
+		return -1;
+	}
+	if (!prefetch.running || bio_map(block_num) != NULL) {
+		bio_advise(block_num, count, BIO_ADVICE_WILLNEED);
+		return 0;
+	}
+	if (count > bio_prefetch_max()) {
+		count = bio_prefetch_max();
+	}
+
+	pthread_mutex_lock(&prefetch.lock);
+	if (prefetch.tail - prefetch.head == PREFETCH_QUEUE) {
+		pthread_mutex_unlock(&prefetch.lock);
+		__atomic_fetch_add(&bio_counters.prefetch_dropped, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	prefetch.reqs[prefetch.tail % PREFETCH_QUEUE].block_num = block_num;
+	prefetch.reqs[prefetch.tail % PREFETCH_QUEUE].count = count;
+	prefetch.tail++;
+	pthread_cond_signal(&prefetch.wake);
+	pthread_mutex_unlock(&prefetch.lock);
+	return 0;
+}
+
+/* -----------------
+ * counted entry points
+ -------------------*/
+
+int bio_read(const int block_num, void *buf) {
+	uint64_t start = bio_clock();
+	int retstat = bio_read_block(block_num, buf);
+	bio_count(0, 1, start);
+	return retstat;
+}
+
+int bio_write(const int block_num, const void *buf) {
+	uint64_t start = bio_clock();
+	int retstat = bio_write_block(block_num, buf);
+	bio_count(1, 1, start);
+	return retstat;
+}
+
+int bio_readv(const int *block_nums, void *const *bufs, int count) {
+	uint64_t start = bio_clock();
+	int retstat = bio_readv_blocks(block_nums, bufs, count);
+	bio_count(0, count, start);
+	return retstat;
+}
+
+int bio_writev(const int *block_nums, const void *const *bufs, int count) {
+	uint64_t start = bio_clock();
+	int retstat = bio_writev_blocks(block_nums, bufs, count);
+	bio_count(1, count, start);
+	return retstat;
+}
+
+//Read/write system calls issued so far
+unsigned long bio_syscall_count() {
+	return __atomic_load_n(&bio_syscalls, __ATOMIC_RELAXED);
+}
+
+//Print the block-layer counters
+void bio_stats(FILE *out) {
+	unsigned long reads = __atomic_load_n(&bio_counters.reads, __ATOMIC_RELAXED);
+	unsigned long writes = __atomic_load_n(&bio_counters.writes, __ATOMIC_RELAXED);
+
+	fprintf(out, "block io: %lu reads (%lu bytes, %.2f us avg), %lu writes (%lu bytes, %.2f us avg), %lu system calls\n",
+		reads, __atomic_load_n(&bio_counters.read_bytes, __ATOMIC_RELAXED),
+		reads ? __atomic_load_n(&bio_counters.read_ns, __ATOMIC_RELAXED) / 1000.0 / reads : 0.0,
+		writes, __atomic_load_n(&bio_counters.write_bytes, __ATOMIC_RELAXED),
+		writes ? __atomic_load_n(&bio_counters.write_ns, __ATOMIC_RELAXED) / 1000.0 / writes : 0.0,
+		bio_syscall_count());
+	fprintf(out, "readahead: %lu blocks prefetched, %lu of them used, %lu requests dropped\n",
+		__atomic_load_n(&bio_counters.prefetched, __ATOMIC_RELAXED),
+		__atomic_load_n(&bio_counters.prefetch_hits, __ATOMIC_RELAXED),
+		__atomic_load_n(&bio_counters.prefetch_dropped, __ATOMIC_RELAXED));
+}
+
+//Zero the block-layer and cache shard counters
+void bio_stats_reset() {
+	int i;
+
+	__atomic_store_n(&bio_counters.reads, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&bio_counters.writes, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&bio_counters.read_bytes, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&bio_counters.write_bytes, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&bio_counters.read_ns, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&bio_counters.write_ns, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&bio_counters.prefetched, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&bio_counters.prefetch_hits, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&bio_counters.prefetch_dropped, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&bio_syscalls, 0, __ATOMIC_RELAXED);
+
+	if (!cache_enabled) {
+		return;
+	}
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		struct cache_shard *shard = &cache_shards[i];
+		pthread_mutex_lock(&shard->lock);
+		shard->hits = shard->misses = shard->evictions = shard->writebacks = 0;
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
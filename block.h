@@ -12,13 +12,60 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
+#include <stdio.h>
+#include <stdint.h>
+
 #define BLOCK_SIZE 4096
 
+//Default size of a new disk file (32MB)
+#define DEFAULT_DISK_SIZE	(32*1024*1024)
+
+//Default memory budget of the block cache (4MB)
+#define DEFAULT_CACHE_SIZE	(4*1024*1024)
+
+//How the disk file is accessed, see dev_set_backend()
+#define BIO_BACKEND_PREAD	0
+#define BIO_BACKEND_MMAP	1
+#define BIO_BACKEND_URING	2
+
+//Access pattern hints for bio_advise()
+#define BIO_ADVICE_NORMAL		0
+#define BIO_ADVICE_RANDOM		1
+#define BIO_ADVICE_SEQUENTIAL	2
+#define BIO_ADVICE_WILLNEED		3
+
+//One block request for bio_submit()/bio_wait()
+struct bio_req {
+	int		block_num;
+	void	*buf;		/* BLOCK_SIZE bytes */
+	int		write;		/* 1 writes buf to block_num, 0 reads block_num into buf */
+	int		result;		/* BLOCK_SIZE, or negative on error, once done */
+	int		done;		/* set when the request has completed */
+};
+
 void dev_init(const char* diskfile_path);
 int dev_open(const char* diskfile_path);
 void dev_close();
+void dev_set_size(uint64_t bytes);
+uint64_t dev_blocks();
+void dev_set_cache_size(size_t bytes);
+void dev_set_backend(int which);
 int bio_read(const int block_num, void *buf);
 int bio_write(const int block_num, const void *buf);
+int bio_readv(const int *block_nums, void *const *bufs, int count);
+int bio_writev(const int *block_nums, const void *const *bufs, int count);
+int bio_submit(struct bio_req *reqs, int count);
+int bio_wait(struct bio_req *reqs, int count);
+void *bio_map(const int block_num);
+void bio_advise(const int block_num, int count, int advice);
+int bio_prefetch(const int block_num, int count);
+int bio_prefetch_max();
+int bio_sync();
+int bio_flush();
+unsigned long bio_syscall_count();
+void bio_stats(FILE *out);
+void bio_stats_reset();
+void bio_cache_stats(FILE *out);
 
 #endif
 
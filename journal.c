@@ -0,0 +1,774 @@
+/*
+ *	Tiny File System
+ *
+ *	File:	journal.c
+ *
+ *	Metadata write-ahead journal with group commit
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "block.h"
+#include "journal.h"
+#include "trace.h"
+
+//Soft limits on the running transaction: journal_start() commits it once it
+//holds this many blocks or has been open this long
+#define JOURNAL_TXN_BLOCKS	256
+#define JOURNAL_COMMIT_SECS	5
+
+#define JSET_BUCKETS		1024
+
+/*
+ * A set of metadata block images keyed by home block number. The running
+ * transaction, the transaction being committed and the committed blocks
+ * waiting for checkpoint are each one set; reads look in them newest first,
+ * so callers always see the latest image of a block.
+ */
+struct jblock {
+	int				block_num;	/* home block */
+	char			*data;		/* BLOCK_SIZE image */
+	struct jblock	*next;		/* hash bucket chain */
+	struct jblock	*link;		/* every block of the set */
+};
+
+struct jset {
+	struct jblock	*buckets[JSET_BUCKETS];
+	struct jblock	*list;
+	int				count;
+};
+
+/*
+ * Journal state. lock covers everything here. Operations that change
+ * metadata run between journal_start() and journal_stop(), so a commit waits
+ * for handles to drain (holding off new ones with locked) before it takes the
+ * running transaction - each operation lands in exactly one transaction.
+ * Only one thread commits or checkpoints at a time (committing); the others
+ * wait on cond, and a commit covers every change made before it closed the
+ * transaction, so concurrent journal_commit() callers share one log write.
+ */
+struct journal {
+	int				enabled;
+	uint32_t		start_blk;		/* journal superblock */
+	uint32_t		nblocks;		/* size of the region, superblock included */
+	uint32_t		head;			/* next free log block, relative to start_blk */
+	uint32_t		first_seq;		/* first transaction in the log, as in the superblock */
+	uint32_t		running_tid;
+	uint32_t		committed_tid;
+	struct jset		running;
+	struct jset		committing_set;
+	struct jset		checkpoint;
+	int				handles;		/* open handles on the running transaction */
+	int				locked;			/* a commit is waiting for handles to drain */
+	int				committing;		/* a commit or checkpoint is in progress */
+	time_t			running_since;	/* when the running transaction got its first block */
+	int				(*flush)();		/* pushes cached metadata in before a commit */
+	void			(*release)(int);	/* frees a block held back by journal_defer_free() */
+	int				*deferred;		/* blocks waiting for a checkpoint before they are freed */
+	int				ndeferred;
+	int				deferred_cap;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	unsigned long	commits;
+	unsigned long	commit_calls;
+	unsigned long	blocks_logged;
+	unsigned long	log_blocks;
+	unsigned long	checkpoints;
+	unsigned long	split_txns;		/* transactions too big for the log, see journal_log() */
+};
+
+struct journal journal = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static uint32_t crc_table[256];
+
+/* -----------------
+ * helpers
+ -------------------*/
+
+static void crc_init() {
+	uint32_t i, k;
+	for (i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (k = 0; k < 8; k++) {
+			c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+		}
+		crc_table[i] = c;
+	}
+}
+
+static uint32_t crc32_update(uint32_t crc, const void *buf, size_t len) {
+	const unsigned char *p = buf;
+	size_t i;
+	crc = ~crc;
+	for (i = 0; i < len; i++) {
+		crc = crc_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+static struct jblock *jset_find(struct jset *set, int block_num) {
+	struct jblock *jb;
+	for (jb = set->buckets[block_num % JSET_BUCKETS]; jb != NULL; jb = jb->next) {
+		if (jb->block_num == block_num) {
+			return jb;
+		}
+	}
+	return NULL;
+}
+
+//Add block_num to set, or reuse its slot if it is there already. Returns the slot.
+static struct jblock *jset_slot(struct jset *set, int block_num) {
+	struct jblock *jb = jset_find(set, block_num);
+	if (jb == NULL) {
+		jb = malloc(sizeof(struct jblock));
+		jb->block_num = block_num;
+		jb->data = NULL;
+		jb->next = set->buckets[block_num % JSET_BUCKETS];
+		set->buckets[block_num % JSET_BUCKETS] = jb;
+		jb->link = set->list;
+		set->list = jb;
+		set->count++;
+	}
+	return jb;
+}
+
+static void jset_remove(struct jset *set, int block_num) {
+	struct jblock **link = &set->buckets[block_num % JSET_BUCKETS];
+	while (*link != NULL && (*link)->block_num != block_num) {
+		link = &(*link)->next;
+	}
+	if (*link == NULL) {
+		return;
+	}
+	struct jblock *victim = *link;
+	*link = victim->next;
+
+	link = &set->list;
+	while (*link != victim) {
+		link = &(*link)->link;
+	}
+	*link = victim->link;
+	set->count--;
+	free(victim->data);
+	free(victim);
+}
+
+static void jset_clear(struct jset *set) {
+	struct jblock *jb = set->list;
+	while (jb != NULL) {
+		struct jblock *link = jb->link;
+		free(jb->data);
+		free(jb);
+		jb = link;
+	}
+	memset(set, 0, sizeof(struct jset));
+}
+
+//Move every image of src into dst, replacing older images of the same blocks
+static void jset_move(struct jset *dst, struct jset *src) {
+	struct jblock *jb;
+	for (jb = src->list; jb != NULL; jb = jb->link) {
+		struct jblock *slot = jset_slot(dst, jb->block_num);
+		free(slot->data);
+		slot->data = jb->data;
+		jb->data = NULL;
+	}
+	jset_clear(src);
+}
+
+static int jblock_cmp(const void *a, const void *b) {
+	const struct jblock *x = *(struct jblock *const *)a;
+	const struct jblock *y = *(struct jblock *const *)b;
+	return (x->block_num > y->block_num) - (x->block_num < y->block_num);
+}
+
+//Write count images to their home blocks, in block order so adjacent blocks
+//share a request, and flush
+static int jblocks_write_home(struct jblock **blocks, int count) {
+	struct jblock **sorted = malloc(count * sizeof(struct jblock *));
+	int *block_nums = malloc(count * sizeof(int));
+	const void **bufs = malloc(count * sizeof(void *));
+	int i;
+	int ret;
+
+	memcpy(sorted, blocks, count * sizeof(struct jblock *));
+	qsort(sorted, count, sizeof(struct jblock *), jblock_cmp);
+	for (i = 0; i < count; i++) {
+		block_nums[i] = sorted[i]->block_num;
+		bufs[i] = sorted[i]->data;
+	}
+
+	ret = bio_writev(block_nums, bufs, count);
+	if (bio_flush() < 0) {
+		ret = -1;
+	}
+
+	free(sorted);
+	free(block_nums);
+	free(bufs);
+	return ret;
+}
+
+//Gather the images of set into an array, in list order
+static struct jblock **jset_array(struct jset *set) {
+	struct jblock **blocks = malloc((set->count + 1) * sizeof(struct jblock *));
+	struct jblock *jb;
+	int i = 0;
+
+	for (jb = set->list; jb != NULL; jb = jb->link) {
+		blocks[i++] = jb;
+	}
+	return blocks;
+}
+
+static int jset_write_home(struct jset *set) {
+	struct jblock **blocks = jset_array(set);
+	int ret = jblocks_write_home(blocks, set->count);
+	free(blocks);
+	return ret;
+}
+
+//Rewrite the journal superblock so the log starts empty at transaction seq
+static int journal_reset(uint32_t seq) {
+	struct journal_superblock *jsb = calloc(1, BLOCK_SIZE);
+	jsb->h.magic = JOURNAL_MAGIC;
+	jsb->h.type = JOURNAL_SUPERBLOCK;
+	jsb->h.seq = seq;
+	jsb->nblocks = journal.nblocks;
+
+	const void *buf = jsb;
+	int block_num = journal.start_blk;
+	int ret = bio_writev(&block_num, &buf, 1);
+	if (bio_flush() < 0) {
+		ret = -1;
+	}
+	free(jsb);
+
+	journal.first_seq = seq;
+	journal.head = 1;
+	return ret;
+}
+
+//Write the committed blocks home and empty the log. Called by the thread holding committing.
+static int checkpoint_all(uint32_t next_seq) {
+	int ret = 0;
+
+	TRACE(TRACE_INFO, TR_JOURNAL_CHECKPOINT, journal.checkpoint.count, 0);
+	if (journal.checkpoint.count > 0 && jset_write_home(&journal.checkpoint) < 0) {
+		ret = -1;
+	}
+	if (journal_reset(next_seq) < 0) {
+		ret = -1;
+	}
+
+	// Blocks freed while they had images can be reused now, unless the
+	// transaction being committed still carries one
+	pthread_mutex_lock(&journal.lock);
+	jset_clear(&journal.checkpoint);
+	journal.checkpoints++;
+	int *release = malloc((journal.ndeferred + 1) * sizeof(int));
+	int nrelease = 0;
+	int i, kept = 0;
+	for (i = 0; i < journal.ndeferred; i++) {
+		if (jset_find(&journal.committing_set, journal.deferred[i]) != NULL) {
+			journal.deferred[kept++] = journal.deferred[i];
+		} else {
+			release[nrelease++] = journal.deferred[i];
+		}
+	}
+	journal.ndeferred = kept;
+	pthread_mutex_unlock(&journal.lock);
+
+	for (i = 0; i < nrelease; i++) {
+		journal.release(release[i]);
+	}
+	free(release);
+	return ret;
+}
+
+//Append count images of transaction seq to the log with a single write and a
+//single flush: descriptor blocks, each followed by the images it lists, then the
+//commit block. The caller has made room for them.
+static int journal_log_run(struct jblock **blocks, uint32_t count, uint32_t seq) {
+	uint32_t ndesc = (count + JOURNAL_DESC_MAX - 1) / JOURNAL_DESC_MAX;
+	uint32_t total = ndesc + count + 1;
+	int ret;
+
+	// Step 1: Lay out descriptors and images, checksumming both
+	int *block_nums = malloc(total * sizeof(int));
+	const void **bufs = malloc(total * sizeof(void *));
+	char *desc_mem = calloc(ndesc + 1, BLOCK_SIZE);
+	uint32_t crc = 0;
+	uint32_t n = 0;
+	uint32_t i = 0;
+	uint32_t d;
+
+	for (d = 0; d < ndesc; d++) {
+		struct journal_descriptor *desc = (struct journal_descriptor *)(desc_mem + (size_t)d * BLOCK_SIZE);
+		uint32_t k = 0;
+
+		desc->h.magic = JOURNAL_MAGIC;
+		desc->h.type = JOURNAL_DESCRIPTOR;
+		desc->h.seq = seq;
+		block_nums[n] = journal.start_blk + journal.head + n;
+		bufs[n++] = desc;
+
+		for (; i < count && k < JOURNAL_DESC_MAX; i++, k++) {
+			desc->blocks[k] = blocks[i]->block_num;
+			block_nums[n] = journal.start_blk + journal.head + n;
+			bufs[n++] = blocks[i]->data;
+		}
+		desc->h.count = k;
+	}
+	for (d = 0; d < n; d++) {
+		crc = crc32_update(crc, bufs[d], BLOCK_SIZE);
+	}
+
+	struct journal_commit *commit = (struct journal_commit *)(desc_mem + (size_t)ndesc * BLOCK_SIZE);
+	commit->h.magic = JOURNAL_MAGIC;
+	commit->h.type = JOURNAL_COMMIT;
+	commit->h.seq = seq;
+	commit->h.count = count;
+	commit->crc = crc;
+	block_nums[n] = journal.start_blk + journal.head + n;
+	bufs[n++] = commit;
+
+	// Step 2: One sequential write, one flush
+	ret = bio_writev(block_nums, bufs, n);
+	if (bio_flush() < 0) {
+		ret = -1;
+	}
+	journal.head += total;
+	journal.blocks_logged += count;
+	journal.log_blocks += total;
+
+	free(block_nums);
+	free(bufs);
+	free(desc_mem);
+	return ret;
+}
+
+//Append transaction seq to the log, checkpointing everything logged so far if the
+//log is full. A transaction larger than the whole log is never written in place:
+//it is logged in runs that each fill an empty log, and every run is written home
+//before the next one replaces it. Each run is atomic on its own but the
+//transaction as a whole is not, so this is reported.
+static int journal_log(struct jset *txn, uint32_t seq) {
+	uint32_t ndesc = (txn->count + JOURNAL_DESC_MAX - 1) / JOURNAL_DESC_MAX;
+	uint32_t total = ndesc + txn->count + 1;
+	int ret = 0;
+
+	// Step 1: The common case, one run
+	if (journal.head + total > journal.nblocks) {
+		checkpoint_all(seq);
+	}
+	if (journal.head + total <= journal.nblocks) {
+		struct jblock **blocks = jset_array(txn);
+		ret = journal_log_run(blocks, txn->count, seq);
+		free(blocks);
+		return ret;
+	}
+
+	// Step 2: Too big for the log. Most images an empty log takes, with their
+	// descriptors and the commit block.
+	uint32_t room = journal.nblocks - 2;
+	uint32_t per_run = room - (room + JOURNAL_DESC_MAX) / (JOURNAL_DESC_MAX + 1);
+	fprintf(stderr, "journal: transaction %u of %d blocks is larger than the journal, logging it in %u parts\n",
+		seq, txn->count, (txn->count + per_run - 1) / per_run);
+	journal.split_txns++;
+
+	// Step 3: Log each run, write it home and empty the log for the next one. The
+	// runs share seq, which replay accepts because each starts a fresh log.
+	struct jblock **blocks = jset_array(txn);
+	uint32_t i;
+	for (i = 0; i < (uint32_t)txn->count; i += per_run) {
+		uint32_t count = txn->count - i < per_run ? txn->count - i : per_run;
+		if (journal_log_run(blocks + i, count, seq) < 0) {
+			ret = -1;
+			break;
+		}
+		if (i + count < (uint32_t)txn->count) {
+			if (jblocks_write_home(blocks + i, count) < 0) {
+				ret = -1;
+				break;
+			}
+			checkpoint_all(seq);
+		}
+	}
+	free(blocks);
+	return ret;
+}
+
+/* -----------------
+ * setup and recovery
+ -------------------*/
+
+//Attach the journal region [start_blk, start_blk + nblocks). With format set it is
+//initialised empty; otherwise its superblock is read and journal_replay() must run
+//before the file system is used. flush is called at every commit to push metadata
+//cached in memory into the running transaction; release frees blocks held back by
+//journal_defer_free(). Returns -1 on a bad journal.
+int journal_init(uint32_t start_blk, uint32_t nblocks, int format, int (*flush)(), void (*release)(int)) {
+	crc_init();
+	memset(&journal.running, 0, sizeof(struct jset));
+	memset(&journal.committing_set, 0, sizeof(struct jset));
+	memset(&journal.checkpoint, 0, sizeof(struct jset));
+	journal.start_blk = start_blk;
+	journal.nblocks = nblocks;
+	journal.flush = flush;
+	journal.release = release;
+	journal.deferred = NULL;
+	journal.ndeferred = 0;
+	journal.deferred_cap = 0;
+	journal.handles = 0;
+	journal.locked = 0;
+	journal.committing = 0;
+	journal.commits = 0;
+	journal.commit_calls = 0;
+	journal.blocks_logged = 0;
+	journal.log_blocks = 0;
+	journal.checkpoints = 0;
+	journal.split_txns = 0;
+
+	if (format) {
+		if (journal_reset(1) < 0) {
+			return -1;
+		}
+	} else {
+		struct journal_superblock *jsb = malloc(BLOCK_SIZE);
+		bio_read(start_blk, jsb);
+		int valid = jsb->h.magic == JOURNAL_MAGIC && jsb->h.type == JOURNAL_SUPERBLOCK && jsb->nblocks == nblocks;
+		journal.first_seq = jsb->h.seq;
+		free(jsb);
+		if (!valid) {
+			return -1;
+		}
+		journal.head = 1;
+	}
+
+	journal.running_tid = journal.first_seq;
+	journal.committed_tid = journal.first_seq - 1;
+	journal.enabled = 1;
+	return 0;
+}
+
+//Apply every fully committed transaction in the log to its home blocks, then empty
+//the log. Transactions are read back one descriptor run at a time and stop at the
+//first one that is stale, torn or fails its checksum. Returns how many were replayed.
+int journal_replay() {
+	struct journal_header *h = malloc(BLOCK_SIZE);
+	char *images = malloc((size_t)JOURNAL_DESC_MAX * BLOCK_SIZE);
+	uint32_t expected = journal.first_seq;
+	uint32_t pos = 1;
+	int replayed = 0;
+
+	while (pos < journal.nblocks) {
+		struct jset txn;
+		uint32_t crc = 0;
+		uint32_t seq;
+		uint32_t p = pos;
+		int good = 0;
+
+		memset(&txn, 0, sizeof(struct jset));
+
+		// Step 1: Collect the descriptors and images of the next transaction
+		bio_read(journal.start_blk + p, h);
+		if (h->magic != JOURNAL_MAGIC || h->type != JOURNAL_DESCRIPTOR || h->seq < expected) {
+			break;
+		}
+		seq = h->seq;
+		while (h->magic == JOURNAL_MAGIC && h->type == JOURNAL_DESCRIPTOR && h->seq == seq
+				&& h->count <= JOURNAL_DESC_MAX && p + 1 + h->count < journal.nblocks) {
+			struct journal_descriptor *desc = (struct journal_descriptor *)h;
+			uint32_t count = desc->h.count;
+			int *block_nums = malloc(count * sizeof(int));
+			void **bufs = malloc(count * sizeof(void *));
+			uint32_t k;
+
+			crc = crc32_update(crc, desc, BLOCK_SIZE);
+			for (k = 0; k < count; k++) {
+				block_nums[k] = journal.start_blk + p + 1 + k;
+				bufs[k] = images + (size_t)k * BLOCK_SIZE;
+			}
+			bio_readv(block_nums, bufs, count);
+			for (k = 0; k < count; k++) {
+				crc = crc32_update(crc, bufs[k], BLOCK_SIZE);
+				struct jblock *slot = jset_slot(&txn, desc->blocks[k]);
+				if (slot->data == NULL) {
+					slot->data = malloc(BLOCK_SIZE);
+				}
+				memcpy(slot->data, bufs[k], BLOCK_SIZE);
+			}
+			free(block_nums);
+			free(bufs);
+
+			p += 1 + count;
+			bio_read(journal.start_blk + p, h);
+		}
+
+		// Step 2: It counts only with a matching commit block
+		if (h->magic == JOURNAL_MAGIC && h->type == JOURNAL_COMMIT && h->seq == seq
+				&& ((struct journal_commit *)h)->crc == crc) {
+			good = 1;
+		}
+		if (good) {
+			jset_write_home(&txn);
+			replayed++;
+			expected = seq + 1;
+			pos = p + 1;
+		}
+		jset_clear(&txn);
+		if (!good) {
+			break;
+		}
+	}
+
+	free(h);
+	free(images);
+
+	// Step 3: Start over with an empty log
+	journal_reset(expected);
+	journal.running_tid = expected;
+	journal.committed_tid = expected - 1;
+	return replayed;
+}
+
+//Commit what is pending, checkpoint it and stop journaling
+void journal_close() {
+	if (!journal.enabled) {
+		return;
+	}
+	journal_commit();
+	journal_checkpoint();
+	pthread_mutex_lock(&journal.lock);
+	jset_clear(&journal.running);
+	jset_clear(&journal.committing_set);
+	jset_clear(&journal.checkpoint);
+	free(journal.deferred);
+	journal.deferred = NULL;
+	journal.ndeferred = 0;
+	journal.enabled = 0;
+	pthread_mutex_unlock(&journal.lock);
+}
+
+/* -----------------
+ * transactions
+ -------------------*/
+
+//Open a handle on the running transaction. Everything written until the matching
+//journal_stop() commits together. Must not be called with inode locks held, since
+//it may commit a transaction that is due first.
+void journal_start() {
+	if (!journal.enabled) {
+		return;
+	}
+
+	pthread_mutex_lock(&journal.lock);
+	for (;;) {
+		if (journal.locked) {
+			pthread_cond_wait(&journal.cond, &journal.lock);
+			continue;
+		}
+		int due = journal.running.count >= JOURNAL_TXN_BLOCKS
+			|| (journal.running.count > 0 && time(NULL) - journal.running_since >= JOURNAL_COMMIT_SECS);
+		if (due && !journal.committing) {
+			pthread_mutex_unlock(&journal.lock);
+			journal_commit();
+			pthread_mutex_lock(&journal.lock);
+			continue;
+		}
+		break;
+	}
+	journal.handles++;
+	pthread_mutex_unlock(&journal.lock);
+}
+
+void journal_stop() {
+	if (!journal.enabled) {
+		return;
+	}
+
+	pthread_mutex_lock(&journal.lock);
+	journal.handles--;
+	if (journal.handles == 0) {
+		pthread_cond_broadcast(&journal.cond);
+	}
+	pthread_mutex_unlock(&journal.lock);
+}
+
+//Make every metadata change made so far durable. Callers arriving while another
+//commit is running wait for it and then share the next one (group commit).
+int journal_commit() {
+	int ret = 0;
+
+	if (!journal.enabled) {
+		return journal.flush != NULL ? journal.flush() : 0;
+	}
+
+	// Step 1: Wait for a commit in progress; it may already cover this caller
+	pthread_mutex_lock(&journal.lock);
+	journal.commit_calls++;
+	uint32_t target = journal.running_tid;
+	while (journal.committing && journal.committed_tid < target) {
+		pthread_cond_wait(&journal.cond, &journal.lock);
+	}
+	if (journal.committed_tid >= target) {
+		pthread_mutex_unlock(&journal.lock);
+		return 0;
+	}
+
+	// Step 2: Close the running transaction once its handles drain
+	journal.committing = 1;
+	journal.locked = 1;
+	while (journal.handles > 0) {
+		pthread_cond_wait(&journal.cond, &journal.lock);
+	}
+	pthread_mutex_unlock(&journal.lock);
+
+	if (journal.flush != NULL && journal.flush() < 0) {
+		ret = -1;
+	}
+
+	pthread_mutex_lock(&journal.lock);
+	journal.committing_set = journal.running;
+	memset(&journal.running, 0, sizeof(struct jset));
+	uint32_t tid = journal.running_tid;
+	if (journal.committing_set.count > 0) {
+		journal.running_tid++;
+	}
+	journal.locked = 0;
+	pthread_cond_broadcast(&journal.cond);
+	pthread_mutex_unlock(&journal.lock);
+
+	// Step 3: Log it, then keep its blocks for the next checkpoint
+	if (journal.committing_set.count > 0) {
+		if (journal_log(&journal.committing_set, tid) < 0) {
+			ret = -1;
+		}
+		journal.commits++;
+		TRACE(TRACE_INFO, TR_JOURNAL_COMMIT, tid, journal.committing_set.count);
+	}
+
+	pthread_mutex_lock(&journal.lock);
+	if (journal.committing_set.count > 0) {
+		journal.committed_tid = tid;
+	}
+	jset_move(&journal.checkpoint, &journal.committing_set);
+	journal.committing = 0;
+	pthread_cond_broadcast(&journal.cond);
+	pthread_mutex_unlock(&journal.lock);
+	return ret;
+}
+
+//Write every committed block to its home location and empty the log
+int journal_checkpoint() {
+	if (!journal.enabled) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&journal.lock);
+	while (journal.committing) {
+		pthread_cond_wait(&journal.cond, &journal.lock);
+	}
+	journal.committing = 1;
+	uint32_t next = journal.running_tid;
+	pthread_mutex_unlock(&journal.lock);
+
+	int ret = checkpoint_all(next);
+
+	pthread_mutex_lock(&journal.lock);
+	journal.committing = 0;
+	pthread_cond_broadcast(&journal.cond);
+	pthread_mutex_unlock(&journal.lock);
+	return ret;
+}
+
+/* -----------------
+ * block access
+ -------------------*/
+
+//Read a metadata block: its newest journaled image if there is one, the disk otherwise
+int journal_read(int block_num, void *buf) {
+	if (journal.enabled) {
+		pthread_mutex_lock(&journal.lock);
+		struct jblock *jb = jset_find(&journal.running, block_num);
+		if (jb == NULL) {
+			jb = jset_find(&journal.committing_set, block_num);
+		}
+		if (jb == NULL) {
+			jb = jset_find(&journal.checkpoint, block_num);
+		}
+		if (jb != NULL) {
+			memcpy(buf, jb->data, BLOCK_SIZE);
+			pthread_mutex_unlock(&journal.lock);
+			return BLOCK_SIZE;
+		}
+		pthread_mutex_unlock(&journal.lock);
+	}
+	return bio_read(block_num, buf);
+}
+
+//Write a metadata block. It joins the running transaction and reaches its home
+//location only after the transaction is committed and checkpointed.
+int journal_write(int block_num, const void *buf) {
+	if (!journal.enabled) {
+		return bio_write(block_num, buf);
+	}
+
+	pthread_mutex_lock(&journal.lock);
+	struct jblock *jb = jset_slot(&journal.running, block_num);
+	if (jb->data == NULL) {
+		jb->data = malloc(BLOCK_SIZE);
+	}
+	memcpy(jb->data, buf, BLOCK_SIZE);
+	if (journal.running.count == 1) {
+		time(&journal.running_since);
+	}
+	pthread_mutex_unlock(&journal.lock);
+	return BLOCK_SIZE;
+}
+
+//Called instead of freeing block_num. If the journal holds an image of the block, a
+//later checkpoint would write it over whatever the block gets reused for, so the
+//block is held back and handed to release() once no image of it is left. Returns 1
+//if the block was held back, 0 if the caller can free it right away.
+int journal_defer_free(int block_num) {
+	if (!journal.enabled) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&journal.lock);
+	jset_remove(&journal.running, block_num);
+	if (jset_find(&journal.committing_set, block_num) == NULL && jset_find(&journal.checkpoint, block_num) == NULL) {
+		pthread_mutex_unlock(&journal.lock);
+		return 0;
+	}
+	if (journal.ndeferred == journal.deferred_cap) {
+		journal.deferred_cap = journal.deferred_cap ? 2 * journal.deferred_cap : 64;
+		journal.deferred = realloc(journal.deferred, journal.deferred_cap * sizeof(int));
+	}
+	journal.deferred[journal.ndeferred++] = block_num;
+	pthread_mutex_unlock(&journal.lock);
+	return 1;
+}
+
+void journal_stats(FILE *out) {
+	pthread_mutex_lock(&journal.lock);
+	fprintf(out, "journal: %lu commits for %lu commit calls, %lu blocks logged (%.1f per commit), %lu log blocks written, %lu checkpoints, %lu split\n",
+		journal.commits, journal.commit_calls, journal.blocks_logged,
+		journal.commits ? (double)journal.blocks_logged / journal.commits : 0.0,
+		journal.log_blocks, journal.checkpoints, journal.split_txns);
+	pthread_mutex_unlock(&journal.lock);
+}
+
+void journal_stats_reset() {
+	pthread_mutex_lock(&journal.lock);
+	journal.commits = journal.commit_calls = journal.blocks_logged = 0;
+	journal.log_blocks = journal.checkpoints = journal.split_txns = 0;
+	pthread_mutex_unlock(&journal.lock);
+}
@@ -0,0 +1,74 @@
+/*
+ *	Tiny File System
+ *
+ *	File:	journal.h
+ *
+ *	Metadata write-ahead journal
+ *
+ */
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "block.h"
+
+// [journal superblock] [descriptor][block]..[block] [commit] [descriptor]..
+//
+// Every metadata block written through journal_write() joins the running
+// transaction. A commit appends the transaction to the log - descriptor
+// blocks listing home block numbers, the block images, and a commit block
+// with a checksum over them - in one sequential write and one flush. The
+// blocks are checkpointed to their home locations only when the log fills
+// up or the journal is closed.
+
+#define JOURNAL_MAGIC		0x4A524E4C
+
+/* header types */
+#define JOURNAL_SUPERBLOCK	1
+#define JOURNAL_DESCRIPTOR	2
+#define JOURNAL_COMMIT		3
+
+struct journal_header {
+	uint32_t	magic;				/* JOURNAL_MAGIC */
+	uint32_t	type;				/* JOURNAL_SUPERBLOCK, _DESCRIPTOR or _COMMIT */
+	uint32_t	seq;				/* transaction the block belongs to */
+	uint32_t	count;				/* descriptor: blocks listed, commit: blocks in the transaction */
+};
+
+/* first block of the journal region, rewritten only at checkpoint */
+struct journal_superblock {
+	struct journal_header	h;		/* seq is the first transaction expected in the log */
+	uint32_t	nblocks;			/* size of the journal region */
+};
+
+struct journal_descriptor {
+	struct journal_header	h;
+	uint32_t	blocks[];			/* home block of each block image that follows */
+};
+
+#define JOURNAL_DESC_MAX	((BLOCK_SIZE - sizeof(struct journal_descriptor)) / sizeof(uint32_t))
+
+struct journal_commit {
+	struct journal_header	h;
+	uint32_t	crc;				/* crc32 over the block images of the transaction */
+};
+
+int journal_init(uint32_t start_blk, uint32_t nblocks, int format, int (*flush)(), void (*release)(int));
+int journal_replay();
+void journal_close();
+
+void journal_start();
+void journal_stop();
+int journal_commit();
+int journal_checkpoint();
+
+int journal_read(int block_num, void *buf);
+int journal_write(int block_num, const void *buf);
+int journal_defer_free(int block_num);
+void journal_stats(FILE *out);
+void journal_stats_reset();
+
+#endif
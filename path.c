@@ -0,0 +1,69 @@
+/*
+ *	Tiny File System
+ *
+ *	File:	path.c
+ *
+ *	Path component iteration, see path.h
+ *
+ */
+
+#include <limits.h>
+
+#include "path.h"
+
+//Walk the first len bytes of path, or all of it with PATH_WHOLE
+void path_iter_init(struct path_iter *it, const char *path, size_t len) {
+	it->pos = path;
+	it->left = len;
+}
+
+//Set *name and *len to the next component. Returns 0 once there are no more.
+int path_next(struct path_iter *it, const char **name, size_t *len) {
+	const char *p = it->pos;
+	size_t left = it->left;
+
+	// Step 1: Skip the slashes in front of the component
+	while (left > 0 && *p == '/') {
+		p++;
+		left--;
+	}
+	if (left == 0 || *p == '\0') {
+		it->pos = p;
+		it->left = 0;
+		return 0;
+	}
+
+	// Step 2: The component runs up to the next slash or the end
+	*name = p;
+	while (left > 0 && *p != '/' && *p != '\0') {
+		p++;
+		left--;
+	}
+	*len = p - *name;
+	it->pos = p;
+	it->left = left;
+	return 1;
+}
+
+//Cut path before its last component in one pass. Returns -1 if the path is
+//PATH_MAX or longer, has no components, or its last one is name_max bytes or
+//longer.
+int path_split(const char *path, size_t name_max, struct path_split *split) {
+	struct path_iter it;
+	const char *name;
+	size_t len;
+
+	split->name = NULL;
+	split->name_len = 0;
+	path_iter_init(&it, path, PATH_WHOLE);
+	while (path_next(&it, &name, &len)) {
+		split->name = name;
+		split->name_len = len;
+	}
+
+	if (it.pos - path >= PATH_MAX || split->name == NULL || split->name_len >= name_max) {
+		return -1;
+	}
+	split->parent_len = split->name - path;
+	return 0;
+}
@@ -0,0 +1,42 @@
+/*
+ *	Tiny File System
+ *
+ *	File:	path.h
+ *
+ *	Path component iteration
+ *
+ */
+
+#ifndef _PATH_H_
+#define _PATH_H_
+
+#include <stddef.h>
+
+/*
+ * Paths are walked in place: each component comes back as a pointer into the
+ * path and a length, never copied or NUL-terminated, so a walk reads each byte
+ * once and allocates nothing. Empty components ("//") and trailing slashes are
+ * skipped, and a path with no components names the directory the walk starts
+ * from.
+ */
+
+//Length for path_iter_init() that walks up to the terminating NUL
+#define PATH_WHOLE	((size_t)-1)
+
+struct path_iter {
+	const char	*pos;	/* rest of the path */
+	size_t		left;	/* bytes of it still to walk, the NUL ends it earlier */
+};
+
+//A path cut before its last component
+struct path_split {
+	size_t		parent_len;	/* path[0, parent_len) is the parent directory */
+	const char	*name;		/* the last component, name_len bytes */
+	size_t		name_len;
+};
+
+void path_iter_init(struct path_iter *it, const char *path, size_t len);
+int path_next(struct path_iter *it, const char **name, size_t *len);
+int path_split(const char *path, size_t name_max, struct path_split *split);
+
+#endif
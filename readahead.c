@@ -0,0 +1,61 @@
+/*
+ *	Tiny File System
+ *
+ *	File:	readahead.c
+ *
+ *	Sequential readahead window, see readahead.h
+ *
+ */
+
+#include "readahead.h"
+
+void ra_init(struct ra_state *ra) {
+	pthread_mutex_init(&ra->lock, NULL);
+	ra->next = 0;
+	ra->window = 0;
+	ra->end = 0;
+}
+
+void ra_destroy(struct ra_state *ra) {
+	pthread_mutex_destroy(&ra->lock);
+}
+
+//Record a read of count blocks from first, in a file of limit blocks, with windows
+//of at most max blocks. Returns how many blocks from *start to read ahead now, 0
+//for none.
+uint32_t ra_advance(struct ra_state *ra, uint32_t first, uint32_t count, uint32_t max, uint32_t limit, uint32_t *start) {
+	uint32_t want = 0;
+
+	pthread_mutex_lock(&ra->lock);
+
+	// Step 1: Grow the window on a sequential read, close it on any other
+	if (max == 0 || first != ra->next) {
+		ra->window = 0;
+		ra->end = 0;
+	} else if (ra->window == 0) {
+		ra->window = 2 * count > RA_MIN_BLOCKS ? 2 * count : RA_MIN_BLOCKS;
+	} else {
+		ra->window *= 2;
+	}
+	if (ra->window > max) {
+		ra->window = max;
+	}
+	ra->next = first + count;
+
+	// Step 2: Top the window up once less than half of it is left
+	if (ra->window > 0) {
+		uint32_t from = ra->end > ra->next ? ra->end : ra->next;
+		uint32_t to = ra->next + ra->window;
+		if (to > limit) {
+			to = limit;
+		}
+		if (from < to && from - ra->next < ra->window / 2) {
+			*start = from;
+			want = to - from;
+			ra->end = to;
+		}
+	}
+
+	pthread_mutex_unlock(&ra->lock);
+	return want;
+}
@@ -0,0 +1,41 @@
+/*
+ *	Tiny File System
+ *
+ *	File:	readahead.h
+ *
+ *	Sequential readahead window, one per open file
+ *
+ */
+
+#ifndef _READAHEAD_H_
+#define _READAHEAD_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Each read of an open file is checked against where the previous one ended.
+ * The first read that continues it opens a window of RA_MIN_BLOCKS, or twice
+ * the read if that is more; every further sequential read doubles the window
+ * up to the configured maximum, and any other read closes it again. Blocks
+ * are asked for once the unread part of the window drops below half of it,
+ * in one batch reaching a full window past the read, so the block layer sees
+ * few large requests. Block numbers are logical, within the file.
+ */
+#define RA_MIN_BLOCKS	8
+
+//Default largest window, in KB (the readahead_kb mount option)
+#define DEFAULT_READAHEAD_KB	1024
+
+struct ra_state {
+	pthread_mutex_t	lock;
+	uint32_t		next;	/* block a sequential read starts at */
+	uint32_t		window;	/* blocks, 0 while access looks random */
+	uint32_t		end;	/* blocks before this were asked for already */
+};
+
+void ra_init(struct ra_state *ra);
+void ra_destroy(struct ra_state *ra);
+uint32_t ra_advance(struct ra_state *ra, uint32_t first, uint32_t count, uint32_t max, uint32_t limit, uint32_t *start);
+
+#endif
@@ -0,0 +1,122 @@
+/*
+ *	Tiny File System
+ *
+ *	File:	stats.c
+ *
+ *	Per-operation call counts and latency histograms
+ *
+ */
+
+#include <time.h>
+
+#include "stats.h"
+
+//Monotonic clock in ns, the start argument of stats_record()
+uint64_t stats_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int stats_bucket(uint64_t ns) {
+	int b = ns ? 64 - __builtin_clzll(ns) : 0;
+	return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
+}
+
+//Count one call of op that started at start and returned ret
+void stats_record(struct op_stats *op, uint64_t start, int ret) {
+	uint64_t ns = stats_now() - start;
+	unsigned long max = __atomic_load_n(&op->max_ns, __ATOMIC_RELAXED);
+
+	__atomic_fetch_add(&op->calls, 1, __ATOMIC_RELAXED);
+	if (ret < 0) {
+		__atomic_fetch_add(&op->errors, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_fetch_add(&op->total_ns, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&op->hist[stats_bucket(ns)], 1, __ATOMIC_RELAXED);
+	while (ns > max && !__atomic_compare_exchange_n(&op->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+//Upper bound of bucket b, in us
+static double stats_bound_us(int b) {
+	return (double)(1ULL << b) / 1000.0;
+}
+
+//Upper bound of the bucket holding the p-th fraction of calls, in us, but no
+//more than the slowest call seen
+static double stats_percentile(unsigned long *hist, unsigned long calls, double p, double max) {
+	unsigned long want = (unsigned long)(p * calls);
+	unsigned long seen = 0;
+	int b;
+
+	for (b = 0; b < STATS_BUCKETS; b++) {
+		seen += hist[b];
+		if (seen > want) {
+			break;
+		}
+	}
+	if (b == STATS_BUCKETS) {
+		b--;
+	}
+	return stats_bound_us(b) < max ? stats_bound_us(b) : max;
+}
+
+//Table of the operations that were called, then their histograms. Percentiles
+//are bucket upper bounds, so they are accurate to a factor of two.
+void stats_print(FILE *out, struct op_stats *ops, int count) {
+	unsigned long hist[STATS_BUCKETS];
+	double max;
+	int i, b;
+
+	fprintf(out, "operations:\n");
+	fprintf(out, "  %-10s %10s %8s %10s %10s %10s %10s %10s\n", "op", "calls", "errors",
+		"avg us", "p50 us", "p99 us", "p999 us", "max us");
+	for (i = 0; i < count; i++) {
+		struct op_stats *op = &ops[i];
+		unsigned long calls = __atomic_load_n(&op->calls, __ATOMIC_RELAXED);
+		if (calls == 0) {
+			continue;
+		}
+		for (b = 0; b < STATS_BUCKETS; b++) {
+			hist[b] = __atomic_load_n(&op->hist[b], __ATOMIC_RELAXED);
+		}
+		max = __atomic_load_n(&op->max_ns, __ATOMIC_RELAXED) / 1000.0;
+		fprintf(out, "  %-10s %10lu %8lu %10.1f %10.1f %10.1f %10.1f %10.1f\n", op->name, calls,
+			__atomic_load_n(&op->errors, __ATOMIC_RELAXED),
+			__atomic_load_n(&op->total_ns, __ATOMIC_RELAXED) / 1000.0 / calls,
+			stats_percentile(hist, calls, 0.5, max), stats_percentile(hist, calls, 0.99, max),
+			stats_percentile(hist, calls, 0.999, max), max);
+	}
+
+	fprintf(out, "latency histograms (calls taking less than each bound in us):\n");
+	for (i = 0; i < count; i++) {
+		struct op_stats *op = &ops[i];
+		if (__atomic_load_n(&op->calls, __ATOMIC_RELAXED) == 0) {
+			continue;
+		}
+		fprintf(out, "  %-10s", op->name);
+		for (b = 0; b < STATS_BUCKETS; b++) {
+			unsigned long n = __atomic_load_n(&op->hist[b], __ATOMIC_RELAXED);
+			if (n) {
+				fprintf(out, " %g:%lu", stats_bound_us(b), n);
+			}
+		}
+		fprintf(out, "\n");
+	}
+}
+
+//Zero every counter, keeping the names
+void stats_reset(struct op_stats *ops, int count) {
+	int i, b;
+
+	for (i = 0; i < count; i++) {
+		__atomic_store_n(&ops[i].calls, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&ops[i].errors, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&ops[i].total_ns, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&ops[i].max_ns, 0, __ATOMIC_RELAXED);
+		for (b = 0; b < STATS_BUCKETS; b++) {
+			__atomic_store_n(&ops[i].hist[b], 0, __ATOMIC_RELAXED);
+		}
+	}
+}
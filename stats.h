@@ -0,0 +1,36 @@
+/*
+ *	Tiny File System
+ *
+ *	File:	stats.h
+ *
+ *	Per-operation call counts and latency histograms
+ *
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+//Latency buckets: bucket b counts calls that took [2^(b-1), 2^b) ns, the last
+//one everything slower
+#define STATS_BUCKETS	40
+
+//One operation's counters. Updated with relaxed atomics from any thread, and
+//cache line aligned so different operations never share a line.
+struct op_stats {
+	const char		*name;
+	unsigned long	calls;
+	unsigned long	errors;		/* calls that returned < 0 */
+	unsigned long	total_ns;
+	unsigned long	max_ns;
+	unsigned long	hist[STATS_BUCKETS];
+} __attribute__((aligned(64)));
+
+uint64_t stats_now();
+void stats_record(struct op_stats *op, uint64_t start, int ret);
+void stats_print(FILE *out, struct op_stats *ops, int count);
+void stats_reset(struct op_stats *ops, int count);
+
+#endif
@@ -20,528 +20,3298 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <sys/statvfs.h>
 #include <libgen.h>
 #include <limits.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "block.h"
 #include "tfs.h"
+#include "journal.h"
+#include "stats.h"
+#include "trace.h"
+#include "readahead.h"
+#include "path.h"
+#include "arena.h"
 
 #include <ctype.h>
 
 char diskfile_path[PATH_MAX];
 char *disk_path = "./disk";
 
+/*
+ * Mount options, given as "-o name=value" on the command line
+ *   disk_mb=N	size of the disk file created by mkfs in MB
+ *   inodes=N	number of inodes mkfs sets aside
+ *   		(both only matter when the disk file holds no tfs image yet)
+ *   cache_mb=N	memory budget of the block cache in MB (0 disables it)
+ *   readahead_kb=N	largest readahead window of a sequentially read file in KB
+ *   		(0 disables readahead)
+ *   dirty_mb=N	memory for written file data not yet given blocks, in MB
+ *   		(0 allocates and writes on every write)
+ *   backend=pread	read and write the disk file with pread/pwrite (default)
+ *   backend=mmap	map the disk file and copy file data straight out of the mapping
+ *   backend=uring	batch block I/O through io_uring (falls back to pread if unavailable)
+ *
+ * "tfs --mkfs -o disk_mb=N,inodes=N" only formats the disk file and exits.
+ */
+struct tfs_config {
+	unsigned long disk_mb;
+	unsigned int inodes;
+	unsigned int cache_mb;
+	unsigned int readahead_kb;
+	unsigned int dirty_mb;
+	int backend;
+	int mkfs_only;
+};
+
+struct tfs_config tfs_config = {
+	.disk_mb = DEFAULT_DISK_SIZE / (1024 * 1024),
+	.inodes = DEFAULT_INUM,
+	.cache_mb = DEFAULT_CACHE_SIZE / (1024 * 1024),
+	.readahead_kb = DEFAULT_READAHEAD_KB,
+	.dirty_mb = DEFAULT_DIRTY_MB,
+	.backend = BIO_BACKEND_PREAD,
+};
+
+#define TFS_OPT(t, p, v) { t, offsetof(struct tfs_config, p), v }
+
+static struct fuse_opt tfs_opts[] = {
+	TFS_OPT("disk_mb=%lu", disk_mb, 0),
+	TFS_OPT("inodes=%u", inodes, 0),
+	TFS_OPT("--mkfs", mkfs_only, 1),
+	TFS_OPT("cache_mb=%u", cache_mb, 0),
+	TFS_OPT("readahead_kb=%u", readahead_kb, 0),
+	TFS_OPT("dirty_mb=%u", dirty_mb, 0),
+	TFS_OPT("backend=pread", backend, BIO_BACKEND_PREAD),
+	TFS_OPT("backend=mmap", backend, BIO_BACKEND_MMAP),
+	TFS_OPT("backend=uring", backend, BIO_BACKEND_URING),
+	FUSE_OPT_END
+};
+
 /*------------------------------------------
  Declare your in-memory data structures here
  -------------------------------------------*/
-bitmap_t inode_bit_map;
-bitmap_t data_bit_map;
 struct superblock *sb;
 
-int numBlocksForInodes;
+/*
+ * Bitmap allocator state, one for the inodes and one for the data blocks of
+ * each allocation group. The bitmap (words, also readable with get_bitmap())
+ * is scanned a 64-bit word at a time. summary has one bit per bitmap word, set
+ * while the word still has a free bit, so full regions are skipped 4096 bits
+ * per summary word. Allocation resumes from hint (next-fit) and free counts
+ * are kept here.
+ * The bitmap spans BITMAP_BLOCKS(nbits) consecutive disk blocks; changes only
+ * reach the disk when bitmap_sync() runs, and then only the blocks marked in
+ * dirty are written. Every entry point
+ * takes lock, so allocations from concurrent FUSE threads never race. At
+ * mount the bitmaps are read by a background thread; until it sets loaded,
+ * entry points wait on ready.
+ */
+struct balloc {
+	uint64_t	*words;		/* bitmap, nblocks BLOCK_SIZE buffers, same bit order as set_bitmap() */
+	uint64_t	*summary;	/* bit w set while words[w] has a free bit */
+	uint32_t	nbits;		/* number of allocatable bits */
+	uint32_t	nwords;		/* words covering nbits */
+	uint32_t	hint;		/* word the next search starts from */
+	uint32_t	nfree;		/* free bits left */
+	uint32_t	bitmap_blk;	/* where the bitmap starts on disk */
+	uint32_t	nblocks;	/* bitmap blocks */
+	uint8_t		*dirty;		/* per bitmap block, changed since last written */
+	int			loaded;		/* words and counts are valid */
+	unsigned long	allocs;	/* bits handed out, for balloc_stats() */
+	unsigned long	frees;	/* bits given back */
+	pthread_mutex_t	lock;	/* serializes allocation, freeing and syncing */
+	pthread_cond_t	ready;	/* signalled when loaded is set */
+};
+
+/*
+ * Allocation groups, see the layout in tfs.h. Each group has its own pair of
+ * allocators, so allocations in different groups never wait for each other's
+ * lock, and placement decides which group an allocation comes from: a file's
+ * inode and blocks go in its parent directory's group, keeping a directory's
+ * files close together on disk, while new directories are spread over the
+ * groups with the most room left (see dirGroup()). Only when its group is
+ * full does an allocation move on to the groups after it.
+ */
+struct group {
+	struct balloc	inodes;		/* inode numbers from g * inodes_per_group on */
+	struct balloc	blocks;		/* data blocks from gdt[g].d_start_blk on */
+};
+
+struct group *groups;			/* sb->ngroups of them */
+struct group_desc *gdt;			/* the group descriptor blocks, as on disk */
+uint32_t gdt_blocks;
+uint32_t group_rotor;			/* group the next directory search starts from */
+pthread_t bitmap_loader;
+int bitmap_loading;
+
+// Covers growing the initialized part of an inode table, see itable_init()
+pthread_mutex_t itable_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Runtime statistics. Every FUSE handler is timed by its wrapper into
+ * op_stats. Everything the file system counts - these, the block layer, the
+ * allocators, the caches and the journal - can be read at runtime from the
+ * virtual file TFS_STATS_PATH, and writing to it zeroes the counters.
+ */
+#define TFS_STATS_PATH	"/.tfs_stats"
+
+enum {
+	OP_GETATTR, OP_OPENDIR, OP_READDIR, OP_RELEASEDIR, OP_MKDIR, OP_RMDIR,
+	OP_CREATE, OP_OPEN, OP_READ, OP_WRITE, OP_UNLINK, OP_TRUNCATE,
+	OP_RELEASE, OP_FLUSH, OP_FSYNC, OP_STATFS, OP_UTIMENS, OP_COUNT
+};
+
+struct op_stats op_stats[OP_COUNT] = {
+	[OP_GETATTR] = { .name = "getattr" },
+	[OP_OPENDIR] = { .name = "opendir" },
+	[OP_READDIR] = { .name = "readdir" },
+	[OP_RELEASEDIR] = { .name = "releasedir" },
+	[OP_MKDIR] = { .name = "mkdir" },
+	[OP_RMDIR] = { .name = "rmdir" },
+	[OP_CREATE] = { .name = "create" },
+	[OP_OPEN] = { .name = "open" },
+	[OP_READ] = { .name = "read" },
+	[OP_WRITE] = { .name = "write" },
+	[OP_UNLINK] = { .name = "unlink" },
+	[OP_TRUNCATE] = { .name = "truncate" },
+	[OP_RELEASE] = { .name = "release" },
+	[OP_FLUSH] = { .name = "flush" },
+	[OP_FSYNC] = { .name = "fsync" },
+	[OP_STATFS] = { .name = "statfs" },
+	[OP_UTIMENS] = { .name = "utimens" },
+};
+
+// Contents of the stats file as of open(), kept in fi->fh until release()
+struct stats_snapshot {
+	char	*buf;
+	size_t	len;
+};
+
+// An open regular file or directory, kept in fi->fh until release() or
+// releasedir(). Operations on the handle find the inode by number instead of
+// walking the path again, and reads reuse the last extent they mapped.
+struct tfs_file {
+	uint32_t		ino;
+	struct inode	*pinned;	/* icache pin, NULL once handles hold their share */
+	struct ra_state	ra;
+	pthread_mutex_t	map_lock;	/* covers the cached extent below */
+	uint32_t		map_gen;	/* imap_gen() of the inode when it was cached */
+	uint32_t		map_lblk;	/* first logical block of the cached extent */
+	uint32_t		map_pblk;
+	uint32_t		map_len;	/* 0 if nothing is cached */
+};
+
+/*
+ * In-memory inode cache. Holds up to ICACHE_SIZE inodes keyed by inode
+ * number. Entries pinned through iget() are never evicted; unpinned ones are
+ * reclaimed CLOCK-style, writing them back first if they are dirty.
+ *
+ * Locking: icache_lock covers the hash table, the CLOCK state and copies in
+ * and out of cached inodes (readi()/writei()), so an inode is never seen
+ * half-written. Every entry also carries a reader/writer lock taken through
+ * ilock(): operations hold it across a whole read-modify-write of the inode
+ * and its blocks - shared to read a file or search a directory, exclusive to
+ * write, truncate, or add and remove directory entries. A parent directory is
+ * always locked before a child, and path walks hold one directory at a time.
+ * The allocators and the dentry cache have their own locks, taken last.
+ */
+#define ICACHE_SIZE		256
+#define ICACHE_BUCKETS	512
+#define ICACHE_HANDLE_PINS	(ICACHE_SIZE / 2)	/* most entries open handles may pin */
+
+struct icache_entry {
+	struct inode		inode;		/* cached copy of the on-disk inode */
+	int					ino;		/* inode number, -1 if the slot is unused */
+	int					refcount;	/* pins held through iget() */
+	int					dirty;		/* modified since last written back */
+	int					referenced;	/* CLOCK second-chance bit */
+	uint32_t			mapgen;		/* changes whenever blocks are unmapped, see imap_gen() */
+	pthread_rwlock_t	lock;		/* inode lock, see ilock() */
+	struct icache_entry	*next;		/* hash bucket chain */
+};
+
+struct icache_entry icache[ICACHE_SIZE];
+struct icache_entry *icache_buckets[ICACHE_BUCKETS];
+pthread_mutex_t icache_lock = PTHREAD_MUTEX_INITIALIZER;
+int icache_hand;
+int icache_handles;			/* pins held by open handles, see iget_handle() */
+uint32_t icache_mapgen;		/* last mapgen handed out */
+uint32_t ino_frees;			/* inode numbers given back, see get_locked_node_by_path() */
+unsigned long icache_hits;
+unsigned long icache_misses;
+
+/*
+ * Dentry cache. Maps (parent directory inode, name) to the child's inode
+ * number so repeated path walks skip dir_find(). A miss in the directory is
+ * cached too, as a negative entry with ino DCACHE_NEGATIVE. Entries are only
+ * inserted with the parent directory locked (shared after a dir_find(),
+ * exclusive after a change), so a stale result can't overwrite a newer one.
+ */
+#define DCACHE_SIZE		1024
+#define DCACHE_BUCKETS	2048
+#define DCACHE_NEGATIVE	-1
+
+struct dcache_entry {
+	int					parent;		/* parent directory inode, -1 if the slot is unused */
+	int					ino;		/* child inode number or DCACHE_NEGATIVE */
+	int					referenced;	/* CLOCK second-chance bit */
+	size_t				name_len;
+	char				name[DIRENT_NAME_LEN];
+	struct dcache_entry	*next;		/* hash bucket chain */
+};
+
+struct dcache_entry dcache[DCACHE_SIZE];
+struct dcache_entry *dcache_buckets[DCACHE_BUCKETS];
+pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+int dcache_hand;
+unsigned long dcache_hits;
+unsigned long dcache_misses;
+
+/*
+ * Delayed allocation. Writes to a file that lives in data blocks are copied
+ * into dirty pages kept per inode, together with the size and mtime they
+ * set, instead of being mapped and written right away. Blocks are allocated
+ * and the pages written only when the file is flushed: on flush() and
+ * release(), fsync() and truncate(), when the buffered pages go over the
+ * dirty_mb budget, or from the writeback thread once they are
+ * DELALLOC_EXPIRE_SECS old. The allocator then sees the whole dirty range
+ * at once and can give it one contiguous run, and a file appended to in
+ * small records costs one inode update per flush instead of one per write.
+ * A page over a hole reserves a data block when it is created, so a flush
+ * does not run out of space.
+ *
+ * Locking: the pages of a file are only touched under its inode lock -
+ * exclusive to add, change or flush them, shared to read them. delalloc.lock
+ * covers the table of files, the counters, and each file's size and mtime,
+ * which getattr() reads without the inode lock.
+ */
+#define DELALLOC_BUCKETS		256
+#define DELALLOC_EXPIRE_SECS	5
+
+struct dpage {
+	uint32_t		lblk;
+	int				reserved;	/* over a hole: holds a block reservation */
+	struct dpage	*next;		/* hash bucket chain of the file */
+	char			data[BLOCK_SIZE];
+};
+
+struct dfile {
+	uint32_t		ino;
+	uint32_t		size;		/* file size, buffered writes included */
+	time_t			mtime;
+	time_t			dirtied;	/* when the oldest page was buffered */
+	struct dpage	**pages;	/* hash table by logical block */
+	uint32_t		nbuckets;
+	uint32_t		npages;
+	int				failed;		/* the last flush failed for a reason other than space */
+	struct dfile	*next;		/* hash bucket chain of the table */
+};
+
+struct delalloc {
+	pthread_mutex_t	lock;
+	pthread_cond_t	wake;		/* wakes the writeback thread */
+	struct dfile	*buckets[DELALLOC_BUCKETS];
+	uint32_t		npages;		/* buffered pages of all files */
+	uint32_t		maxpages;	/* dirty_mb budget */
+	uint32_t		reserved;	/* data blocks promised to pages over holes */
+	int				running;	/* the writeback thread is started */
+	int				stop;
+	pthread_t		thread;
+	unsigned long	writes;		/* writes buffered */
+	unsigned long	flushes;	/* files flushed */
+	unsigned long	flushed;	/* pages written by them */
+	unsigned long	runs;		/* block runs allocated for them */
+};
+
+struct delalloc delalloc = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+// Reservations of the pages the calling thread is flushing, which
+// get_avail_blkrun() may spend instead of reserving blocks of its own
+static __thread uint32_t delalloc_held;
 
 /*--------------------------
 	Helper function headers
 ----------------------------*/
 
-void printInodeBitMap();
-void printDataBitMap();
+void printInodeBitMap(FILE *out);
+void printDataBitMap(FILE *out);
+
+void balloc_init(struct balloc *ba, uint32_t nbits, uint32_t bitmap_blk, int load);
+void balloc_recount(struct balloc *ba);
+int bitmap_load();
+void bitmap_wait();
+int balloc_alloc(struct balloc *ba);
+int balloc_alloc_run(struct balloc *ba, uint32_t goal, uint32_t want, uint32_t *got);
+void balloc_free(struct balloc *ba, uint32_t bit);
+uint32_t balloc_nfree(struct balloc *ba);
+int bitmap_sync();
+int flush_metadata();
+
+struct inode *get_locked_node_by_path(const char *path, size_t len, int exclusive, struct inode *inode);
+struct inode *get_locked_node_by_handle(const char *path, struct fuse_file_info *fi, int exclusive, struct inode *inode);
+int bmap(struct inode *inode, int lblk, int create);
+int mapRun(struct inode *inode, uint32_t lblk, uint32_t want, int create, uint32_t *pblk, uint32_t *len);
+uint32_t bmap_run(struct inode *inode, uint32_t lblk, uint32_t want, int create, uint32_t *len);
+int truncateInodeBlocks(struct inode *inode, uint32_t keepBlocks);
+struct tfs_file *openFile(uint32_t ino);
+void closeFile(struct tfs_file *file);
+uint32_t fileBmap(struct tfs_file *file, struct inode *locked, struct inode *inode, uint32_t lblk, uint32_t want, uint32_t *len);
+void readaheadInode(struct tfs_file *file, struct inode *locked, struct inode *inode, uint32_t firstBlk, uint32_t lastBlk);
+void freeInodeBlocks(struct inode *inode);
+int dir_is_empty(struct inode *dir_inode);
+void initInode(struct inode *inode, uint32_t ino, uint32_t type, mode_t mode);
+
+int readInodeFromDisk(uint32_t ino, struct inode *inode);
+int writeInodeToDisk(uint32_t ino, struct inode *inode);
+
+void icache_init();
+struct inode *iget(uint32_t ino);
+void iput(struct inode *inode);
+void imark_dirty(struct inode *inode);
+struct inode *ilock(uint32_t ino, int exclusive);
+void iunlock(struct inode *inode);
+struct inode *iget_handle(uint32_t ino);
+void iput_handle(struct inode *inode);
+uint32_t imap_gen(struct inode *locked);
+void imap_changed(uint32_t ino);
+int icache_sync();
+void icache_stats(FILE *out);
+void icache_stats_reset();
+
+void dcache_init();
+int dcache_lookup(uint32_t parent, const char *name, size_t name_len, int *ino);
+void dcache_insert(uint32_t parent, const char *name, size_t name_len, int ino);
+void dcache_purge_dir(uint32_t parent);
+void dcache_stats(FILE *out);
+void dcache_stats_reset();
+
+void delalloc_start(uint32_t maxpages);
+void delalloc_stop();
+int delalloc_write(struct inode *inode, const char *buffer, size_t size, off_t offset);
+void delalloc_read(struct inode *inode, char *buffer, size_t size, off_t offset);
+uint32_t delalloc_size(struct inode *inode);
+void delalloc_getattr(uint32_t ino, struct stat *stbuf);
+void delalloc_trim(uint32_t ino, uint32_t size);
+int delalloc_flush(struct inode *inode);
+int delalloc_flush_ino(uint32_t ino);
+void delalloc_discard(uint32_t ino);
+uint32_t delalloc_reserved();
+void delalloc_stats(FILE *out);
+void delalloc_stats_reset();
+
+/*------------------
+	Main functions
+--------------------*/
+
+/* ----------------------------------------
+ * Bitmap allocator
+ ------------------------------------------*/
+
+// Set up ba over an nbits-long bitmap stored from bitmap_blk on, starting with
+// everything free. If load is set the bitmap is left for bitmap_load() to read
+// and count instead, so its memory is only touched once.
+void balloc_init(struct balloc *ba, uint32_t nbits, uint32_t bitmap_blk, int load) {
+	ba->nbits = nbits;
+	ba->nwords = (nbits + 63) / 64;
+	ba->bitmap_blk = bitmap_blk;
+	ba->nblocks = BITMAP_BLOCKS(nbits);
+	ba->hint = 0;
+	ba->loaded = !load;
+	pthread_mutex_init(&ba->lock, NULL);
+	pthread_cond_init(&ba->ready, NULL);
+
+	ba->words = calloc(ba->nblocks, BLOCK_SIZE);
+	ba->summary = calloc((ba->nwords + 63) / 64, sizeof(uint64_t));
+	ba->dirty = calloc(ba->nblocks, 1);
+	if(!load){
+		balloc_recount(ba);
+	}
+}
+
+// Rebuild the free count and the summary from the bitmap words
+void balloc_recount(struct balloc *ba) {
+	uint32_t w;
+
+	// bits past nbits in the last word are never handed out
+	if(ba->nbits % 64){
+		ba->words[ba->nwords - 1] |= ~0ULL << (ba->nbits % 64);
+	}
+
+	memset(ba->summary, 0, (ba->nwords + 63) / 64 * sizeof(uint64_t));
+	ba->nfree = 0;
+	for(w = 0; w < ba->nwords; w++){
+		ba->nfree += __builtin_popcountll(~ba->words[w]);
+		if(~ba->words[w]){
+			ba->summary[w / 64] |= 1ULL << (w % 64);
+		}
+	}
+}
+
+// Find a free bit at or after the hint word, wrapping around once. Returns -1 if the bitmap is full.
+static int balloc_find(struct balloc *ba) {
+	uint32_t nsummary = (ba->nwords + 63) / 64;
+	uint32_t first = ba->hint / 64;
+	uint32_t k;
+
+	if(ba->nfree == 0){
+		return -1;
+	}
+
+	// Step 1: Walk the summary from the hint. The summary word holding the hint
+	// is visited twice: first for words at or after the hint, at the end for
+	// words before it.
+	for(k = 0; k <= nsummary; k++){
+		uint32_t s = (first + k) % nsummary;
+		uint64_t candidates = ba->summary[s];
+		if(k == 0){
+			candidates &= ~0ULL << (ba->hint % 64);
+		} else if(k == nsummary){
+			candidates &= ~(~0ULL << (ba->hint % 64));
+		}
+		if(candidates == 0){
+			continue;
+		}
+
+		// Step 2: First non-full word, then its first free bit
+		uint32_t w = s * 64 + __builtin_ctzll(candidates);
+		return w * 64 + __builtin_ctzll(~ba->words[w]);
+	}
+	return -1;
+}
+
+// Mark bits [start, start + len) used and keep the summary in step
+static void balloc_mark(struct balloc *ba, uint32_t start, uint32_t len) {
+	uint32_t bit;
+	for(bit = start; bit < start + len; bit++){
+		uint32_t w = bit / 64;
+		ba->words[w] |= 1ULL << (bit % 64);
+		if(ba->words[w] == ~0ULL){
+			ba->summary[w / 64] &= ~(1ULL << (w % 64));
+		}
+	}
+	ba->nfree -= len;
+	ba->hint = (start + len - 1) / 64;
+	for(bit = start / BITS_PER_BLOCK; bit <= (start + len - 1) / BITS_PER_BLOCK; bit++){
+		ba->dirty[bit] = 1;
+	}
+}
+
+// Wait for the background bitmap load, called with ba->lock held
+static void balloc_wait(struct balloc *ba) {
+	while(!ba->loaded){
+		pthread_cond_wait(&ba->ready, &ba->lock);
+	}
+}
+
+// Find, mark used and return a free bit, or -1 if the bitmap is full
+int balloc_alloc(struct balloc *ba) {
+	pthread_mutex_lock(&ba->lock);
+	balloc_wait(ba);
+	int bit = balloc_find(ba);
+	if(bit >= 0){
+		balloc_mark(ba, bit, 1);
+		ba->allocs++;
+	}
+	pthread_mutex_unlock(&ba->lock);
+	return bit;
+}
+
+// Allocate a run of up to want contiguous free bits, starting at goal if it is
+// free and at the next free bit otherwise. Returns the first bit and the run
+// length in *got, or -1 if the bitmap is full.
+int balloc_alloc_run(struct balloc *ba, uint32_t goal, uint32_t want, uint32_t *got) {
+	int start;
+
+	if(want == 0){
+		return -1;
+	}
+	pthread_mutex_lock(&ba->lock);
+	balloc_wait(ba);
+
+	// Step 1: Pick the first bit of the run
+	if(goal < ba->nbits && !(ba->words[goal / 64] & (1ULL << (goal % 64)))){
+		start = goal;
+	} else {
+		if(goal < ba->nbits){
+			ba->hint = goal / 64;
+		}
+		start = balloc_find(ba);
+		if(start < 0){
+			pthread_mutex_unlock(&ba->lock);
+			return -1;
+		}
+	}
+
+	// Step 2: Extend it a word at a time while the bits stay free
+	uint32_t len = 0;
+	uint32_t bit = start;
+	while(len < want && bit < ba->nbits){
+		uint32_t shift = bit % 64;
+		uint64_t used = ba->words[bit / 64] >> shift;
+		uint32_t freeHere = used ? __builtin_ctzll(used) : 64 - shift;
+		uint32_t take = freeHere < want - len ? freeHere : want - len;
+
+		len += take;
+		bit += take;
+		if(take == 0 || bit % 64 != 0){
+			// stopped on a used bit, or got everything asked for
+			break;
+		}
+	}
+
+	// Step 3: Mark the run used
+	balloc_mark(ba, start, len);
+	ba->allocs += len;
+	pthread_mutex_unlock(&ba->lock);
+	*got = len;
+	return start;
+}
+
+void balloc_free(struct balloc *ba, uint32_t bit) {
+	uint32_t w = bit / 64;
+
+	if(bit >= ba->nbits){
+		return;
+	}
+	pthread_mutex_lock(&ba->lock);
+	balloc_wait(ba);
+	if(ba->words[w] & (1ULL << (bit % 64))){
+		ba->words[w] &= ~(1ULL << (bit % 64));
+		ba->summary[w / 64] |= 1ULL << (w % 64);
+		ba->nfree++;
+		ba->frees++;
+		ba->dirty[bit / BITS_PER_BLOCK] = 1;
+	}
+	pthread_mutex_unlock(&ba->lock);
+}
+
+// Free bits left, once the bitmap is loaded
+uint32_t balloc_nfree(struct balloc *ba) {
+	pthread_mutex_lock(&ba->lock);
+	balloc_wait(ba);
+	uint32_t nfree = ba->nfree;
+	pthread_mutex_unlock(&ba->lock);
+	return nfree;
+}
+
+static int balloc_sync(struct balloc *ba) {
+	int ret = 0;
+	uint32_t i;
+	pthread_mutex_lock(&ba->lock);
+	balloc_wait(ba);
+	for(i = 0; i < ba->nblocks; i++){
+		if(!ba->dirty[i]){
+			continue;
+		}
+		ba->dirty[i] = 0;
+		if(journal_write(ba->bitmap_blk + i, (char *)ba->words + (size_t)i * BLOCK_SIZE) < 0){
+			ret = -1;
+		}
+	}
+	pthread_mutex_unlock(&ba->lock);
+	return ret;
+}
+
+// Totals of one kind of allocator over every group, with the fewest and most
+// free bits any single group has left
+static void balloc_stats(FILE *out, const char *name, int data) {
+	uint32_t nfree = 0, nbits = 0, minFree = UINT32_MAX, maxFree = 0;
+	unsigned long allocs = 0, frees = 0;
+	uint32_t g;
+
+	for(g = 0; g < sb->ngroups; g++){
+		struct balloc *ba = data ? &groups[g].blocks : &groups[g].inodes;
+		pthread_mutex_lock(&ba->lock);
+		uint32_t groupFree = ba->loaded ? ba->nfree : 0;
+		nfree += groupFree;
+		nbits += ba->nbits;
+		allocs += ba->allocs;
+		frees += ba->frees;
+		pthread_mutex_unlock(&ba->lock);
+		minFree = groupFree < minFree ? groupFree : minFree;
+		maxFree = groupFree > maxFree ? groupFree : maxFree;
+	}
+	fprintf(out, "%s allocator: %u of %u free (%u to %u in each of %u groups), %lu allocated, %lu freed\n",
+		name, nfree, nbits, minFree, maxFree, sb->ngroups, allocs, frees);
+}
+
+static void balloc_stats_reset(struct balloc *ba) {
+	pthread_mutex_lock(&ba->lock);
+	ba->allocs = ba->frees = 0;
+	pthread_mutex_unlock(&ba->lock);
+}
+
+static void balloc_destroy(struct balloc *ba) {
+	free(ba->words);
+	free(ba->summary);
+	free(ba->dirty);
+	pthread_mutex_destroy(&ba->lock);
+	pthread_cond_destroy(&ba->ready);
+}
+
+// Free bits left in the inode (data == 0) or data allocators of every group,
+// once the bitmaps are loaded
+static uint32_t groups_nfree(int data) {
+	uint32_t nfree = 0;
+	uint32_t g;
+	for(g = 0; g < sb->ngroups; g++){
+		nfree += balloc_nfree(data ? &groups[g].blocks : &groups[g].inodes);
+	}
+	return nfree;
+}
+
+// Count a bitmap read by bitmap_load() and let waiting entry points in
+static void balloc_loaded(struct balloc *ba) {
+	pthread_mutex_lock(&ba->lock);
+	balloc_recount(ba);
+	ba->loaded = 1;
+	pthread_cond_broadcast(&ba->ready);
+	pthread_mutex_unlock(&ba->lock);
+}
+
+// Read the bitmaps of every group of a mounted image. They all come in with a
+// single vectored read straight into the allocators; a group's two bitmap
+// blocks sit next to each other on disk.
+int bitmap_load() {
+	uint32_t count = 2 * sb->ngroups;
+	int *block_nums = malloc(count * sizeof(int));
+	void **bufs = malloc(count * sizeof(void *));
+	uint32_t g;
+	int ret;
+
+	for(g = 0; g < sb->ngroups; g++){
+		block_nums[2 * g] = groups[g].inodes.bitmap_blk;
+		bufs[2 * g] = groups[g].inodes.words;
+		block_nums[2 * g + 1] = groups[g].blocks.bitmap_blk;
+		bufs[2 * g + 1] = groups[g].blocks.words;
+	}
+	ret = bio_readv(block_nums, bufs, count);
+	free(block_nums);
+	free(bufs);
+
+	for(g = 0; g < sb->ngroups; g++){
+		balloc_loaded(&groups[g].inodes);
+		balloc_loaded(&groups[g].blocks);
+	}
+	return ret < 0 ? -1 : 0;
+}
+
+// Background half of tfs_mount(): the bitmaps grow with the disk, so reading
+// and counting them is kept off the mount path
+static void *bitmap_load_thread(void *arg) {
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if(bitmap_load() < 0){
+		fprintf(stderr, "tfs: reading bitmaps failed\n");
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("tfs: loaded %u bitmap blocks in %.3f ms\n", 2 * sb->ngroups,
+		(end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+	return NULL;
+}
+
+// Wait until every bitmap is loaded
+void bitmap_wait() {
+	uint32_t g;
+	for(g = 0; g < sb->ngroups; g++){
+		pthread_mutex_lock(&groups[g].inodes.lock);
+		balloc_wait(&groups[g].inodes);
+		pthread_mutex_unlock(&groups[g].inodes.lock);
+		pthread_mutex_lock(&groups[g].blocks.lock);
+		balloc_wait(&groups[g].blocks);
+		pthread_mutex_unlock(&groups[g].blocks.lock);
+	}
+}
+
+// Write the inode and data bitmaps back if allocations changed them
+int bitmap_sync() {
+	int ret = 0;
+	uint32_t g;
+	for(g = 0; g < sb->ngroups; g++){
+		if(balloc_sync(&groups[g].inodes) < 0){
+			ret = -1;
+		}
+		if(balloc_sync(&groups[g].blocks) < 0){
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+// Flush point for in-memory metadata: dirty inodes and bitmaps go to the journal.
+// Runs at every journal commit, with no operation in progress.
+int flush_metadata() {
+	int ret = icache_sync();
+	if(bitmap_sync() < 0){
+		ret = -1;
+	}
+	return ret;
+}
+
+// Group that disk block blkno falls in, sb->ngroups for the blocks in front of group 0
+static uint32_t groupOf(uint32_t blkno) {
+	if(blkno < sb->g_start_blk || blkno >= sb->nblocks){
+		return sb->ngroups;
+	}
+	return (blkno - sb->g_start_blk) / sb->blocks_per_group;
+}
+
+// Disk block holding inode number ino
+static int inodeDiskBlock(uint32_t ino) {
+	return gdt[ino / sb->inodes_per_group].i_start_blk + (ino % sb->inodes_per_group) / INODES_PER_BLOCK;
+}
+
+/* ----------------------------------------
+ * Inode table blocks of group g from gdt[g].i_init_blks on have never been
+ * written and read as free inodes. Extend the initialized part to cover
+ * block blk of the group's inode table by zeroing the blocks in between, and
+ * record the new mark in the group descriptor in the same journal transaction.
+ ------------------------------------------*/
+static int itable_init(uint32_t g, uint32_t blk) {
+	struct group_desc *gd = &gdt[g];
+	int ret = 0;
+
+	pthread_mutex_lock(&itable_lock);
+	if(blk >= gd->i_init_blks){
+		struct arena_pos scratch = arena_mark();
+		char *zero = arena_zalloc(BLOCK_SIZE);
+		uint32_t b;
+		for(b = gd->i_init_blks; b <= blk; b++){
+			if(journal_write(gd->i_start_blk + b, zero) < 0){
+				ret = -1;
+				break;
+			}
+		}
+		arena_release(scratch);
+		if(ret == 0){
+			uint32_t gdBlock = g / GROUP_DESCS_PER_BLOCK;
+			__atomic_store_n(&gd->i_init_blks, blk + 1, __ATOMIC_RELEASE);
+			ret = journal_write(sb->gd_blk + gdBlock, (char *)gdt + (size_t)gdBlock * BLOCK_SIZE) < 0 ? -1 : 0;
+		}
+	}
+	pthread_mutex_unlock(&itable_lock);
+	return ret;
+}
+
+// Group for a new directory: the first one, going round from where the last
+// search started, with at least the average number of free inodes and data
+// blocks. Directories, and the files later created in them, spread out over
+// the disk instead of piling up in the groups at the front.
+static uint32_t dirGroup() {
+	uint64_t inodesFree = groups_nfree(0);
+	uint64_t blocksFree = groups_nfree(1);
+	uint32_t first = __atomic_fetch_add(&group_rotor, 1, __ATOMIC_RELAXED) % sb->ngroups;
+	uint32_t i;
+
+	for(i = 0; i < sb->ngroups; i++){
+		uint32_t g = (first + i) % sb->ngroups;
+		uint64_t groupInodes = balloc_nfree(&groups[g].inodes);
+		if(groupInodes > 0 && groupInodes * sb->ngroups >= inodesFree
+			&& (uint64_t)balloc_nfree(&groups[g].blocks) * sb->ngroups >= blocksFree){
+			return g;
+		}
+	}
+	return first;
+}
+
+/* ----------------------------------------
+ * Get available inode number from bitmap, for a new inode of the given type
+ * in directory parent. Files start looking in their parent's group,
+ * directories in the one dirGroup() picks.
+ ------------------------------------------*/
+int get_avail_ino(uint32_t parent, uint32_t type) {
+	uint32_t first = type == TFS_DIR ? dirGroup() : parent / sb->inodes_per_group;
+	uint32_t i;
+
+	if(first >= sb->ngroups){
+		first = 0;
+	}
+	for(i = 0; i < sb->ngroups; i++){
+		uint32_t g = (first + i) % sb->ngroups;
+		int bit = balloc_alloc(&groups[g].inodes);
+		if(bit < 0){
+			continue;
+		}
+		int ino = g * sb->inodes_per_group + bit;
+		TRACE(TRACE_INFO, TR_INO_ALLOC, ino, g);
+
+		// first inode handed out from a block that was never initialized
+		if(itable_init(g, bit / INODES_PER_BLOCK) < 0){
+			balloc_free(&groups[g].inodes, bit);
+			return -1;
+		}
+		return ino;
+	}
+	TRACE(TRACE_ERR, TR_NOSPC, 0, 0);
+	return -1;
+}
+
+// Debugging aid, not called on any operation path
+void printInodeBitMap(FILE *out){
+	uint32_t g, i;
+	fprintf(out, "Printing inode bitmap...\n");
+	for(g = 0; g < sb->ngroups; g++){
+		for(i = 0; i < groups[g].inodes.nbits; i++){
+			uint8_t inodeBitmapIndex = get_bitmap((bitmap_t)groups[g].inodes.words, i);
+			fprintf(out, "%u",inodeBitmapIndex);
+		}
+		fprintf(out, "\n");
+	}
+}
+
+// Reserve up to want data blocks without dipping into ones already promised
+// to buffered pages. Returns how many were reserved.
+static uint32_t delalloc_reserve(uint32_t want) {
+	uint32_t nfree = groups_nfree(1);
+	pthread_mutex_lock(&delalloc.lock);
+	uint32_t left = nfree > delalloc.reserved ? nfree - delalloc.reserved : 0;
+	uint32_t count = want < left ? want : left;
+	delalloc.reserved += count;
+	pthread_mutex_unlock(&delalloc.lock);
+	return count;
+}
+
+static void delalloc_unreserve(uint32_t count) {
+	pthread_mutex_lock(&delalloc.lock);
+	delalloc.reserved -= count;
+	pthread_mutex_unlock(&delalloc.lock);
+}
+
+/* --------------------------------------------
+ * Get a run of up to want contiguous data blocks, starting at disk block goal
+ * if possible. Returns the first disk block and the run length in *got. The
+ * run comes from goal's group, or failing that the first group after it
+ * with room.
+ *
+ * Every allocation is covered by a reservation first, so blocks promised to
+ * buffered pages never go to anyone else: a flush spends the ones its pages
+ * hold (delalloc_held), everything else reserves its own on the way in.
+ ----------------------------------------------*/
+int get_avail_blkrun(int goal, uint32_t want, uint32_t *got) {
+	uint32_t first = groupOf(goal);
+	uint32_t i;
+
+	// Step 1: Cover the run, shrinking it to what could be reserved
+	uint32_t held = delalloc_held < want ? delalloc_held : want;
+	uint32_t extra = delalloc_reserve(want - held);
+	want = held + extra;
+	if(want == 0){
+		TRACE(TRACE_ERR, TR_NOSPC, 1, 0);
+		return -1;
+	}
+
+	// Step 2: Take it from the goal's group or the ones after it
+	if(first == sb->ngroups){
+		first = 0;
+	}
+	for(i = 0; i < sb->ngroups; i++){
+		uint32_t g = (first + i) % sb->ngroups;
+		struct group_desc *gd = &gdt[g];
+
+		// Search the goal's group from the goal, or from its first data block if
+		// the goal is one of its metadata blocks. Other groups go on from their hint.
+		uint32_t goalIndex = gd->d_blocks;
+		if(i == 0 && (uint32_t)goal >= gd->i_bitmap_blk){
+			goalIndex = (uint32_t)goal >= gd->d_start_blk ? goal - gd->d_start_blk : 0;
+		}
+		int start = balloc_alloc_run(&groups[g].blocks, goalIndex, want, got);
+		if(start >= 0){
+			// Step 3: The blocks are allocated, their reservations go
+			uint32_t spent = *got < held ? *got : held;
+			delalloc_held -= spent;
+			delalloc_unreserve(spent + extra);
+			TRACE(TRACE_INFO, TR_BLK_ALLOC, gd->d_start_blk + start, *got);
+			return gd->d_start_blk + start;
+		}
+	}
+	delalloc_unreserve(extra);
+	TRACE(TRACE_ERR, TR_NOSPC, 1, 0);
+	return -1;
+}
+
+/* --------------------------------------------
+ * Get available data block number from bitmap
+ ----------------------------------------------*/
+int get_avail_blkno() {
+	// no goal, so the first group with a free block
+	uint32_t got;
+	return get_avail_blkrun(0, 1, &got);
+}
+
+// Debugging aid, not called on any operation path
+void printDataBitMap(FILE *out){
+	uint32_t g, i;
+	fprintf(out, "Printing data bitmap...\n");
+	
+	for(g = 0; g < sb->ngroups; g++){
+		for(i = 0; i < 64; i++){
+			uint8_t dataBitmapIndex = get_bitmap((bitmap_t)groups[g].blocks.words, i);
+			fprintf(out, "%u",dataBitmapIndex);
+		}
+		fprintf(out, "...\n");
+	}
+}
+
+/* ----------------------------------------
+ * Return an inode number to the inode bitmap
+ ------------------------------------------*/
+void put_avail_ino(uint32_t ino) {
+	TRACE(TRACE_INFO, TR_INO_FREE, ino, 0);
+	// counted before the number can be handed out again
+	__atomic_fetch_add(&ino_frees, 1, __ATOMIC_RELEASE);
+	if(ino < sb->max_inum){
+		balloc_free(&groups[ino / sb->inodes_per_group].inodes, ino % sb->inodes_per_group);
+	}
+}
+
+// Give data block blkno back to its group's allocator
+static void freeDataBlock(uint32_t blkno) {
+	uint32_t g = groupOf(blkno);
+	if(g < sb->ngroups && blkno >= gdt[g].d_start_blk){
+		balloc_free(&groups[g].blocks, blkno - gdt[g].d_start_blk);
+	}
+}
+
+/* ----------------------------------------------
+ * Return a data block (disk block number) to the data bitmap
+ ------------------------------------------------*/
+void put_avail_blkno(int blkno) {
+	// metadata blocks still journaled come back after the next checkpoint
+	if(journal_defer_free(blkno)){
+		TRACE(TRACE_INFO, TR_BLK_DEFER, blkno, 0);
+		return;
+	}
+	TRACE(TRACE_INFO, TR_BLK_FREE, blkno, 0);
+	freeDataBlock(blkno);
+}
+
+// journal_init() callback for blocks held back by journal_defer_free()
+static void release_blkno(int blkno) {
+	TRACE(TRACE_INFO, TR_BLK_FREE, blkno, 0);
+	freeDataBlock(blkno);
+}
+
+void put_avail_blkrun(int blkno, uint32_t len) {
+	uint32_t i;
+	for(i = 0; i < len; i++){
+		put_avail_blkno(blkno + i);
+	}
+}
+
+/* -----------------
+ * inode operations
+ -------------------*/
+
+ //Given an inode number, get it's corresponding inode (through the inode cache)
+int readi(uint32_t ino, struct inode *inode) {
+
+	struct inode *cached = iget(ino);
+	if(cached == NULL){
+		return -1;
+	}
+	pthread_mutex_lock(&icache_lock);
+	memcpy(inode, cached, sizeof(struct inode));
+	pthread_mutex_unlock(&icache_lock);
+	iput(cached);
+
+	return 0;
+}
+
+//give an inode number, and overrite the inode corresponding to that number with the new inode.
+//The cached copy is marked dirty and written back to disk by icache_sync() or on eviction.
+int writei(uint32_t ino, struct inode *inode) {
+
+	struct inode *cached = iget(ino);
+	if(cached == NULL){
+		return -1;
+	}
+	pthread_mutex_lock(&icache_lock);
+	memcpy(cached, inode, sizeof(struct inode));
+	imark_dirty(cached);
+	pthread_mutex_unlock(&icache_lock);
+	iput(cached);
+
+	return 0;
+}
+
+// readi/writei helper functions ------------------------------------------------------------------------------------
+
+int readInodeFromDisk(uint32_t ino, struct inode *inode) {
+
+	if(ino >= sb->max_inum){
+		return -1;
+	}
+
+	// Step 1: Get the inode's on-disk block number. Blocks past the initialized
+	// part of its group's inode table only hold free inodes and aren't read.
+	struct group_desc *gd = &gdt[ino / sb->inodes_per_group];
+	if((ino % sb->inodes_per_group) / INODES_PER_BLOCK >= __atomic_load_n(&gd->i_init_blks, __ATOMIC_ACQUIRE)){
+		memset(inode, 0, sizeof(struct inode));
+		return 0;
+	}
+	int inodeDiskBlockNumber = inodeDiskBlock(ino);
+
+	// Step 2: Get offset of the inode in the inode on-disk block
+	int inodeOffset = (ino % INODES_PER_BLOCK) * sizeof(struct inode);
+
+	// Step 3: Read the block from disk and then copy into inode structure
+	struct arena_pos scratch = arena_mark();
+	char *block = arena_alloc(BLOCK_SIZE);
+	journal_read(inodeDiskBlockNumber, block);
+	memcpy(inode, block + inodeOffset, sizeof(struct inode));
+	arena_release(scratch);
+
+	return 0;
+}
+
+int writeInodeToDisk(uint32_t ino, struct inode *inode) {
+
+	if(ino >= sb->max_inum){
+		return -1;
+	}
+
+	// Step 1: Get the block number where this inode resides on disk
+	int inodeDiskBlockNumber = inodeDiskBlock(ino);
+
+	// Step 2: Get the offset in the block where this inode resides on disk
+	int inodeOffset = (ino % INODES_PER_BLOCK) * sizeof(struct inode);
+
+	// Step 3: Write inode to disk, keeping the other inodes that share its block
+	struct arena_pos scratch = arena_mark();
+	char *block = arena_alloc(BLOCK_SIZE);
+	journal_read(inodeDiskBlockNumber, block);
+	memcpy(block + inodeOffset, inode, sizeof(struct inode));
+	journal_write(inodeDiskBlockNumber, block);
+	arena_release(scratch);
+
+	return 0;
+}
+
+/* -----------------
+ * inode cache
+ -------------------*/
+
+static struct icache_entry *icache_entry_of(struct inode *inode) {
+	return (struct icache_entry *)((char *)inode - offsetof(struct icache_entry, inode));
+}
+
+static struct icache_entry *icache_lookup(uint32_t ino) {
+	struct icache_entry *e;
+	for(e = icache_buckets[ino % ICACHE_BUCKETS]; e != NULL; e = e->next){
+		if(e->ino == ino){
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static void icache_unhash(struct icache_entry *victim) {
+	struct icache_entry **link = &icache_buckets[victim->ino % ICACHE_BUCKETS];
+	while(*link != victim){
+		link = &(*link)->next;
+	}
+	*link = victim->next;
+	victim->next = NULL;
+}
+
+void icache_init() {
+	int i;
+	memset(icache_buckets, 0, sizeof(icache_buckets));
+	for(i = 0; i < ICACHE_SIZE; i++){
+		memset(&icache[i], 0, sizeof(struct icache_entry));
+		icache[i].ino = -1;
+		pthread_rwlock_init(&icache[i].lock, NULL);
+	}
+	icache_hand = 0;
+	icache_handles = 0;
+	icache_hits = 0;
+	icache_misses = 0;
+}
+
+// Pick a slot to reuse: a free one, or the first unpinned entry whose second chance ran out.
+// Called with icache_lock held.
+static struct icache_entry *icache_evict() {
+	int scanned;
+	for(scanned = 0; scanned < 2 * ICACHE_SIZE; scanned++){
+		struct icache_entry *e = &icache[icache_hand];
+		icache_hand = (icache_hand + 1) % ICACHE_SIZE;
+
+		if(e->ino < 0){
+			return e;
+		}
+		if(e->refcount > 0){
+			continue;
+		}
+		if(e->referenced){
+			e->referenced = 0;
+			continue;
+		}
+
+		if(e->dirty){
+			writeInodeToDisk(e->ino, &e->inode);
+			e->dirty = 0;
+		}
+		icache_unhash(e);
+		e->ino = -1;
+		return e;
+	}
+	// every entry is pinned
+	return NULL;
+}
+
+// Get the cached inode for ino, loading it from disk on a miss. The inode stays
+// pinned in the cache until the matching iput().
+struct inode *iget(uint32_t ino) {
+
+	if(ino >= sb->max_inum){
+		return NULL;
+	}
+
+	pthread_mutex_lock(&icache_lock);
+	struct icache_entry *e = icache_lookup(ino);
+	if(e != NULL){
+		icache_hits++;
+	} else {
+		icache_misses++;
+		TRACE(TRACE_DEBUG, TR_ICACHE_MISS, ino, 0);
+
+		e = icache_evict();
+		if(e == NULL){
+			pthread_mutex_unlock(&icache_lock);
+			return NULL;
+		}
+		readInodeFromDisk(ino, &e->inode);
+		e->ino = ino;
+		e->dirty = 0;
+		e->mapgen = ++icache_mapgen;
+		e->next = icache_buckets[ino % ICACHE_BUCKETS];
+		icache_buckets[ino % ICACHE_BUCKETS] = e;
+	}
+
+	e->refcount++;
+	e->referenced = 1;
+	pthread_mutex_unlock(&icache_lock);
+	return &e->inode;
+}
+
+void iput(struct inode *inode) {
+	struct icache_entry *e = icache_entry_of(inode);
+	pthread_mutex_lock(&icache_lock);
+	if(e->refcount > 0){
+		e->refcount--;
+	}
+	pthread_mutex_unlock(&icache_lock);
+}
+
+// Called with icache_lock held, see writei()
+void imark_dirty(struct inode *inode) {
+	icache_entry_of(inode)->dirty = 1;
+}
+
+// Pin ino and take its inode lock, shared or exclusive. The pin keeps the entry
+// (and so the lock) from being evicted until iunlock().
+struct inode *ilock(uint32_t ino, int exclusive) {
+	struct inode *inode = iget(ino);
+	if(inode == NULL){
+		return NULL;
+	}
+	if(exclusive){
+		pthread_rwlock_wrlock(&icache_entry_of(inode)->lock);
+	} else {
+		pthread_rwlock_rdlock(&icache_entry_of(inode)->lock);
+	}
+	return inode;
+}
+
+void iunlock(struct inode *inode) {
+	pthread_rwlock_unlock(&icache_entry_of(inode)->lock);
+	iput(inode);
+}
+
+// Pin ino for an open file handle, so its inode stays cached until release().
+// Handles pin at most ICACHE_HANDLE_PINS entries, leaving the rest for the
+// pins operations take; past that NULL is returned and the handle goes
+// through ilock() like everyone else.
+struct inode *iget_handle(uint32_t ino) {
+	pthread_mutex_lock(&icache_lock);
+	int full = icache_handles >= ICACHE_HANDLE_PINS;
+	if(!full){
+		icache_handles++;
+	}
+	pthread_mutex_unlock(&icache_lock);
+	if(full){
+		return NULL;
+	}
+
+	struct inode *inode = iget(ino);
+	if(inode == NULL){
+		pthread_mutex_lock(&icache_lock);
+		icache_handles--;
+		pthread_mutex_unlock(&icache_lock);
+	}
+	return inode;
+}
+
+void iput_handle(struct inode *inode) {
+	iput(inode);
+	pthread_mutex_lock(&icache_lock);
+	icache_handles--;
+	pthread_mutex_unlock(&icache_lock);
+}
+
+// A number that changes whenever blocks of the inode are unmapped, so a mapping
+// remembered with it is still good while it matches. Entries get a fresh one when
+// they are loaded, so an evicted inode never matches again. Called with the inode locked.
+uint32_t imap_gen(struct inode *locked) {
+	return icache_entry_of(locked)->mapgen;
+}
+
+// Called with the inode locked exclusively, before its blocks are released
+void imap_changed(uint32_t ino) {
+	pthread_mutex_lock(&icache_lock);
+	struct icache_entry *e = icache_lookup(ino);
+	if(e != NULL){
+		e->mapgen = ++icache_mapgen;
+	}
+	pthread_mutex_unlock(&icache_lock);
+}
+
+// Write back every dirty inode. Dirty inodes sharing an inode block are
+// written together with one read and one write of that block.
+int icache_sync() {
+	struct arena_pos scratch = arena_mark();
+	char *block = arena_alloc(BLOCK_SIZE);
+	int i, j;
+
+	pthread_mutex_lock(&icache_lock);
+	for(i = 0; i < ICACHE_SIZE; i++){
+		struct icache_entry *e = &icache[i];
+		if(e->ino < 0 || !e->dirty){
+			continue;
+		}
+
+		int firstIno = e->ino - e->ino % INODES_PER_BLOCK;
+		int inodeDiskBlockNumber = inodeDiskBlock(e->ino);
+		journal_read(inodeDiskBlockNumber, block);
+
+		for(j = 0; j < INODES_PER_BLOCK && firstIno + j < sb->max_inum; j++){
+			struct icache_entry *sibling = icache_lookup(firstIno + j);
+			if(sibling != NULL && sibling->dirty){
+				memcpy(block + j * sizeof(struct inode), &sibling->inode, sizeof(struct inode));
+				sibling->dirty = 0;
+			}
+		}
+		journal_write(inodeDiskBlockNumber, block);
+	}
+	pthread_mutex_unlock(&icache_lock);
+
+	arena_release(scratch);
+	return 0;
+}
+
+void icache_stats(FILE *out) {
+	pthread_mutex_lock(&icache_lock);
+	unsigned long lookups = icache_hits + icache_misses;
+	fprintf(out, "inode cache: %lu hits, %lu misses (%.1f%% hit rate)\n",
+		icache_hits, icache_misses, lookups ? 100.0 * icache_hits / lookups : 0.0);
+	pthread_mutex_unlock(&icache_lock);
+}
+
+void icache_stats_reset() {
+	pthread_mutex_lock(&icache_lock);
+	icache_hits = icache_misses = 0;
+	pthread_mutex_unlock(&icache_lock);
+}
+
+
+/* --------------------
+ * dentry cache
+-----------------------*/
+
+static unsigned int dcache_hash(uint32_t parent, const char *name, size_t name_len) {
+	// FNV-1a over the parent inode number and the name
+	unsigned int hash = 2166136261u ^ parent;
+	size_t i;
+	for(i = 0; i < name_len; i++){
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
+	}
+	return hash % DCACHE_BUCKETS;
+}
+
+static struct dcache_entry *dcache_find(uint32_t parent, const char *name, size_t name_len) {
+	struct dcache_entry *e;
+	for(e = dcache_buckets[dcache_hash(parent, name, name_len)]; e != NULL; e = e->next){
+		if(e->parent == parent && e->name_len == name_len && memcmp(e->name, name, name_len) == 0){
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static void dcache_unhash(struct dcache_entry *victim) {
+	struct dcache_entry **link = &dcache_buckets[dcache_hash(victim->parent, victim->name, victim->name_len)];
+	while(*link != victim){
+		link = &(*link)->next;
+	}
+	*link = victim->next;
+	victim->next = NULL;
+	victim->parent = -1;
+}
+
+void dcache_init() {
+	int i;
+	memset(dcache_buckets, 0, sizeof(dcache_buckets));
+	for(i = 0; i < DCACHE_SIZE; i++){
+		memset(&dcache[i], 0, sizeof(struct dcache_entry));
+		dcache[i].parent = -1;
+	}
+	dcache_hand = 0;
+	dcache_hits = 0;
+	dcache_misses = 0;
+}
+
+// Returns 1 and sets *ino (DCACHE_NEGATIVE if the name is known not to exist) on a hit, 0 on a miss
+int dcache_lookup(uint32_t parent, const char *name, size_t name_len, int *ino) {
+	pthread_mutex_lock(&dcache_lock);
+	struct dcache_entry *e = dcache_find(parent, name, name_len);
+	if(e == NULL){
+		dcache_misses++;
+		pthread_mutex_unlock(&dcache_lock);
+		return 0;
+	}
+	dcache_hits++;
+	e->referenced = 1;
+	*ino = e->ino;
+	pthread_mutex_unlock(&dcache_lock);
+	return 1;
+}
+
+// Add or replace the entry for name in parent. ino may be DCACHE_NEGATIVE.
+void dcache_insert(uint32_t parent, const char *name, size_t name_len, int ino) {
+	if(name_len >= DIRENT_NAME_LEN){
+		return;
+	}
+
+	pthread_mutex_lock(&dcache_lock);
+	struct dcache_entry *e = dcache_find(parent, name, name_len);
+	if(e == NULL){
+		// reuse a free slot, or the first entry whose second chance ran out
+		for(;;){
+			e = &dcache[dcache_hand];
+			dcache_hand = (dcache_hand + 1) % DCACHE_SIZE;
+			if(e->parent < 0){
+				break;
+			}
+			if(e->referenced){
+				e->referenced = 0;
+				continue;
+			}
+			dcache_unhash(e);
+			break;
+		}
+
+		unsigned int bucket = dcache_hash(parent, name, name_len);
+		e->parent = parent;
+		e->name_len = name_len;
+		memcpy(e->name, name, name_len);
+		e->name[name_len] = '\0';
+		e->next = dcache_buckets[bucket];
+		dcache_buckets[bucket] = e;
+	}
+	e->ino = ino;
+	e->referenced = 1;
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+// Drop every entry looked up under parent. Used when parent's inode is freed,
+// since the inode number may be reused for an unrelated directory.
+void dcache_purge_dir(uint32_t parent) {
+	int i;
+	pthread_mutex_lock(&dcache_lock);
+	for(i = 0; i < DCACHE_SIZE; i++){
+		if(dcache[i].parent == parent){
+			dcache_unhash(&dcache[i]);
+		}
+	}
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+void dcache_stats(FILE *out) {
+	pthread_mutex_lock(&dcache_lock);
+	unsigned long lookups = dcache_hits + dcache_misses;
+	fprintf(out, "dentry cache: %lu hits, %lu misses (%.1f%% hit rate)\n",
+		dcache_hits, dcache_misses, lookups ? 100.0 * dcache_hits / lookups : 0.0);
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+void dcache_stats_reset() {
+	pthread_mutex_lock(&dcache_lock);
+	dcache_hits = dcache_misses = 0;
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+/* --------------------
+ * block mapping
+-----------------------*/
+
+ // Files and directories are mapped by extents, sorted by logical block. Up to
+ // INODE_EXTENTS live in the inode; past that they all move to an extent block
+ // (a sorted leaf of up to EXTENTS_PER_BLOCK extents) at inode->ext_blk. When that
+ // leaf fills up it is split in two under an extent index block, which then takes
+ // its place at ext_blk (INODE_EXT_INDEX) and can point to INDEX_PER_BLOCK leaves,
+ // each split again as it fills. Only the leaf a block falls in is read or written.
+ // Small files and directories have no blocks at all: with INODE_INLINE set, the
+ // extent area holds their data instead (see uninlineFile() and uninlineDir()).
+
+// Room for a leaf's extents plus the one an insertion adds before the leaf is split
+#define LEAF_BUF	(EXTENTS_PER_BLOCK + 1)
+
+// Extents any map takes: it only fills up once its index is full, and every leaf
+// but the last is then at least half full (see storeLeaf())
+#define EXTENTS_SAFE	((INDEX_PER_BLOCK - 1) * (EXTENTS_PER_BLOCK / 2))
+
+// The leaf of an inode's extent map that a logical block falls in
+struct leaf_pos {
+	int			slot;		/* its index entry, -1 without an index */
+	uint32_t	blk;		/* its block, 0 if the extents live in the inode */
+	uint32_t	end;		/* first logical block of the next leaf, UINT32_MAX for the last */
+};
+
+// Get the extents of an inode without an index into ext (room for LEAF_BUF entries)
+static void loadExtents(struct inode *inode, struct extent *ext) {
+	if(inode->nextents <= INODE_EXTENTS){
+		memcpy(ext, inode->extents, inode->nextents * sizeof(struct extent));
+		return;
+	}
+	struct arena_pos scratch = arena_mark();
+	struct extent_block *eb = arena_alloc(BLOCK_SIZE);
+	journal_read(inode->ext_blk, eb);
+	memcpy(ext, eb->extents, inode->nextents * sizeof(struct extent));
+	arena_release(scratch);
+}
+
+// Write count extents to leaf block blk
+static void writeLeaf(uint32_t blk, struct extent *ext, uint32_t count) {
+	struct arena_pos scratch = arena_mark();
+	struct extent_block *eb = arena_zalloc(BLOCK_SIZE);
+	eb->magic = EXTENT_MAGIC;
+	eb->count = count;
+	memcpy(eb->extents, ext, count * sizeof(struct extent));
+	journal_write(blk, eb);
+	arena_release(scratch);
+}
+
+// Allocate a block for inode's extent map, near its data. It isn't a buffered
+// page's block, so it takes a reservation of its own. Returns -1 if none is left.
+static int allocMapBlock(struct inode *inode) {
+	uint32_t got, held = delalloc_held;
+	delalloc_held = 0;
+	int blkno = get_avail_blkrun(gdt[inode->ino / sb->inodes_per_group].d_start_blk, 1, &got);
+	delalloc_held = held;
+	if(blkno >= 0){
+		inode->vstat.st_blocks += BLOCK_SIZE / 512;
+	}
+	return blkno;
+}
+
+// Give back a block of inode's extent map
+static void freeMapBlock(struct inode *inode, uint32_t blk) {
+	put_avail_blkno(blk);
+	inode->vstat.st_blocks -= BLOCK_SIZE / 512;
+}
+
+// Store the extent list of an inode without an index, count entries, moving it
+// between the inode and its extent block as needed
+static int storeExtents(struct inode *inode, struct extent *ext, uint32_t count) {
+	if(count > EXTENTS_PER_BLOCK){
+		return -1;
+	}
+
+	if(count <= INODE_EXTENTS){
+		memcpy(inode->extents, ext, count * sizeof(struct extent));
+		if(inode->ext_blk != 0){
+			freeMapBlock(inode, inode->ext_blk);
+			inode->ext_blk = 0;
+		}
+	} else {
+		if(inode->ext_blk == 0){
+			int blkno = allocMapBlock(inode);
+			if(blkno < 0){
+				return -1;
+			}
+			inode->ext_blk = blkno;
+		}
+		writeLeaf(inode->ext_blk, ext, count);
+	}
+	inode->nextents = count;
+	return 0;
+}
+
+// Index of the last index entry starting at or before lblk
+static uint32_t findLeaf(struct extent_index_block *ib, uint32_t lblk) {
+	uint32_t lo = 1, hi = ib->count;
+	while(lo < hi){
+		uint32_t mid = (lo + hi) / 2;
+		if(ib->entries[mid].lblk <= lblk){
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo - 1;
+}
+
+// Load the leaf of inode's extent map that lblk falls in into ext (room for
+// LEAF_BUF entries) and say where it lives in *pos. Returns its extent count.
+static uint32_t loadLeaf(struct inode *inode, uint32_t lblk, struct extent *ext, struct leaf_pos *pos) {
+	if(!(inode->flags & INODE_EXT_INDEX)){
+		pos->slot = -1;
+		pos->blk = inode->nextents > INODE_EXTENTS ? inode->ext_blk : 0;
+		pos->end = UINT32_MAX;
+		loadExtents(inode, ext);
+		return inode->nextents;
+	}
+
+	struct arena_pos scratch = arena_mark();
+	struct extent_index_block *ib = arena_alloc(BLOCK_SIZE);
+	journal_read(inode->ext_blk, ib);
+	uint32_t slot = findLeaf(ib, lblk);
+	pos->slot = slot;
+	pos->blk = ib->entries[slot].blk;
+	pos->end = slot + 1 < ib->count ? ib->entries[slot + 1].lblk : UINT32_MAX;
+
+	struct extent_block *eb = arena_alloc(BLOCK_SIZE);
+	journal_read(pos->blk, eb);
+	uint32_t count = eb->count;
+	memcpy(ext, eb->extents, count * sizeof(struct extent));
+	arena_release(scratch);
+	return count;
+}
+
+// Store the count extents of the leaf at pos back. A leaf that outgrew its block
+// is split into a new leaf, putting an index over the inode's single leaf first:
+// in half, or for the last leaf, which a growing file appends to, just its last
+// extent, so the leaves left behind stay full. Returns -ENOSPC if no block is left for that, -EFBIG if the index
+// is full; the map is unchanged then.
+static int storeLeaf(struct inode *inode, struct leaf_pos *pos, struct extent *ext, uint32_t count) {
+	// Step 1: Fits where it is
+	if(count <= EXTENTS_PER_BLOCK){
+		if(pos->slot < 0){
+			return storeExtents(inode, ext, count) < 0 ? -ENOSPC : 0;
+		}
+		writeLeaf(pos->blk, ext, count);
+		return 0;
+	}
+
+	// Step 2: Get the index, or the blocks for a new one
+	struct arena_pos scratch = arena_mark();
+	struct extent_index_block *ib = arena_zalloc(BLOCK_SIZE);
+	int indexBlk = inode->ext_blk;
+	if(pos->slot < 0){
+		indexBlk = allocMapBlock(inode);
+		if(indexBlk < 0){
+			arena_release(scratch);
+			return -ENOSPC;
+		}
+		ib->magic = EXTENT_INDEX_MAGIC;
+		ib->count = 1;
+		ib->entries[0].lblk = 0;
+		ib->entries[0].blk = pos->blk;
+		pos->slot = 0;
+	} else {
+		journal_read(indexBlk, ib);
+		if(ib->count >= INDEX_PER_BLOCK){
+			arena_release(scratch);
+			return -EFBIG;
+		}
+	}
+	int newBlk = allocMapBlock(inode);
+	if(newBlk < 0){
+		if(indexBlk != (int)inode->ext_blk){
+			freeMapBlock(inode, indexBlk);
+		}
+		arena_release(scratch);
+		return -ENOSPC;
+	}
+
+	// Step 3: The upper part moves to the new leaf, entered right after the old one
+	uint32_t split = pos->end == UINT32_MAX ? count - 1 : count / 2;
+	writeLeaf(pos->blk, ext, split);
+	writeLeaf(newBlk, ext + split, count - split);
+	memmove(&ib->entries[pos->slot + 2], &ib->entries[pos->slot + 1], (ib->count - pos->slot - 1) * sizeof(struct extent_index));
+	ib->entries[pos->slot + 1].lblk = ext[split].lblk;
+	ib->entries[pos->slot + 1].blk = newBlk;
+	ib->count++;
+	journal_write(indexBlk, ib);
+
+	inode->flags |= INODE_EXT_INDEX;
+	inode->ext_blk = indexBlk;
+	inode->nextents = ib->count;
+	arena_release(scratch);
+	return 0;
+}
+
+// Most extents inode's map can hold right now: its count without an index, full
+// leaves with one. Cheap, as it reads no blocks.
+static uint32_t mapExtentsMax(struct inode *inode) {
+	if(inode->flags & INODE_EXT_INDEX){
+		return inode->nextents * EXTENTS_PER_BLOCK;
+	}
+	return inode->nextents;
+}
+
+// Index of the first extent ending after lblk (nextents if none)
+static uint32_t findExtent(struct extent *ext, uint32_t count, uint32_t lblk) {
+	uint32_t lo = 0, hi = count;
+	while(lo < hi){
+		uint32_t mid = (lo + hi) / 2;
+		if(ext[mid].lblk + ext[mid].len <= lblk){
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+ // bmap_run() with the reason a block could not be mapped: 0 with the disk block in
+ // *pblk (0 for a hole) and the run length in *len, or -ENOSPC when no block is
+ // left and -EFBIG when the extent map is full.
+int mapRun(struct inode *inode, uint32_t lblk, uint32_t want, int create, uint32_t *pblk, uint32_t *len) {
+
+	*pblk = 0;
+	*len = 0;
+	if(inode->flags & INODE_INLINE){
+		// nothing is mapped, and the extent area is data; callers uninline first
+		return create ? -ENOSPC : 0;
+	}
+
+	struct arena_pos scratch = arena_mark();
+	struct extent *ext = arena_alloc(LEAF_BUF * sizeof(struct extent));
+	struct leaf_pos pos;
+	uint32_t count = loadLeaf(inode, lblk, ext, &pos);
+
+	// Step 1: Look for an extent covering lblk
+	uint32_t i = findExtent(ext, count, lblk);
+	if(i < count && ext[i].lblk <= lblk){
+		uint32_t inExtent = ext[i].lblk + ext[i].len - lblk;
+		*pblk = ext[i].pblk + (lblk - ext[i].lblk);
+		*len = inExtent < want ? inExtent : want;
+		arena_release(scratch);
+		return 0;
+	}
+
+	// Step 2: lblk is in a hole that runs up to the next extent, or at least to
+	// the end of this leaf
+	uint32_t hole = (i < count) ? ext[i].lblk - lblk : pos.end - lblk;
+	if(hole > want){
+		hole = want;
+	}
+	*len = hole;
+	if(!create){
+		arena_release(scratch);
+		return 0;
+	}
+
+	// Step 3: Allocate a run for the hole, aiming right behind the previous
+	// extent, or for a file's first blocks at its inode's group
+	int goal = gdt[inode->ino / sb->inodes_per_group].d_start_blk;
+	if(i > 0){
+		goal = ext[i - 1].pblk + ext[i - 1].len + (lblk - ext[i - 1].lblk - ext[i - 1].len);
+	}
+	uint32_t got;
+	int run = get_avail_blkrun(goal, hole, &got);
+	if(run < 0){
+		arena_release(scratch);
+		*len = 0;
+		return -ENOSPC;
+	}
+
+	// Step 4: Extend the previous extent if the run continues it, otherwise insert
+	// a new one; ext has room for it even in a full leaf, which storeLeaf() splits
+	if(i > 0 && ext[i - 1].lblk + ext[i - 1].len == lblk && ext[i - 1].pblk + ext[i - 1].len == (uint32_t)run){
+		ext[i - 1].len += got;
+	} else {
+		memmove(&ext[i + 1], &ext[i], (count - i) * sizeof(struct extent));
+		ext[i].lblk = lblk;
+		ext[i].pblk = run;
+		ext[i].len = got;
+		count++;
+	}
+	int ret = storeLeaf(inode, &pos, ext, count);
+	arena_release(scratch);
+	if(ret < 0){
+		put_avail_blkrun(run, got);
+		*len = 0;
+		return ret;
+	}
+	inode->vstat.st_blocks += got * (BLOCK_SIZE / 512);
+
+	*pblk = run;
+	*len = got;
+	return 0;
+}
+
+ // Map logical block lblk of inode to its disk block. Returns the disk block and, in
+ // *len, how many following blocks (at most want) are mapped contiguously on disk.
+ // For a hole it returns 0 with *len set to the hole's length, unless create is set:
+ // then a contiguous run of up to want blocks is allocated right after the previous
+ // extent where possible and merged into it, and 0 with *len 0 means it couldn't be
+ // (see mapRun() for why). The caller writes the inode back.
+uint32_t bmap_run(struct inode *inode, uint32_t lblk, uint32_t want, int create, uint32_t *len) {
+	uint32_t pblk;
+	mapRun(inode, lblk, want, create, &pblk, len);
+	return pblk;
+}
+
+ // Single block form of bmap_run(), used by the directory code. Returns 0 for a hole
+ // and -1 if a block could not be allocated.
+int bmap(struct inode *inode, int lblk, int create) {
+	uint32_t len;
+	if(lblk < 0){
+		return -1;
+	}
+	uint32_t pblk = bmap_run(inode, lblk, 1, create, &len);
+	if(pblk == 0 && create){
+		return -1;
+	}
+	return pblk;
+}
+
+// Free the blocks the count extents in ext map at or past logical block
+// keepBlocks. Returns how many extents are left.
+static uint32_t cutExtents(struct inode *inode, struct extent *ext, uint32_t count, uint32_t keepBlocks) {
+	uint32_t i = findExtent(ext, count, keepBlocks);
+	uint32_t newCount = i;
+	if(i < count && ext[i].lblk < keepBlocks){
+		// this extent straddles the cut: keep its head
+		uint32_t keep = keepBlocks - ext[i].lblk;
+		put_avail_blkrun(ext[i].pblk + keep, ext[i].len - keep);
+		inode->vstat.st_blocks -= (ext[i].len - keep) * (BLOCK_SIZE / 512);
+		ext[i].len = keep;
+		i++;
+		newCount = i;
+	}
+	for(; i < count; i++){
+		put_avail_blkrun(ext[i].pblk, ext[i].len);
+		inode->vstat.st_blocks -= ext[i].len * (BLOCK_SIZE / 512);
+	}
+	return newCount;
+}
+
+// Release every block mapped at or past logical block keepBlocks
+int truncateInodeBlocks(struct inode *inode, uint32_t keepBlocks) {
+
+	if(inode->flags & INODE_INLINE){
+		return 0;
+	}
+
+	imap_changed(inode->ino);
+
+	struct arena_pos scratch = arena_mark();
+	struct extent *ext = arena_alloc(LEAF_BUF * sizeof(struct extent));
+	if(!(inode->flags & INODE_EXT_INDEX)){
+		loadExtents(inode, ext);
+		int ret = storeExtents(inode, ext, cutExtents(inode, ext, inode->nextents, keepBlocks));
+		arena_release(scratch);
+		return ret;
+	}
+
+	// Step 1: Leaves wholly past the cut go, the one it falls in is cut
+	struct extent_index_block *ib = arena_alloc(BLOCK_SIZE);
+	struct extent_block *eb = arena_alloc(BLOCK_SIZE);
+	journal_read(inode->ext_blk, ib);
+	while(ib->count > 0){
+		struct extent_index *entry = &ib->entries[ib->count - 1];
+		journal_read(entry->blk, eb);
+		uint32_t count = cutExtents(inode, eb->extents, eb->count, keepBlocks);
+		if(entry->lblk >= keepBlocks){
+			freeMapBlock(inode, entry->blk);
+			ib->count--;
+			continue;
+		}
+		writeLeaf(entry->blk, eb->extents, count);
+		break;
+	}
+
+	// Step 2: Down to one leaf, the index goes and the leaf is stored without it
+	if(ib->count <= 1){
+		uint32_t count = 0;
+		uint32_t leafBlk = 0;
+		if(ib->count == 1){
+			leafBlk = ib->entries[0].blk;
+			journal_read(leafBlk, eb);
+			count = eb->count;
+			memcpy(ext, eb->extents, count * sizeof(struct extent));
+		}
+		freeMapBlock(inode, inode->ext_blk);
+		inode->flags &= ~INODE_EXT_INDEX;
+		inode->ext_blk = leafBlk;
+		int ret = storeExtents(inode, ext, count);
+		arena_release(scratch);
+		return ret;
+	}
+	journal_write(inode->ext_blk, ib);
+	inode->nextents = ib->count;
+	arena_release(scratch);
+	return 0;
+}
+
+// Release every data block and the extent block of inode
+void freeInodeBlocks(struct inode *inode) {
+	truncateInodeBlocks(inode, 0);
+	inode->size = 0;
+	inode->vstat.st_size = 0;
+}
+
+// Move an inline file's data to a newly allocated first block, so it can grow
+// past INODE_INLINE_MAX. The caller writes the inode back.
+int uninlineFile(struct inode *inode) {
+	struct arena_pos scratch = arena_mark();
+	char *block = arena_zalloc(BLOCK_SIZE);
+	memcpy(block, inode->inline_data, inode->size);
+
+	// Step 1: Turn the inline area back into an empty extent map
+	memset(inode->inline_data, 0, INODE_INLINE_MAX);
+	inode->flags &= ~INODE_INLINE;
+
+	// Step 2: An empty file needs no block yet
+	if(inode->size > 0){
+		int blkno = bmap(inode, 0, 1);
+		if(blkno <= 0){
+			memcpy(inode->inline_data, block, inode->size);
+			inode->flags |= INODE_INLINE;
+			arena_release(scratch);
+			return -1;
+		}
+		bio_write(blkno, block);
+	}
+	arena_release(scratch);
+	return 0;
+}
+
+// Called by read() before it reads blocks firstBlk to lastBlk of inode: if the
+// file is being read sequentially, start reading the blocks after them into the
+// block cache in the background, one request per run of adjacent disk blocks.
+void readaheadInode(struct tfs_file *file, struct inode *locked, struct inode *inode, uint32_t firstBlk, uint32_t lastBlk) {
+	uint32_t fileBlks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	uint32_t maxBlks = tfs_config.readahead_kb / (BLOCK_SIZE / 1024);
+	uint32_t lblk;
+
+	if(maxBlks > (uint32_t)bio_prefetch_max() && bio_prefetch_max() > 0){
+		maxBlks = bio_prefetch_max();
+	}
+	uint32_t count = ra_advance(&file->ra, firstBlk, lastBlk - firstBlk + 1, maxBlks, fileBlks, &lblk);
+	uint32_t endBlk = lblk + count;
+
+	while(count > 0 && lblk < endBlk){
+		uint32_t runLen;
+		uint32_t pblk = fileBmap(file, locked, inode, lblk, endBlk - lblk, &runLen);
+		if(pblk != 0){
+			bio_prefetch(pblk, runLen);
+		}
+		lblk += runLen;
+	}
+}
+
+// bmap_run() without create, for reads through an open file. The whole extent
+// found is remembered in the handle, so a file read sequentially looks each
+// extent up once instead of loading the extent map on every request.
+uint32_t fileBmap(struct tfs_file *file, struct inode *locked, struct inode *inode, uint32_t lblk, uint32_t want, uint32_t *len) {
+	uint32_t gen = imap_gen(locked);
+	uint32_t pblk = 0;
+
+	// Step 1: Try the cached extent
+	pthread_mutex_lock(&file->map_lock);
+	if(file->map_len > 0 && file->map_gen == gen && lblk >= file->map_lblk && lblk - file->map_lblk < file->map_len){
+		pblk = file->map_pblk + (lblk - file->map_lblk);
+		*len = file->map_len - (lblk - file->map_lblk);
+	}
+	pthread_mutex_unlock(&file->map_lock);
+
+	// Step 2: Otherwise map the rest of the extent and keep it
+	if(pblk == 0){
+		pblk = bmap_run(inode, lblk, UINT32_MAX - lblk, 0, len);
+		if(pblk != 0){
+			pthread_mutex_lock(&file->map_lock);
+			file->map_gen = gen;
+			file->map_lblk = lblk;
+			file->map_pblk = pblk;
+			file->map_len = *len;
+			pthread_mutex_unlock(&file->map_lock);
+		}
+	}
+	if(*len > want){
+		*len = want;
+	}
+	return pblk;
+}
+
+// Per-open state for regular file or directory ino, freed by closeFile(). FUSE
+// doesn't unlink an open file (it renames it aside instead, which tfs refuses,
+// unless mounted with hard_remove), so ino stays the file's until then.
+struct tfs_file *openFile(uint32_t ino) {
+	struct tfs_file *file = malloc(sizeof(struct tfs_file));
+	if(file != NULL){
+		file->ino = ino;
+		file->pinned = iget_handle(ino);
+		ra_init(&file->ra);
+		pthread_mutex_init(&file->map_lock, NULL);
+		file->map_len = 0;
+	}
+	return file;
+}
+
+void closeFile(struct tfs_file *file) {
+	if(file->pinned != NULL){
+		iput_handle(file->pinned);
+	}
+	ra_destroy(&file->ra);
+	pthread_mutex_destroy(&file->map_lock);
+	free(file);
+}
+
+/* --------------------
+ * delayed allocation
+-----------------------*/
+
+static struct dfile **dfile_bucket(uint32_t ino) {
+	return &delalloc.buckets[ino % DELALLOC_BUCKETS];
+}
+
+// The buffered state of ino, or NULL if it has none. Called with delalloc.lock held.
+static struct dfile *dfile_lookup(uint32_t ino) {
+	struct dfile *f;
+	for(f = *dfile_bucket(ino); f != NULL; f = f->next){
+		if(f->ino == ino){
+			return f;
+		}
+	}
+	return NULL;
+}
+
+// Same, taking delalloc.lock. The result stays valid while the caller holds the inode lock.
+static struct dfile *dfile_get(uint32_t ino) {
+	pthread_mutex_lock(&delalloc.lock);
+	struct dfile *f = dfile_lookup(ino);
+	pthread_mutex_unlock(&delalloc.lock);
+	return f;
+}
+
+static struct dpage *dfile_page(struct dfile *f, uint32_t lblk) {
+	struct dpage *page;
+	for(page = f->pages[lblk % f->nbuckets]; page != NULL; page = page->next){
+		if(page->lblk == lblk){
+			return page;
+		}
+	}
+	return NULL;
+}
+
+// Double the page hash table once it holds twice as many pages as buckets
+static void dfile_grow(struct dfile *f) {
+	uint32_t nbuckets = f->nbuckets * 2;
+	struct dpage **pages = calloc(nbuckets, sizeof(struct dpage *));
+	uint32_t i;
+
+	if(pages == NULL){
+		return;
+	}
+	for(i = 0; i < f->nbuckets; i++){
+		while(f->pages[i] != NULL){
+			struct dpage *page = f->pages[i];
+			f->pages[i] = page->next;
+			page->next = pages[page->lblk % nbuckets];
+			pages[page->lblk % nbuckets] = page;
+		}
+	}
+	free(f->pages);
+	f->pages = pages;
+	f->nbuckets = nbuckets;
+}
+
+// Free page, giving back its reservation. Called with delalloc.lock held.
+static void dpage_free(struct dpage *page) {
+	if(page->reserved){
+		delalloc.reserved--;
+	}
+	delalloc.npages--;
+	free(page);
+}
+
+// Free every page of f and f itself, taking it out of the table
+static void dfile_free(struct dfile *f) {
+	uint32_t i;
+
+	pthread_mutex_lock(&delalloc.lock);
+	struct dfile **link = dfile_bucket(f->ino);
+	while(*link != f){
+		link = &(*link)->next;
+	}
+	*link = f->next;
+	for(i = 0; i < f->nbuckets; i++){
+		while(f->pages[i] != NULL){
+			struct dpage *page = f->pages[i];
+			f->pages[i] = page->next;
+			dpage_free(page);
+		}
+	}
+	pthread_mutex_unlock(&delalloc.lock);
+	free(f->pages);
+	free(f);
+}
+
+// Buffered page for block lblk of inode, created from the block's current contents
+// if there is none. A page over a hole reserves a data block first. Returns NULL
+// with the error in *err when none is left, or the extent map can't take the block.
+static struct dpage *dfile_page_get(struct dfile *f, struct inode *inode, uint32_t lblk, int *err) {
+	struct dpage *page = dfile_page(f, lblk);
+	if(page != NULL){
+		return page;
+	}
+
+	// Step 1: Reserve a block for a hole, without dipping into ones already
+	// promised. Once the extent map might not take one more extent per buffered
+	// page, the block is mapped right away instead, so a full map fails the write
+	// rather than a flush long after it was acknowledged.
+	uint32_t len;
+	uint32_t pblk = bmap_run(inode, lblk, 1, 0, &len);
+	int mapped = 0;
+	if(pblk == 0 && mapExtentsMax(inode) + f->npages < EXTENTS_SAFE){
+		if(delalloc_reserve(1) == 0){
+			*err = -ENOSPC;
+			return NULL;
+		}
+	} else if(pblk == 0){
+		*err = mapRun(inode, lblk, 1, 1, &pblk, &len);
+		if(*err < 0){
+			return NULL;
+		}
+		mapped = 1;
+	}
+
+	// Step 2: Start from the old block, or zeros for a hole. A block just mapped is
+	// zeroed on disk too, so a crash before the flush can't show what it held.
+	page = malloc(sizeof(struct dpage));
+	page->lblk = lblk;
+	page->reserved = (pblk == 0);
+	if(pblk != 0 && !mapped){
+		bio_read(pblk, page->data);
+	} else {
+		memset(page->data, 0, BLOCK_SIZE);
+	}
+	if(mapped){
+		bio_write(pblk, page->data);
+		writei(inode->ino, inode);
+	}
+
+	// Step 3: Hash it in
+	if(f->npages >= 2 * f->nbuckets){
+		dfile_grow(f);
+	}
+	page->next = f->pages[lblk % f->nbuckets];
+	f->pages[lblk % f->nbuckets] = page;
+	f->npages++;
+	pthread_mutex_lock(&delalloc.lock);
+	delalloc.npages++;
+	pthread_mutex_unlock(&delalloc.lock);
+	return page;
+}
+
+// Buffer a write of size bytes at offset to a file that lives in data blocks, with
+// its inode locked exclusively. Returns the bytes buffered, or if there was room
+// for none, -ENOSPC or -EFBIG for a full extent map.
+int delalloc_write(struct inode *inode, const char *buffer, size_t size, off_t offset) {
+	struct dfile *f = dfile_get(inode->ino);
+	size_t done = 0;
+	int err = 0;
+
+	// Step 1: Start buffering the file
+	if(f == NULL){
+		f = calloc(1, sizeof(struct dfile));
+		f->ino = inode->ino;
+		f->size = inode->size;
+		f->mtime = inode->vstat.st_mtime;
+		f->nbuckets = 16;
+		f->pages = calloc(f->nbuckets, sizeof(struct dpage *));
+		time(&f->dirtied);
+		pthread_mutex_lock(&delalloc.lock);
+		f->next = *dfile_bucket(f->ino);
+		*dfile_bucket(f->ino) = f;
+		pthread_mutex_unlock(&delalloc.lock);
+	}
+
+	// Step 2: Copy the data into the pages of the blocks it covers
+	while(done < size){
+		off_t pos = offset + done;
+		uint32_t lblk = pos / BLOCK_SIZE;
+		size_t inBlock = BLOCK_SIZE - pos % BLOCK_SIZE;
+		size_t n = size - done < inBlock ? size - done : inBlock;
+
+		struct dpage *page = dfile_page_get(f, inode, lblk, &err);
+		if(page == NULL){
+			break;
+		}
+		memcpy(page->data + pos % BLOCK_SIZE, buffer + done, n);
+		done += n;
+	}
+
+	// Step 3: Grow the buffered size and stamp the time
+	pthread_mutex_lock(&delalloc.lock);
+	if(offset + done > f->size){
+		f->size = offset + done;
+	}
+	time(&f->mtime);
+	f->failed = 0;
+	delalloc.writes++;
+	int over = delalloc.npages > delalloc.maxpages;
+	pthread_mutex_unlock(&delalloc.lock);
+
+	// Step 4: Over budget, write this file out now and have the thread see to the rest
+	if(f->npages == 0){
+		// nothing could be buffered, so there is nothing to flush either
+		dfile_free(f);
+	} else if(over){
+		delalloc_flush(inode);
+		pthread_cond_signal(&delalloc.wake);
+	}
+	return done > 0 ? (int)done : err;
+}
 
-struct inode *getPathRec(const char *path, char *currentDirentName, int currentDirentNameIndex, struct inode *currentInode, char *finalDirentName);
-struct inode *getInodeOfDataBlock(int dataBlock);
+// Copy the buffered parts of [offset, offset + size) over buffer, which holds what
+// is on disk. Called with the inode locked.
+void delalloc_read(struct inode *inode, char *buffer, size_t size, off_t offset) {
+	struct dfile *f = dfile_get(inode->ino);
+	uint32_t lblk;
 
-struct dirent *getDirEntryOfDataBlock(int dataBlock);
+	if(f == NULL || size == 0){
+		return;
+	}
+	for(lblk = offset / BLOCK_SIZE; lblk <= (offset + size - 1) / BLOCK_SIZE; lblk++){
+		struct dpage *page = dfile_page(f, lblk);
+		if(page == NULL){
+			continue;
+		}
+		off_t start = (off_t)lblk * BLOCK_SIZE > offset ? (off_t)lblk * BLOCK_SIZE : offset;
+		off_t end = (off_t)(lblk + 1) * BLOCK_SIZE < offset + (off_t)size ? (off_t)(lblk + 1) * BLOCK_SIZE : offset + (off_t)size;
+		memcpy(buffer + (start - offset), page->data + (start - (off_t)lblk * BLOCK_SIZE), end - start);
+	}
+}
 
-char *getNthDirentInPathString(const char *path, int n);
+// Size of the file, buffered writes included. Called with the inode locked.
+uint32_t delalloc_size(struct inode *inode) {
+	uint32_t size = inode->size;
+	pthread_mutex_lock(&delalloc.lock);
+	struct dfile *f = dfile_lookup(inode->ino);
+	if(f != NULL){
+		size = f->size;
+	}
+	pthread_mutex_unlock(&delalloc.lock);
+	return size;
+}
 
-/*------------------
-	Main functions
---------------------*/
+// Put the buffered size and mtime of ino into stbuf
+void delalloc_getattr(uint32_t ino, struct stat *stbuf) {
+	pthread_mutex_lock(&delalloc.lock);
+	struct dfile *f = dfile_lookup(ino);
+	if(f != NULL){
+		stbuf->st_size = f->size;
+		stbuf->st_mtime = f->mtime;
+	}
+	pthread_mutex_unlock(&delalloc.lock);
+}
 
-/* ----------------------------------------
- * Get available inode number from bitmap
- ------------------------------------------*/
-int get_avail_ino() {
-	// printf("|----------------------------\n");
-	// printf("|--- starting get_avail_ino()\n");
-	// printf("|----------------------------\n");
-	if(inode_bit_map == NULL){
-	 	printf("inode_bit_map is NULL.\n");
-	 	return -1;
-	}
-	printInodeBitMap();	
-	
-	uint8_t indexOfAvailableInode;
-	
-	// Step 1: Traverse inode bitmap to find an available slot			
-	uint8_t i;
-	for(i = 0; i < numBlocksForInodes; i++){
-		uint8_t inodeBitmapIndex = get_bitmap(inode_bit_map, i);		
-		if(inodeBitmapIndex == 0){
-			indexOfAvailableInode = i;
-			break;
+// Free the pages of f for logical blocks from up to, but not including, to
+static void dfile_drop(struct dfile *f, uint32_t from, uint32_t to) {
+	uint32_t i;
+
+	pthread_mutex_lock(&delalloc.lock);
+	for(i = 0; i < f->nbuckets; i++){
+		struct dpage **link = &f->pages[i];
+		while(*link != NULL){
+			struct dpage *page = *link;
+			if(page->lblk < from || page->lblk >= to){
+				link = &page->next;
+				continue;
+			}
+			*link = page->next;
+			f->npages--;
+			dpage_free(page);
 		}
 	}
+	pthread_mutex_unlock(&delalloc.lock);
+}
 
-	// Step 2: Get index of avaiable inode in file
-	int indexOfAvailableInodeInFile = sb->i_start_blk + indexOfAvailableInode;	
-	
-	// Step 3: Update inode bitmap	
-	set_bitmap(inode_bit_map, indexOfAvailableInode);	
-	//printInodeBitMap();
+// Drop the pages of ino past size and zero the end of the last one, so a
+// truncate doesn't allocate blocks only to free them. The size is left to the
+// truncate. Called with the inode locked exclusively.
+void delalloc_trim(uint32_t ino, uint32_t size) {
+	struct dfile *f = dfile_get(ino);
+	uint32_t keep = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
 
-	//Step 4: write new bitmap to disk	
-	bio_write(sb->i_bitmap_blk, inode_bit_map);	
-	
-	//printf("indexOfAvailableInodeInFile: %u\nReturning index %u as next free index\n",indexOfAvailableInodeInFile, indexOfAvailableInodeInFile);
-	printf("|--- get_avail_ino() is done.\n\n");	
+	if(f == NULL){
+		return;
+	}
+	dfile_drop(f, keep, UINT32_MAX);
 
-	// return block num in disk that contains next available inode 
-	return indexOfAvailableInodeInFile;		
+	struct dpage *last = size % BLOCK_SIZE ? dfile_page(f, size / BLOCK_SIZE) : NULL;
+	if(last != NULL){
+		memset(last->data + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+	}
 }
 
-void printInodeBitMap(){
-	uint8_t i;
-	printf("Printing inode bitmap...\n");
-	for(i = 0; i < numBlocksForInodes; i++){
-		uint8_t inodeBitmapIndex = get_bitmap(inode_bit_map, i);
-		printf("%u",inodeBitmapIndex);
-	}
-	printf("\n");
+static int dpage_cmp(const void *a, const void *b) {
+	const struct dpage *x = *(struct dpage *const *)a, *y = *(struct dpage *const *)b;
+	return x->lblk < y->lblk ? -1 : x->lblk > y->lblk;
 }
 
-/* --------------------------------------------
- * Get available data block number from bitmap
- ----------------------------------------------*/
-int get_avail_blkno() {
-	printf("|------------------------------\n");
-	printf("|--- starting get_avail_blkno()\n");
-	printf("|------------------------------\n");
-	if(data_bit_map == NULL){
-	 	printf("data_bit_map is NULL.\n");
-	 	return -1;
+// Give the buffered pages of inode their blocks, write them and write the inode
+// back with the buffered size and mtime. Called with the inode locked exclusively,
+// inside a journal handle. The inode is updated in place. If blocks run out or
+// the write fails, the pages not written stay buffered, with their reservations,
+// for a later flush to retry, and the inode's size only grows to cover what was
+// written.
+int delalloc_flush(struct inode *inode) {
+	struct dfile *f = dfile_get(inode->ino);
+	uint32_t i, n = 0;
+	int ret = 0;
+
+	if(f == NULL){
+		return 0;
 	}
-	printDataBitMap();
 
-	// Step 1: Traverse data block bitmap to find an available slot
-	uint8_t indexOfAvailableDataBlock;
-	int i;
-	for(i = 0; i < MAX_DNUM; i++){
-		uint8_t dataBitmapIndex = get_bitmap(data_bit_map, i);		
-		if(dataBitmapIndex == 0){			
-			indexOfAvailableDataBlock = i;
-			break;
-		}	
+	// Step 1: Line the pages up by logical block
+	struct arena_pos scratch = arena_mark();
+	struct dpage **pages = arena_alloc(f->npages * sizeof(struct dpage *));
+	for(i = 0; i < f->nbuckets; i++){
+		struct dpage *page;
+		for(page = f->pages[i]; page != NULL; page = page->next){
+			pages[n++] = page;
+		}
 	}
+	qsort(pages, n, sizeof(struct dpage *), dpage_cmp);
+
+	// Step 2: Map each run of adjacent pages, allocating whole runs for holes
+	int *blockNums = arena_alloc(n * sizeof(int));
+	const void **bufs = arena_alloc(n * sizeof(void *));
+	uint32_t count = 0;
+	uint32_t runs = 0;
+
+	i = 0;
+	while(i < n){
+		uint32_t want = 1;
+		while(i + want < n && pages[i + want]->lblk == pages[i]->lblk + want){
+			want++;
+		}
 
-	// Step 2: Get index of next avaiable data block in file
-	int indexOfAvailableDataBlockInFile = sb->d_start_blk + indexOfAvailableDataBlock;
-	
-	// Step 3: Update data block bitmap and write to disk	
-	set_bitmap(data_bit_map, indexOfAvailableDataBlock);	
-	//printDataBitMap();
+		uint32_t runLen, j;
+		uint32_t spent = 0;
+		int err = 0;
+		uint32_t pblk = bmap_run(inode, pages[i]->lblk, want, 0, &runLen);
+		if(pblk == 0){
+			// a hole: its blocks come out of the pages' own reservations
+			for(j = 0; j < runLen; j++){
+				delalloc_held += pages[i + j]->reserved;
+			}
+			spent = delalloc_held;
+			err = mapRun(inode, pages[i]->lblk, runLen, 1, &pblk, &runLen);
+			spent -= delalloc_held;
+			delalloc_held = 0;
+			runs++;
+			if(pblk == 0 && spent > 0){
+				// the run was given back when its extents couldn't be stored
+				pthread_mutex_lock(&delalloc.lock);
+				delalloc.reserved += spent;
+				pthread_mutex_unlock(&delalloc.lock);
+			}
+		}
+		if(pblk == 0){
+			// out of space, or of room in the extent map: the rest stays buffered
+			ret = err;
+			break;
+		}
 
-	//Step 4: write new bit map to disk	
-	bio_write(sb->d_bitmap_blk, data_bit_map);
+		// the reservations spent have turned into real blocks
+		pthread_mutex_lock(&delalloc.lock);
+		for(j = 0; j < runLen && spent > 0; j++){
+			if(pages[i + j]->reserved){
+				pages[i + j]->reserved = 0;
+				spent--;
+			}
+		}
+		pthread_mutex_unlock(&delalloc.lock);
+		for(j = 0; j < runLen; j++){
+			blockNums[count] = pblk + j;
+			bufs[count] = pages[i + j]->data;
+			count++;
+		}
+		i += runLen;
+	}
 
-	//printf("indexOfAvailableDataBlockInFile: %u\nReturning index %u as next free index\n",indexOfAvailableDataBlockInFile, indexOfAvailableDataBlockInFile);
-	//printf("|--- get_avail_blkno() is done.\n\n");
+	// Step 3: Write the pages, adjacent ones in a single request. After a failed
+	// write they are all kept; their blocks are mapped now, so a retry reuses them.
+	if(bio_writev(blockNums, bufs, count) < 0){
+		ret = -EIO;
+		count = 0;
+	}
+	uint32_t firstKept = count < n ? pages[count]->lblk : UINT32_MAX;
+	arena_release(scratch);
+	TRACE(TRACE_INFO, TR_DELALLOC_FLUSH, inode->ino, count);
+
+	// Step 4: Write the inode back with the time and the size the writes set, but
+	// no further than the first page still buffered
+	pthread_mutex_lock(&delalloc.lock);
+	uint64_t written = (uint64_t)firstKept * BLOCK_SIZE;
+	uint32_t size = f->size < written ? f->size : written;
+	if(size > inode->size){
+		inode->size = size;
+		inode->vstat.st_size = size;
+	}
+	inode->vstat.st_mtime = f->mtime;
+	f->failed = ret < 0 && ret != -ENOSPC;
+	delalloc.flushes++;
+	delalloc.flushed += count;
+	delalloc.runs += runs;
+	pthread_mutex_unlock(&delalloc.lock);
+	writei(inode->ino, inode);
+
+	// Step 5: Let go of the pages that made it to disk
+	if(firstKept == UINT32_MAX){
+		dfile_free(f);
+	} else {
+		dfile_drop(f, 0, firstKept);
+	}
+	return ret;
+}
 
-	// return block num in disk that contains next available data block 
-	return indexOfAvailableDataBlockInFile;	
+// Flush ino from outside a journal handle, locking it for the time
+int delalloc_flush_ino(uint32_t ino) {
+	struct inode inode;
+	int ret = 0;
 
+	if(dfile_get(ino) == NULL){
+		return 0;
+	}
+	journal_start();
+	struct inode *locked = ilock(ino, 1);
+	if(locked != NULL){
+		readi(ino, &inode);
+		ret = delalloc_flush(&inode);
+		iunlock(locked);
+	}
+	journal_stop();
+	return ret;
 }
 
-void printDataBitMap(){
-	uint8_t i;
-	printf("Printing data bitmap...\n");
-	
-	for(i = 0; i < 64; i++){
-		uint8_t dataBitmapIndex = get_bitmap(data_bit_map, i);
-		printf("%u",dataBitmapIndex);
+// Throw away the buffered pages of ino, which is being deleted. Called with the
+// inode locked exclusively.
+void delalloc_discard(uint32_t ino) {
+	struct dfile *f = dfile_get(ino);
+	if(f != NULL){
+		dfile_free(f);
 	}
-	printf("...MAX_DNUM\n");
 }
 
-/* -----------------
- * inode operations
- -------------------*/
+// Data blocks promised to buffered pages, which statfs() doesn't count as free
+uint32_t delalloc_reserved() {
+	pthread_mutex_lock(&delalloc.lock);
+	uint32_t reserved = delalloc.reserved;
+	pthread_mutex_unlock(&delalloc.lock);
+	return reserved;
+}
 
- //Given an inode number, get it's corresponding inode on disk
-int readi(uint16_t ino, struct inode *inode) {
-
-  // Scan bit map for ino, keep track of this index
-	uint16_t i;
-	uint16_t j = 0;
-	uint16_t inodeDiskBlockNumber;
-	for(i = sb->i_start_blk; j < numBlocksForInodes; i++, j++){
-		struct inode *temp = malloc(sizeof(struct inode));
-		bio_read(i,temp);
-		if(temp->ino == ino){
-			//if(temp->valid = 1){
-				inodeDiskBlockNumber = i;
-				bio_read(inodeDiskBlockNumber, inode);
-				return 0;
-			//}
+// Up to max inodes with buffered pages: all of them when over budget, otherwise
+// only those dirtied before expired. Files whose last flush failed for a reason
+// other than space wait for their next write. Called with delalloc.lock held.
+static int delalloc_pick(uint32_t *inos, int max, time_t expired) {
+	int over = delalloc.npages > delalloc.maxpages / 2;
+	int count = 0;
+	int i;
+
+	for(i = 0; i < DELALLOC_BUCKETS && count < max; i++){
+		struct dfile *f;
+		for(f = delalloc.buckets[i]; f != NULL && count < max; f = f->next){
+			if(!f->failed && (over || f->dirtied <= expired)){
+				inos[count++] = f->ino;
+			}
 		}
-	}		
-	/*
-	int block = (ino * sizeof(struct inode))/BLOCK_SIZE;
-	int sector = ((block * BLOCK_SIZE) + inodeStardAddr)/512;
-	*/
+	}
+	return count;
+}
 
-	return 0;
+// Writeback thread: flushes files once their pages are DELALLOC_EXPIRE_SECS old,
+// and everything it can while the budget is exceeded
+static void *delalloc_thread(void *arg) {
+	uint32_t inos[64];
+
+	pthread_mutex_lock(&delalloc.lock);
+	while(!delalloc.stop){
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec++;
+		pthread_cond_timedwait(&delalloc.wake, &delalloc.lock, &until);
+
+		int count;
+		uint32_t before = ~0u;
+		while(!delalloc.stop && delalloc.npages < before
+				&& (count = delalloc_pick(inos, 64, time(NULL) - DELALLOC_EXPIRE_SECS)) > 0){
+			int i;
+			before = delalloc.npages;
+			pthread_mutex_unlock(&delalloc.lock);
+			for(i = 0; i < count; i++){
+				if(delalloc_flush_ino(inos[i]) < 0){
+					fprintf(stderr, "tfs: writing back inode %u failed\n", inos[i]);
+				}
+			}
+			arena_reset();
+			pthread_mutex_lock(&delalloc.lock);
+		}
+	}
+	pthread_mutex_unlock(&delalloc.lock);
+	return NULL;
 }
 
-//give an inode number, and overrite the inode corresponding to that number with the new inode on disk
-int writei(uint16_t ino, struct inode *inode) {
+// Start buffering writes, with a budget of maxpages pages, and the writeback thread
+void delalloc_start(uint32_t maxpages) {
+	delalloc.maxpages = maxpages;
+	delalloc.stop = 0;
+	if(!delalloc.running && pthread_create(&delalloc.thread, NULL, delalloc_thread, NULL) == 0){
+		delalloc.running = 1;
+	}
+}
 
-	// Get the block number where this inode resides on disk
-	uint16_t i;
-	uint16_t j = 0;
-	uint16_t inodeDiskBlockNumber;
-	for(i = sb->i_start_blk; j < numBlocksForInodes; i++, j++){
-		struct inode *temp = malloc(sizeof(struct inode));
-		bio_read(i,temp);
-		if(temp->ino == ino){
-			inodeDiskBlockNumber = i;
-			bio_write(inodeDiskBlockNumber, inode);
-			return 0;
-			//inodeDiskBlockNumber = sb->i_start_blk + i;
+// Stop the writeback thread and flush every file still buffered
+void delalloc_stop() {
+	uint32_t inos[64];
+	int count, i;
+
+	if(delalloc.running){
+		pthread_mutex_lock(&delalloc.lock);
+		delalloc.stop = 1;
+		pthread_cond_signal(&delalloc.wake);
+		pthread_mutex_unlock(&delalloc.lock);
+		pthread_join(delalloc.thread, NULL);
+		delalloc.running = 0;
+	}
+
+	pthread_mutex_lock(&delalloc.lock);
+	delalloc.maxpages = 0;
+	for(i = 0; i < DELALLOC_BUCKETS; i++){
+		// one last try for every file
+		struct dfile *f;
+		for(f = delalloc.buckets[i]; f != NULL; f = f->next){
+			f->failed = 0;
 		}
-	}	
-	
-	return 0;
+	}
+	uint32_t before = ~0u;
+	while(delalloc.npages < before && (count = delalloc_pick(inos, 64, time(NULL))) > 0){
+		before = delalloc.npages;
+		pthread_mutex_unlock(&delalloc.lock);
+		for(i = 0; i < count; i++){
+			delalloc_flush_ino(inos[i]);
+		}
+		pthread_mutex_lock(&delalloc.lock);
+	}
+	if(delalloc.npages > 0){
+		fprintf(stderr, "tfs: %u buffered pages could not be written back\n", delalloc.npages);
+	}
+	pthread_mutex_unlock(&delalloc.lock);
+}
+
+void delalloc_stats(FILE *out) {
+	pthread_mutex_lock(&delalloc.lock);
+	fprintf(out, "delayed allocation: %u pages buffered (%u reserved), %lu writes, %lu flushes of %lu pages in %lu runs\n",
+		delalloc.npages, delalloc.reserved, delalloc.writes, delalloc.flushes, delalloc.flushed, delalloc.runs);
+	pthread_mutex_unlock(&delalloc.lock);
 }
 
+void delalloc_stats_reset() {
+	pthread_mutex_lock(&delalloc.lock);
+	delalloc.writes = delalloc.flushes = delalloc.flushed = delalloc.runs = 0;
+	pthread_mutex_unlock(&delalloc.lock);
+}
 
 /* --------------------
  * directory operations
 -----------------------*/
-int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
 
-  // Step 1: Call readi() to get the inode using ino (inode number of current directory)
-  	struct inode *inode = malloc(sizeof(struct inode));  	
-	//this is the inode you're working with
-	readi(ino, inode);
+ // Directory blocks hold variable-length struct dir_record entries packed back to back.
+ // Every block is fully covered by its records' rec_len, and a record's rec_len may
+ // include free space after its name that a later dir_add() can split off. An inline
+ // directory keeps its records the same way in the inode's inline area instead, as
+ // its only chunk.
+
+static int dirRecordMatches(struct dir_record *record, const char *fname, size_t name_len) {
+	return record->valid && record->name_len == name_len && memcmp(record->name, fname, name_len) == 0;
+}
+
+// Number of record chunks in a directory: the inline area, or its blocks
+static int dirChunks(struct inode *dir) {
+	return (dir->flags & INODE_INLINE) ? 1 : dir->size / BLOCK_SIZE;
+}
+
+// Read chunk lblk of dir into buf (BLOCK_SIZE bytes). Returns the chunk length,
+// 0 for a hole.
+static int dirReadChunk(struct inode *dir, int lblk, char *buf) {
+	if(dir->flags & INODE_INLINE){
+		memcpy(buf, dir->inline_data, INODE_INLINE_MAX);
+		return INODE_INLINE_MAX;
+	}
+	int blkno = bmap(dir, lblk, 0);
+	if(blkno <= 0){
+		return 0;
+	}
+	journal_read(blkno, buf);
+	return BLOCK_SIZE;
+}
+
+// Write chunk lblk of dir back from buf, which dirReadChunk() filled
+static void dirWriteChunk(struct inode *dir, int lblk, char *buf) {
+	if(dir->flags & INODE_INLINE){
+		memcpy(dir->inline_data, buf, INODE_INLINE_MAX);
+		writei(dir->ino, dir);
+		return;
+	}
+	journal_write(bmap(dir, lblk, 0), buf);
+}
+
+// Move a full inline directory's records into a newly allocated first block.
+// The last record takes over the rest of the block as free space.
+static int uninlineDir(struct inode *dir) {
+	struct arena_pos scratch = arena_mark();
+	char *block = arena_zalloc(BLOCK_SIZE);
+	memcpy(block, dir->inline_data, INODE_INLINE_MAX);
+
+	// Step 1: Find the last record and extend it to the end of the block
+	int offset = 0;
+	struct dir_record *record = (struct dir_record *)block;
+	while(offset + record->rec_len < INODE_INLINE_MAX){
+		offset += record->rec_len;
+		record = (struct dir_record *)(block + offset);
+	}
+	record->rec_len += BLOCK_SIZE - INODE_INLINE_MAX;
+
+	// Step 2: Map the block in place of the inline area
+	memset(dir->inline_data, 0, INODE_INLINE_MAX);
+	dir->flags &= ~INODE_INLINE;
+	int blkno = bmap(dir, 0, 1);
+	if(blkno <= 0){
+		record->rec_len -= BLOCK_SIZE - INODE_INLINE_MAX;
+		memcpy(dir->inline_data, block, INODE_INLINE_MAX);
+		dir->flags |= INODE_INLINE;
+		arena_release(scratch);
+		return -1;
+	}
+	journal_write(blkno, block);
+	arena_release(scratch);
+
+	// Step 3: Update directory inode
+	dir->size = BLOCK_SIZE;
+	dir->vstat.st_size = dir->size;
+	writei(dir->ino, dir);
+	return 0;
+}
 
-	//Now, inode should be the 'starting' directory	
+int dir_find(uint32_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
+
+  // Step 1: Call readi() to get the inode using ino (inode number of current directory)
+	struct inode inode;
+	if(readi(ino, &inode) < 0 || inode.type != TFS_DIR){
+		return -1;
+	}
 
   // Step 2: Get data block of current directory from inode, read directory's data block 
   // and check each directory entry.
-
-	int i;
-	for(i = 0; i < 16; i++){
-		//if you encounter a valid file/dir linked to this inode
-		if(inode->direct_ptr[i] != 0){		
-			struct dirent *directoryEntry = malloc(sizeof(struct dirent));
-			
-			bio_read((sb->d_start_blk + inode->direct_ptr[i]), directoryEntry);
+	struct arena_pos scratch = arena_mark();
+	char *block = arena_alloc(BLOCK_SIZE);
+	int numChunks = dirChunks(&inode);
+	int lblk;
+	for(lblk = 0; lblk < numChunks; lblk++){
+		int chunkLen = dirReadChunk(&inode, lblk, block);
+
+		int offset;
+		for(offset = 0; offset < chunkLen; offset += ((struct dir_record *)(block + offset))->rec_len){
+			struct dir_record *record = (struct dir_record *)(block + offset);
+			if(record->rec_len == 0){
+				break;
+			}
 
 			//If the name matches, then copy directory entry to dirent structure
-			if(strcmp(fname, directoryEntry->name) == 0){
-				dirent->ino = directoryEntry->ino;
-				dirent->valid = directoryEntry->valid;
-				strcpy(dirent->name, directoryEntry->name);
-				return 0;		
+			if(dirRecordMatches(record, fname, name_len)){
+				dirent->ino = record->ino;
+				dirent->valid = 1;
+				memcpy(dirent->name, record->name, name_len);
+				dirent->name[name_len] = '\0';
+				arena_release(scratch);
+				return 0;
 			}
 		}
 	}
+	arena_release(scratch);
 	return -1;
 }
 
-int dir_add(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
+// Returns 0 on success, -EEXIST if fname is already used, -ENOSPC if there is no room
+int dir_add(struct inode dir_inode, uint32_t f_ino, const char *fname, size_t name_len) {
 
-	// Step 1: Read dir_inode's data block and check each directory entry of dir_inode,
-	// check if fname (directory name) is already used in other entries								
-	int i;
-	for(i = 0; i < 16; i++){
-		//if you encounter a valid file/dir linked to this inode
-		if(dir_inode.direct_ptr[i] != 0){		
-			struct dirent *directoryEntry = malloc(sizeof(struct dirent));
-			
-			bio_read(dir_inode.direct_ptr[i], directoryEntry);			
-
-			if(strcmp(fname, directoryEntry->name) == 0){
-				//if there already exists an entry, return
-				printf("File name already exsists.\n");		
-				return 0;
+	if(name_len == 0 || name_len >= DIRENT_NAME_LEN){
+		return -ENAMETOOLONG;
+	}
+
+	size_t needed = DIR_REC_LEN(name_len);
+	struct arena_pos scratch = arena_mark();
+	char *block = arena_alloc(BLOCK_SIZE);
+	int freeLblk = -1;
+	int freeOffset = 0;
+
+	// Step 1: Read dir_inode's data blocks and check each directory entry of dir_inode:
+	// fname must not be used yet, and remember the first record with room to spare
+	int numChunks = dirChunks(&dir_inode);
+	int lblk;
+	for(lblk = 0; lblk < numChunks; lblk++){
+		int chunkLen = dirReadChunk(&dir_inode, lblk, block);
+
+		int offset;
+		for(offset = 0; offset < chunkLen; offset += ((struct dir_record *)(block + offset))->rec_len){
+			struct dir_record *record = (struct dir_record *)(block + offset);
+			if(record->rec_len == 0){
+				break;
+			}
+
+			if(dirRecordMatches(record, fname, name_len)){
+				TRACE(TRACE_ERR, TR_DIR_EXISTS, dir_inode.ino, trace_hash(fname, name_len));
+				arena_release(scratch);
+				return -EEXIST;
+			}
+
+			size_t used = record->valid ? DIR_REC_LEN(record->name_len) : 0;
+			if(freeLblk < 0 && record->rec_len - used >= needed){
+				freeLblk = lblk;
+				freeOffset = offset;
 			}
 		}
 	}
 
 	// Step 2: Add directory entry in dir_inode's data block and write to disk
-	for(i = 0; i < 16; i++){
-		//if you find a free space in direct_ptr
-		if(dir_inode.direct_ptr[i] == 0){		
-			// get next available space in data
-			int nextAvailableSpaceInData =  get_avail_blkno();
-
-			dir_inode.direct_ptr[i] = nextAvailableSpaceInData;	
-
-			//create new entry
-			struct dirent *newEntry = malloc(sizeof(struct dirent));
-			newEntry->ino = f_ino;
-			newEntry->valid = 1;
-			strcpy(newEntry->name, fname);
-			
-			//write new entry to disk
-			bio_write(nextAvailableSpaceInData, newEntry);
-			break;
+	struct dir_record *newEntry;
+	if(freeLblk >= 0){
+		// reuse free space: either a freed record, or the slack after a live one
+		dirReadChunk(&dir_inode, freeLblk, block);
+		struct dir_record *record = (struct dir_record *)(block + freeOffset);
+		if(record->valid){
+			size_t used = DIR_REC_LEN(record->name_len);
+			newEntry = (struct dir_record *)(block + freeOffset + used);
+			newEntry->rec_len = record->rec_len - used;
+			record->rec_len = used;
+		} else {
+			newEntry = record;
+		}
+	} else if(dir_inode.flags & INODE_INLINE){
+		// the inline area is full, move the entries to a block and add there
+		arena_release(scratch);
+		if(uninlineDir(&dir_inode) < 0){
+			return -ENOSPC;
+		}
+		return dir_add(dir_inode, f_ino, fname, name_len);
+	} else {
+		// no room anywhere, extend the directory by one block
+		freeLblk = numChunks;
+		if(bmap(&dir_inode, freeLblk, 1) <= 0){
+			arena_release(scratch);
+			return -ENOSPC;
 		}
+		memset(block, 0, BLOCK_SIZE);
+		newEntry = (struct dir_record *)block;
+		newEntry->rec_len = BLOCK_SIZE;
+
+		// Step 3: Update directory inode
+		dir_inode.size += BLOCK_SIZE;
+		dir_inode.vstat.st_size = dir_inode.size;
+		writei(dir_inode.ino, &dir_inode);
 	}
 
+	newEntry->ino = f_ino;
+	newEntry->valid = 1;
+	newEntry->name_len = name_len;
+	memcpy(newEntry->name, fname, name_len);
+	dirWriteChunk(&dir_inode, freeLblk, block);
+	TRACE(TRACE_INFO, TR_DIR_ADD, dir_inode.ino, f_ino);
+
+	arena_release(scratch);
 	return 0;
 }
 
 int dir_remove(struct inode dir_inode, const char *fname, size_t name_len) {
 
+	struct arena_pos scratch = arena_mark();
+	char *block = arena_alloc(BLOCK_SIZE);
+
 	// Step 1: Read dir_inode's data block and check each directory entry of dir_inode to see if fname exist
-	int fileExsists = 0;
-	int indexOfFileInDirectPtr;
+	int numChunks = dirChunks(&dir_inode);
+	int lblk;
+	for(lblk = 0; lblk < numChunks; lblk++){
+		int chunkLen = dirReadChunk(&dir_inode, lblk, block);
+
+		struct dir_record *previous = NULL;
+		int offset;
+		for(offset = 0; offset < chunkLen; offset += ((struct dir_record *)(block + offset))->rec_len){
+			struct dir_record *record = (struct dir_record *)(block + offset);
+			if(record->rec_len == 0){
+				break;
+			}
 
-	int i;
-	for(i = 0; i < 16; i++){
-		//if you encounter a valid file/dir linked to this inode
-		if(dir_inode.direct_ptr[i] != 0){		
-			struct dirent *directoryEntry = malloc(sizeof(struct dirent));
-			bio_read(dir_inode.direct_ptr[i], directoryEntry);
-
-			if(strcmp(fname, directoryEntry->name) == 0){
-				//if there already exists an entry, set file exsists to true	
-				indexOfFileInDirectPtr = i;				
-				fileExsists = 1;
+			// Step 2: If exist, then remove it from dir_inode's data block and write to disk.
+			// The space goes to the previous record, or the record is just invalidated
+			// when it is the first in its block, so dir_add() can reuse it.
+			if(dirRecordMatches(record, fname, name_len)){
+				if(previous != NULL){
+					previous->rec_len += record->rec_len;
+				} else {
+					record->valid = 0;
+				}
+				dirWriteChunk(&dir_inode, lblk, block);
+				arena_release(scratch);
+				TRACE(TRACE_INFO, TR_DIR_REMOVE, dir_inode.ino, trace_hash(fname, name_len));
+				return 0;
 			}
+			previous = record;
 		}
 	}
 
-	if(fileExsists == 0){
-		printf("file doesn't exsist\n");
-		return 0;
-	}
+	arena_release(scratch);
+	TRACE(TRACE_ERR, TR_DIR_NOENT, dir_inode.ino, trace_hash(fname, name_len));
+	return -1;
+}
 
-	// Step 3: If exist, then remove it from dir_inode's data block and write to disk
-	dir_inode.direct_ptr[indexOfFileInDirectPtr] = 0;
-	bio_write(sb->i_start_blk + dir_inode.ino, &dir_inode);
-	return 0;
+// Returns 1 if the directory holds no live entries
+int dir_is_empty(struct inode *dir_inode) {
+
+	struct arena_pos scratch = arena_mark();
+	char *block = arena_alloc(BLOCK_SIZE);
+	int numChunks = dirChunks(dir_inode);
+	int lblk;
+	for(lblk = 0; lblk < numChunks; lblk++){
+		int chunkLen = dirReadChunk(dir_inode, lblk, block);
+
+		int offset;
+		for(offset = 0; offset < chunkLen; offset += ((struct dir_record *)(block + offset))->rec_len){
+			struct dir_record *record = (struct dir_record *)(block + offset);
+			if(record->rec_len == 0){
+				break;
+			}
+			if(record->valid){
+				arena_release(scratch);
+				return 0;
+			}
+		}
+	}
+	arena_release(scratch);
+	return 1;
 }
 
 /* ---------------------------------------------------------------------------
  * namei operation
   ---------------------------------------------------------------------------*/
- // Note: You could either implement it in a iterative way or recursive way
 
- // Assumes always starting from root, ex: ./folder1/folder2/file.txt
-int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {	
-	
-	//get initial parameters for recusive function: path, currentDirentName, currentDirentNameIndex, currentInode, finalWord	
-	char *firstDirentName = "";
-	char *finalDirentName = "";
-	char* token;
-
-	//get first dirent name
-	firstDirentName = getNthDirentInPathString(path, 1);
+ // Walks the first len bytes of path (PATH_WHOLE for all of it) one component at a
+ // time, starting from directory ino (0, root, for absolute paths). Components are
+ // slices of path, so the walk copies nothing. Each step is answered from the
+ // dentry cache when possible and falls back to dir_find(), caching the result -
+ // including misses. The directory is locked shared for the dir_find() and the
+ // insert, and only for that step.
+static int lookupPath(const char *path, size_t len, uint32_t ino, struct inode *inode) {
+
+	uint32_t current = ino;
+	struct path_iter it;
+	const char *component;
+	size_t componentLen;
+
+	// Step 1: Take the path one component at a time
+	path_iter_init(&it, path, len);
+	while(path_next(&it, &component, &componentLen)){
+
+		// Step 2: Look it up in the dentry cache, then in the directory itself
+		int child;
+		if(!dcache_lookup(current, component, componentLen, &child)){
+			struct inode *dir = ilock(current, 0);
+			if(dir == NULL){
+				return -1;
+			}
+			struct dirent entry;
+			if(dir_find(current, component, componentLen, &entry) < 0){
+				child = DCACHE_NEGATIVE;
+			} else {
+				child = entry.ino;
+			}
+			dcache_insert(current, component, componentLen, child);
+			iunlock(dir);
+		}
+		if(child == DCACHE_NEGATIVE){
+			return -1;
+		}
+		current = child;
+	}
 
-	// get final dirent name	
-	char filepath[100]; 	
-	char tmp[100];
+	// Step 3: Read the inode of the final component
+	return readi(current, inode);
+}
 
-	const char delim[4] = "/";
+int get_node_by_path(const char *path, uint32_t ino, struct inode *inode) {
+	return lookupPath(path, PATH_WHOLE, ino, inode);
+}
 
-	strcpy(filepath, path);
-  
-    token = strtok(filepath, delim); 	
-	
-    while (token != 0) {         
-        strcpy(tmp, token);
-		token = strtok(0, delim);
-    } 
-	strcpy(finalDirentName, tmp);
-
-	//Get inode corresponding to root
-	struct inode *root = malloc(sizeof(struct inode));
-	readi(0, root);
-	
-	//In recursive function pass in: path, firstDirentName, nth word in in path string, root inode, and finalDirentName
-	struct inode *finalEntryInPathInode = getPathRec(path, firstDirentName, 1, root, finalDirentName);	
+// get_node_by_path helper functions ------------------------------------------------------------------------------------
 
-	//finalEntryInPathInode should contain an Inode that refers to the final dirent in the path string
+// Resolve the first len bytes of path (PATH_WHOLE for all of it, or a parent_len
+// from path_split()) and lock its inode, shared or exclusive. *inode is read once
+// the lock is held, so it can't be stale. Returns the locked inode to hand to
+// iunlock(), or NULL if the path doesn't exist or was removed while waiting for
+// the lock.
+//
+// The walk takes no lock on the final inode, so before the lock is granted the
+// file may be removed and its number reused by a new one. If any inode number
+// was given back meanwhile, the walk is done again.
+struct inode *get_locked_node_by_path(const char *path, size_t len, int exclusive, struct inode *inode) {
+	for(;;){
+		uint32_t frees = __atomic_load_n(&ino_frees, __ATOMIC_ACQUIRE);
+		if(lookupPath(path, len, 0, inode) < 0){
+			return NULL;
+		}
+		struct inode *locked = ilock(inode->ino, exclusive);
+		if(locked == NULL){
+			return NULL;
+		}
+		if(readi(inode->ino, inode) < 0 || !inode->valid){
+			iunlock(locked);
+			return NULL;
+		}
+		if(__atomic_load_n(&ino_frees, __ATOMIC_ACQUIRE) == frees){
+			return locked;
+		}
+		iunlock(locked);
+	}
+}
 
-	//use readi to set 'inode' argument to the inode that corresponds to the final dirent
-	if(finalEntryInPathInode != NULL){
-		readi(finalEntryInPathInode->ino, inode);
-	} else {
-		return -1;
+// get_locked_node_by_path() for an operation on an open file or directory: the
+// handle in fi already knows the inode number, so no path is walked. Without a
+// handle it falls back to the path.
+struct inode *get_locked_node_by_handle(const char *path, struct fuse_file_info *fi, int exclusive, struct inode *inode) {
+	struct tfs_file *file = fi != NULL ? (struct tfs_file *)(uintptr_t)fi->fh : NULL;
+	if(file == NULL){
+		return get_locked_node_by_path(path, PATH_WHOLE, exclusive, inode);
+	}
+	struct inode *locked = ilock(file->ino, exclusive);
+	if(locked == NULL){
+		return NULL;
+	}
+	if(readi(file->ino, inode) < 0 || !inode->valid){
+		iunlock(locked);
+		return NULL;
 	}
+	return locked;
+}
 
-	return 0;
+// Set up a freshly allocated inode
+void initInode(struct inode *inode, uint32_t ino, uint32_t type, mode_t mode) {
+	memset(inode, 0, sizeof(struct inode));
+	inode->ino = ino;
+	inode->valid = 1;
+	inode->type = type;
+	inode->link = (type == TFS_DIR) ? 2 : 1;
+
+	inode->vstat.st_ino = ino;
+	inode->vstat.st_mode = ((type == TFS_DIR) ? S_IFDIR : S_IFREG) | (mode & 07777);
+	inode->vstat.st_nlink = inode->link;
+	inode->vstat.st_uid = getuid();
+	inode->vstat.st_gid = getgid();
+	inode->vstat.st_blksize = BLOCK_SIZE;
+	time(&inode->vstat.st_mtime);
+	inode->vstat.st_atime = inode->vstat.st_mtime;
+	inode->vstat.st_ctime = inode->vstat.st_mtime;
+
+	// Data starts out inline. A directory's inline area is a single free record.
+	inode->flags = INODE_INLINE;
+	if(type == TFS_DIR){
+		((struct dir_record *)inode->inline_data)->rec_len = INODE_INLINE_MAX;
+		inode->size = INODE_INLINE_MAX;
+		inode->vstat.st_size = inode->size;
+	}
 }
 
-// get_node_by_path helper functions ------------------------------------------------------------------------------------
+/*  ---------------------------------------------------------------------------
+ * Make file system
+  ---------------------------------------------------------------------------*/
+// Where the parts of group g go on a disk laid out by s. Every group but the
+// last is blocks_per_group blocks long; the last one ends at s->nblocks.
+static void groupLayout(struct superblock *s, uint32_t g, struct group_desc *gd) {
+	uint64_t start = s->g_start_blk + (uint64_t)g * s->blocks_per_group;
+	uint64_t end = start + s->blocks_per_group < s->nblocks ? start + s->blocks_per_group : s->nblocks;
+
+	gd->i_bitmap_blk = start;
+	gd->d_bitmap_blk = start + 1;
+	gd->i_start_blk = start + 2;
+	gd->d_start_blk = gd->i_start_blk + s->inodes_per_group / INODES_PER_BLOCK;
+	gd->d_blocks = end > gd->d_start_blk ? end - gd->d_start_blk : 0;
+	gd->i_init_blks = 0;
+}
 
-// returns inode of final word in path
-struct inode *getPathRec(const char *path, char *currentDirentName, int currentDirentNameIndex, struct inode *currentInode, char *finalDirentName){
-	// base case
-	if(strcmp(currentDirentName, finalDirentName) == 0){
-		// search directory of current Inode for finalDirentName
-		int i;
-		for(i = 0; i < 16; i++){	
-			struct dirent *currentDirEntry = getDirEntryOfDataBlock(currentInode->direct_ptr[i]);
-
-			// if the finalDirentName is found, return it's corresponding inode
-			if(strcmp(currentDirEntry->name,finalDirentName) == 0){
-				struct inode *inodeOfCurrentDirEntry = getInodeOfDataBlock(currentInode->direct_ptr[i]);
-				return inodeOfCurrentDirEntry;
+// Cut an nblocks disk into allocation groups holding at least ninodes inodes
+// between them and fill in the superblock's layout fields. Aims for
+// GROUP_MIN_COUNT groups, but keeps each one between GROUP_MIN_BLOCKS and
+// GROUP_MAX_BLOCKS blocks; a last group too short for its inodes and a data
+// block is left off the end. Groups are made smaller, and so more of them,
+// while a group's share of the inodes overflows its one-block inode bitmap.
+static int layoutGroups(struct superblock *s, uint64_t nblocks, uint32_t ninodes) {
+	uint32_t gdtBlocks = 1;
+	uint64_t maxPerGroup = GROUP_MAX_BLOCKS;
+	uint64_t rest, perGroup, ngroups, inodesPerGroup, lastBlocks, metaBlocks;
+
+	for(;;){
+		// Step 1: Everything after the descriptors and the journal goes to groups
+		uint64_t start = 1 + gdtBlocks + JOURNAL_BLOCKS;
+		if(ninodes == 0 || nblocks <= start){
+			return -1;
+		}
+		rest = nblocks - start;
+		perGroup = rest / GROUP_MIN_COUNT;
+		perGroup = perGroup < GROUP_MIN_BLOCKS ? GROUP_MIN_BLOCKS : perGroup;
+		perGroup = perGroup > maxPerGroup ? maxPerGroup : perGroup;
+		perGroup = perGroup > rest ? rest : perGroup;
+		ngroups = (rest + perGroup - 1) / perGroup;
+
+		// Step 2: Share the inodes out, dropping a last group that can't hold its share
+		for(;;){
+			inodesPerGroup = (ninodes + ngroups - 1) / ngroups;
+			inodesPerGroup = (inodesPerGroup + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK * INODES_PER_BLOCK;
+			metaBlocks = 2 + inodesPerGroup / INODES_PER_BLOCK;
+			lastBlocks = rest - (ngroups - 1) * perGroup;
+			lastBlocks = lastBlocks > perGroup ? perGroup : lastBlocks;
+			if(lastBlocks > metaBlocks || ngroups == 1){
+				break;
 			}
+			ngroups--;
 		}
-		// if finalDirentName isn't found, return NULL
-		return NULL;
+		if(inodesPerGroup > BITS_PER_BLOCK){
+			if(perGroup / 2 < GROUP_MIN_BLOCKS){
+				return -1;
+			}
+			maxPerGroup = perGroup / 2;
+			continue;
+		}
+		if(lastBlocks <= metaBlocks){
+			return -1;
+		}
+
+		// Step 3: Start over if the descriptors need more blocks than assumed
+		uint32_t need = (ngroups + GROUP_DESCS_PER_BLOCK - 1) / GROUP_DESCS_PER_BLOCK;
+		if(need == gdtBlocks){
+			break;
+		}
+		gdtBlocks = need;
 	}
 
-	// search directory of current Inode for currentDirentName
-	int i;
-	for(i = 0; i < 16; i++){
-		struct dirent *currentDirEntry = getDirEntryOfDataBlock(currentInode->direct_ptr[i]);
+	s->gd_blk = 1;
+	s->j_start_blk = s->gd_blk + gdtBlocks;
+	s->j_blocks = JOURNAL_BLOCKS;
+	s->g_start_blk = s->j_start_blk + s->j_blocks;
+	s->ngroups = ngroups;
+	s->blocks_per_group = perGroup;
+	s->inodes_per_group = inodesPerGroup;
+	s->nblocks = s->g_start_blk + (ngroups - 1) * perGroup + lastBlocks;
+	s->max_inum = ngroups * inodesPerGroup;
+	s->max_dnum = (ngroups - 1) * (perGroup - metaBlocks) + lastBlocks - metaBlocks;
+	return 0;
+}
+
+// Set up the in-memory allocators of every group. If load is set their
+// bitmaps are left for bitmap_load() to read.
+static void groups_init(int load) {
+	uint32_t g;
+	groups = calloc(sb->ngroups, sizeof(struct group));
+	for(g = 0; g < sb->ngroups; g++){
+		balloc_init(&groups[g].inodes, sb->inodes_per_group, gdt[g].i_bitmap_blk, load);
+		balloc_init(&groups[g].blocks, gdt[g].d_blocks, gdt[g].d_bitmap_blk, load);
+	}
+	group_rotor = 0;
+}
+
+/*  ---------------------------------------------------------------------------
+ * Make file system
+  ---------------------------------------------------------------------------*/
+int tfs_mkfs(uint64_t disk_size, uint32_t ninodes) {
+	// printf("|-----------------------\n");
+	// printf("|--- Starting tfs_mkfs()\n");
+	// printf("|-----------------------\n");
 
-		// if currentDirentName is found, make a recursive call that is 
-		// passed the path, the next dirent Name from the path string, 
-		// it's index in the path string, the inode of the current directory and the final dirent name
+	// Step 1: Work out the layout, see layoutGroups()
+	uint64_t nblocks = disk_size / BLOCK_SIZE;
+	if(nblocks > MAX_DISK_BLOCKS){
+		fprintf(stderr, "tfs_mkfs: %llu blocks is more than the %llu supported\n",
+			(unsigned long long)nblocks, MAX_DISK_BLOCKS);
+		return -1;
+	}
+	// a whole block, since the superblock is read and written as one
+	sb = calloc(1, BLOCK_SIZE);
+	if(layoutGroups(sb, nblocks, ninodes) < 0){
+		fprintf(stderr, "tfs_mkfs: %llu blocks can't hold %u inodes\n",
+			(unsigned long long)nblocks, ninodes);
+		free(sb);
+		sb = NULL;
+		return -1;
+	}
+	sb->magic_num = MAGIC_NUM;
 
-		if(strcmp(currentDirEntry->name,currentDirentName) == 0){
-			struct inode *inodeOfCurrentDirEntry = getInodeOfDataBlock(currentInode->direct_ptr[i]);
-			// get next dirent name
-			char *nextDirentName = getNthDirentInPathString(path, currentDirentNameIndex++);
+	// Call dev_init() to initialize (Create) Diskfile
+	dev_set_size(nblocks * BLOCK_SIZE);
+	dev_init(disk_path);
 
-			//pass parameters into recursive function
-			return getPathRec(path, nextDirentName, currentDirentNameIndex++, inodeOfCurrentDirEntry, finalDirentName);
-		}
+	// create the group descriptors, with only the root's inode table block written so far
+	uint32_t g;
+	gdt_blocks = sb->j_start_blk - sb->gd_blk;
+	gdt = calloc(gdt_blocks, BLOCK_SIZE);
+	for(g = 0; g < sb->ngroups; g++){
+		groupLayout(sb, g, &gdt[g]);
 	}
+	gdt[0].i_init_blks = 1;
 
-	return NULL;
-}
+	// start with empty inode and dentry caches
+	icache_init();
+	dcache_init();
 
-struct dirent *getDirEntryOfDataBlock(int dataBlock){
-	struct dirent *dirEntry = malloc(sizeof(struct dirent));
-	bio_read(dataBlock, dirEntry);
-	return dirEntry;
-}
+	dev_open(disk_path);
 
-struct inode *getInodeOfDataBlock(int dataBlock){
-	struct dirent *dirEntry = getDirEntryOfDataBlock(dataBlock);
-	int inodeNum = dirEntry->ino;
+	//write super block and group descriptors to disk
+	bio_write(0, sb);
+	for(g = 0; g < gdt_blocks; g++){
+		bio_write(sb->gd_blk + g, (char *)gdt + (size_t)g * BLOCK_SIZE);
+	}
 
-	struct inode *inode = malloc(sizeof(struct inode));
-	readi(inodeNum, inode);
-	return inode;
-}
+	// Create the inode and data block bitmaps of every group
+	groups_init(0);
 
-char *getNthDirentInPathString(const char *path, int n){
-	char string[100]; 	
-	strcpy(string, path);
+	// Allocate the 0th inode (for root), the first one of group 0
+	balloc_alloc(&groups[0].inodes);
 
-  	const char delim[4] = "/"; 
-    char* file = strtok(string, delim);
-	
-	file = strtok(0, delim);  
+	// write bitmaps to disk. The disk file starts out all zeros, so only the
+	// bitmap block holding the root's bit is written.
+	bitmap_sync();
 
-	int count = 1;	
-	while(file != 0){
+	// The root directory starts out empty, its first data block is allocated by dir_add()
+
+	// Only the first inode table block, holding inode 0 (root), is written. The
+	// rest is initialized by itable_init() as inodes get allocated from it.
+	struct inode *inodeBlock = calloc(1, BLOCK_SIZE);
+	initInode(&inodeBlock[0], 0, TFS_DIR, 0755);
+	bio_write(gdt[0].i_start_blk, inodeBlock);
+	free(inodeBlock);
+
+	// Start with an empty journal, metadata changes go through it from here on
+	journal_init(sb->j_start_blk, sb->j_blocks, 1, flush_metadata, release_blkno);
+	
+	//printf("|--- tfs_mkfs() is done.\n\n");
 		
-		if(count == n){
-			break;			
+	return 0;
+}
+
+// Check that a superblock read from disk describes a layout tfs_mkfs() could
+// have made, on a disk file that is big enough
+static int superblock_valid(struct superblock *s, uint64_t disk_blocks) {
+	uint64_t gdtBlocks = ((uint64_t)s->ngroups + GROUP_DESCS_PER_BLOCK - 1) / GROUP_DESCS_PER_BLOCK;
+
+	return s->magic_num == MAGIC_NUM
+		&& s->nblocks <= disk_blocks
+		&& s->ngroups > 0
+		&& s->inodes_per_group > 0
+		&& s->inodes_per_group % INODES_PER_BLOCK == 0
+		&& s->inodes_per_group <= BITS_PER_BLOCK
+		&& s->blocks_per_group > 0
+		&& s->blocks_per_group <= GROUP_MAX_BLOCKS
+		&& (uint64_t)s->max_inum == (uint64_t)s->ngroups * s->inodes_per_group
+		&& s->max_dnum > 0
+		&& s->gd_blk == 1
+		&& s->j_start_blk == s->gd_blk + gdtBlocks
+		&& s->g_start_blk == (uint64_t)s->j_start_blk + s->j_blocks
+		&& s->nblocks > s->g_start_blk + (uint64_t)(s->ngroups - 1) * s->blocks_per_group
+		&& s->nblocks <= s->g_start_blk + (uint64_t)s->ngroups * s->blocks_per_group;
+}
+
+// Check the group descriptors read from disk against the layout the
+// superblock implies
+static int groups_valid(struct superblock *s, struct group_desc *gd) {
+	uint64_t dataBlocks = 0;
+	uint32_t g;
+
+	for(g = 0; g < s->ngroups; g++){
+		struct group_desc want;
+		groupLayout(s, g, &want);
+		if(gd[g].i_bitmap_blk != want.i_bitmap_blk || gd[g].d_bitmap_blk != want.d_bitmap_blk
+			|| gd[g].i_start_blk != want.i_start_blk || gd[g].d_start_blk != want.d_start_blk
+			|| gd[g].d_blocks != want.d_blocks || gd[g].d_blocks == 0
+			|| gd[g].i_init_blks > s->inodes_per_group / INODES_PER_BLOCK){
+			return 0;
 		}
-		
-		count++;
-		file = strtok(0, delim); 
+		dataBlocks += gd[g].d_blocks;
+	}
+	return dataBlocks == s->max_dnum && gd[0].i_init_blks >= 1;
+}
+
+// Read the group descriptor blocks into gdt
+static void gdt_read() {
+	uint32_t b;
+	for(b = 0; b < gdt_blocks; b++){
+		bio_read(sb->gd_blk + b, (char *)gdt + (size_t)b * BLOCK_SIZE);
 	}
-	return file;
 }
 
 /*  ---------------------------------------------------------------------------
- * Make file system
+ * Mount an existing image. Only the superblock, the group descriptors and the
+ * bitmaps are read; inodes come in through the inode cache the first time they
+ * are used, so the cost doesn't grow with the size of the inode table. Returns
+ * -1, with the disk file closed again, if there is no valid image to mount.
   ---------------------------------------------------------------------------*/
-int tfs_mkfs() {
-	// printf("|-----------------------\n");
-	// printf("|--- Starting tfs_mkfs()\n");
-	// printf("|-----------------------\n");
+int tfs_mount() {
 
-	// Call dev_init() to initialize (Create) Diskfile
-	dev_init(disk_path);
-	
-	int spaceNeededForInodes = (sizeof(struct inode) * MAX_INUM);
-	numBlocksForInodes = spaceNeededForInodes / BLOCK_SIZE;
+	// Step 1: Open the disk file and check the superblock and group descriptors
+	if(access(disk_path, F_OK) == -1 || dev_open(disk_path) < 0){
+		return -1;
+	}
+	sb = calloc(1, BLOCK_SIZE);
+	bio_read(0, sb);
+	if(superblock_valid(sb, dev_blocks())){
+		gdt_blocks = sb->j_start_blk - sb->gd_blk;
+		gdt = calloc(gdt_blocks, BLOCK_SIZE);
+		gdt_read();
+	}
+	if(gdt == NULL || !groups_valid(sb, gdt)){
+		free(gdt);
+		gdt = NULL;
+		free(sb);
+		sb = NULL;
+		dev_close();
+		return -1;
+	}
+
+	icache_init();
+	dcache_init();
+
+	// Step 2: Bring metadata up to date with transactions committed before an
+	// unclean shutdown. A damaged journal is started over empty.
+	if(journal_init(sb->j_start_blk, sb->j_blocks, 0, flush_metadata, release_blkno) < 0){
+		fprintf(stderr, "tfs: journal is damaged, starting it over\n");
+		journal_init(sb->j_start_blk, sb->j_blocks, 1, flush_metadata, release_blkno);
+	} else {
+		int replayed = journal_replay();
+		if(replayed > 0){
+			// the group descriptors may have been among the replayed blocks, so
+			// check them again. The replay left the log empty for whoever
+			// formats the disk next.
+			gdt_read();
+			if(!groups_valid(sb, gdt)){
+				fprintf(stderr, "tfs: group descriptors are damaged after journal replay\n");
+				free(gdt);
+				gdt = NULL;
+				free(sb);
+				sb = NULL;
+				dev_close();
+				return -1;
+			}
+			printf("tfs: replayed %d journal transactions\n", replayed);
+		}
+	}
+
+	// Step 3: Load every group's bitmaps in one read, in the background.
+	// Allocations wait for it, everything else can go ahead.
+	groups_init(1);
+	bitmap_loading = pthread_create(&bitmap_loader, NULL, bitmap_load_thread, NULL) == 0;
+	if(!bitmap_loading){
+		bitmap_load_thread(NULL);
+	}
+
+	return 0;
+}
 
-	// create superblock		
-	sb = malloc(sizeof(struct superblock));
-	sb->magic_num = MAGIC_NUM;
-	sb->max_inum = MAX_INUM;
-	sb->max_dnum = MAX_INUM;
-	sb->i_bitmap_blk = 1;
-	sb->d_bitmap_blk = 2;
-	sb->i_start_blk = 3;
-	sb->d_start_blk = (3 + numBlocksForInodes) + 1; 
 
-	dev_open(disk_path);
+/*  ---------------------------------------------------------------------------
+ * Statistics file
+  --------------------------------------------------------------------------- */
+static int is_stats_path(const char *path) {
+	return strcmp(path, TFS_STATS_PATH) == 0;
+}
 
-	//write super block to disk
-	bio_write(0, sb);
+void tfs_stats_print(FILE *out) {
+	stats_print(out, op_stats, OP_COUNT);
+	bio_stats(out);
+	bio_cache_stats(out);
+	balloc_stats(out, "inode", 0);
+	balloc_stats(out, "data", 1);
+	icache_stats(out);
+	dcache_stats(out);
+	delalloc_stats(out);
+	journal_stats(out);
+}
 
-	// Create inode bitmap			
-	inode_bit_map = malloc(numBlocksForInodes * sizeof(bitmap_t));
+void tfs_stats_reset() {
+	stats_reset(op_stats, OP_COUNT);
+	bio_stats_reset();
+	uint32_t g;
+	for(g = 0; g < sb->ngroups; g++){
+		balloc_stats_reset(&groups[g].inodes);
+		balloc_stats_reset(&groups[g].blocks);
+	}
+	icache_stats_reset();
+	dcache_stats_reset();
+	delalloc_stats_reset();
+	journal_stats_reset();
+}
 
-	// Create data block bitmap	
-	data_bit_map = malloc(MAX_DNUM * sizeof(bitmap_t));						
+static int stats_getattr(struct stat *stbuf) {
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_mode = S_IFREG | 0644;
+	stbuf->st_nlink = 1;
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+	return 0;
+}
 
-	// Setting the 0th index in inode bit map (for root)		
-	set_bitmap(inode_bit_map, 0); 
-	// Setting the 0th index in data bit map (for root)		
-	set_bitmap(data_bit_map, 0); 		
-	
-	// write bitmaps to disk		
-	bio_write(sb->i_bitmap_blk, inode_bit_map);		
-	bio_write(sb->d_bitmap_blk, data_bit_map);
-
-	//create inode for root, write it to the file (first block in inode table)
-	struct inode *root = malloc(sizeof(struct inode));
-	root->ino = 0;
-	root->valid = 1;		
-	root->vstat.st_uid = getuid();
-	root->vstat.st_gid = getgid();
-	root->vstat.st_ino = 0;
-	root->vstat.st_mode = 0755;
-	root->vstat.st_size = -1;
-	root->vstat.st_blksize = BLOCK_SIZE;
-	root->vstat.st_blocks = -1;			
-	
-	// Write inode root to the 0th block in inode region on disk		
-	bio_write(sb->i_start_blk, &root);		
-
-	// Create root dirent	
-	struct dirent *rootDirent = malloc(sizeof(struct dirent));
-	rootDirent->ino = 0;
-	rootDirent->valid = 1;
-	strcpy(rootDirent->name, ".");
-
-	// Write root dirent to the 0th block in data region on disk		
-	bio_write(sb->d_start_blk, &rootDirent);
-										
-	// Fill inode region with available inodes		
-	uint8_t i;
-	for(i = 1; i < numBlocksForInodes; i++){
-		//printf("%d\n",i);			
-		struct inode *newInode = malloc(sizeof(struct inode));
-		newInode->ino = i;
-		newInode->valid = 0;			
-		newInode->vstat.st_ino = i;
-		newInode->vstat.st_mode = 0666;
-		newInode->vstat.st_size = -1;
-		newInode->vstat.st_blksize = BLOCK_SIZE;
-		newInode->vstat.st_blocks = -1;			
-		bio_write(sb->i_start_blk+i, &newInode);			
-	}	
-	
-	//printf("|--- tfs_mkfs() is done.\n\n");
-		
+// Take a snapshot so a reader sees one consistent report across read() calls.
+// The file has no size, so direct_io makes the kernel read until we return 0.
+static int stats_open(struct fuse_file_info *fi) {
+	struct stats_snapshot *snap = calloc(1, sizeof(struct stats_snapshot));
+	FILE *out = open_memstream(&snap->buf, &snap->len);
+	if(out == NULL){
+		free(snap);
+		return -ENOMEM;
+	}
+	tfs_stats_print(out);
+	fclose(out);
+	fi->fh = (uint64_t)(uintptr_t)snap;
+	fi->direct_io = 1;
+	return 0;
+}
+
+static int stats_read(char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+	struct stats_snapshot *snap = (struct stats_snapshot *)(uintptr_t)fi->fh;
+	if(snap == NULL || offset >= (off_t)snap->len){
+		return 0;
+	}
+	if(size > snap->len - offset){
+		size = snap->len - offset;
+	}
+	memcpy(buffer, snap->buf + offset, size);
+	return size;
+}
+
+static int stats_release(struct fuse_file_info *fi) {
+	struct stats_snapshot *snap = (struct stats_snapshot *)(uintptr_t)fi->fh;
+	if(snap != NULL){
+		free(snap->buf);
+		free(snap);
+	}
 	return 0;
 }
 
@@ -551,457 +3321,855 @@ int tfs_mkfs() {
   --------------------------------------------------------------------------- */
 static void *tfs_init(struct fuse_conn_info *conn) {
 
-	// Step 1a: If disk file is not found, call mkfs
-	if( access(disk_path, F_OK ) == -1 ) {
-    	// file doesn't exsist, create file
-		FILE *fp;
-		fp = fopen(disk_path, "w+");
-		fclose (fp);		
-	} 
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
-	//call tfs_mkfs()
-	tfs_mkfs();
+	// Set up the block layer from the mount options before the disk file is opened
+	dev_set_cache_size((size_t)tfs_config.cache_mb * 1024 * 1024);
+	dev_set_backend(tfs_config.backend);
+	delalloc_start(tfs_config.dirty_mb * (1024 * 1024 / BLOCK_SIZE));
 
-  	// Step 1b: If disk file is found, just initialize in-memory data structures
-  	// and read superblock from disk
+	// Step 1a: If the disk file holds a tfs image, just initialize in-memory data
+	// structures from its superblock and bitmaps
+	if(tfs_mount() == 0){
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		printf("tfs: mounted %s (%u blocks, %u inodes) in %.3f ms\n", disk_path, sb->nblocks, sb->max_inum,
+			(end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+		return NULL;
+	}
 
-	// ^^ Handled in tfs_mkfs()
+	// Step 1b: If the disk file is missing or doesn't hold a valid image, call mkfs
+	if(tfs_mkfs((uint64_t)tfs_config.disk_mb * 1024 * 1024, tfs_config.inodes) < 0){
+		exit(EXIT_FAILURE);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("tfs: formatted %s (%u blocks, %u inodes) in %.3f ms\n", disk_path, sb->nblocks, sb->max_inum,
+		(end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
 
 	return NULL;
 }
 
 static void tfs_destroy(void *userdata) {
 
-	// Step 1: De-allocate in-memory data structures
-		//deallocate inode bitmap
-		free(inode_bit_map);
-		//deallocate data bitmap
-		free(data_bit_map);
+	// Step 1: Flush buffered writes, commit and checkpoint the journal, write back
+	// bitmap changes from blocks it released, report statistics and save the trace
+	if(bitmap_loading){
+		pthread_join(bitmap_loader, NULL);
+		bitmap_loading = 0;
+	}
+	delalloc_stop();
+	journal_close();
+	flush_metadata();
+	tfs_stats_print(stdout);
+#if TFS_TRACE
+	trace_dump(TRACE_FILE);
+#endif
+
+	// Step 2: De-allocate in-memory data structures
+		//deallocate the bitmaps and descriptors of every group
+		uint32_t g;
+		for(g = 0; g < sb->ngroups; g++){
+			balloc_destroy(&groups[g].inodes);
+			balloc_destroy(&groups[g].blocks);
+		}
+		free(groups);
+		groups = NULL;
+		free(gdt);
+		gdt = NULL;
 		//deallocate superblock
 		free(sb);
 
-	// Step 2: Close diskfile
+	// Step 3: Close diskfile, writing back the block cache
 	dev_close();
 
 }
 
-static int tfs_getattr(const char *path, struct stat *stbuf) {
+static int tfs_do_getattr(const char *path, struct stat *stbuf) {
 
 	// Step 1: call get_node_by_path() to get inode from path
-	struct inode *inode = malloc(sizeof(struct inode));
-	get_node_by_path(path, 0, inode);
+	struct inode inode;
+	if(get_node_by_path(path, 0, &inode) < 0){
+		return -ENOENT;
+	}
 
 	// Step 2: fill attribute of file into stbuf from inode		
-
-		/*stbuf->st_mode   = S_IFDIR | 0755;
-		stbuf->st_nlink  = 2;
-		time(&stbuf->st_mtime);*/
-
-		stbuf = &inode->vstat;
-
-		if ( strcmp( path, "/" ) == 0 ){
-			stbuf->st_mode = S_IFDIR | 0755;
-			stbuf->st_nlink = 2;
-		} else {
-			stbuf->st_mode = S_IFREG | 0644;
-			stbuf->st_nlink = 1;
-			stbuf->st_size = 1024;
-		}
+	memcpy(stbuf, &inode.vstat, sizeof(struct stat));
+	stbuf->st_size = inode.size;
+	delalloc_getattr(inode.ino, stbuf);
 
 	return 0;
 }
 
-static int tfs_opendir(const char *path, struct fuse_file_info *fi) {
+
+static int tfs_do_opendir(const char *path, struct fuse_file_info *fi) {
 
 	// Step 1: Call get_node_by_path() to get inode from path
-	struct inode *pathNode = malloc(sizeof(struct inode));
-	get_node_by_path(path, 0, pathNode);
+	struct inode pathNode;
 
 	// Step 2: If not find, return -1
-	if(pathNode == NULL){
-		return -1;
+	if(get_node_by_path(path, 0, &pathNode) < 0){
+		return -ENOENT;
+	}
+	if(pathNode.type != TFS_DIR){
+		return -ENOTDIR;
 	}
 
-    return 0;
+	// Step 3: Set up the per-open state releasedir() frees
+	fi->fh = (uint64_t)(uintptr_t)openFile(pathNode.ino);
+	return 0;
 }
 
-static int tfs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-
-	// Step 1: Call get_node_by_path() to get inode from path
-	struct inode *inode = malloc(sizeof(struct inode));
-	get_node_by_path(path, 0, inode);
-
-	// Step 2: Read directory entries from its data blocks, and copy them to filler
-	int i;
-	for(i = 0; i < 16; i++){
 
-		//insert this into filler: inode->direct_ptr[i];	
+static int tfs_do_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
 
-		/*
-
-
-			TODO: Unsure how to insert into filler
+	// Step 1: Get the inode from the handle opendir() set up, locked shared so
+	// entries aren't moved around while they are listed
+	struct inode inode;
+	struct inode *locked = get_locked_node_by_handle(path, fi, 0, &inode);
+	if(locked == NULL){
+		return -ENOENT;
+	}
+	if(inode.type != TFS_DIR){
+		iunlock(locked);
+		return -ENOTDIR;
+	}
 
-			
-		*/
+	// Step 2: Read directory entries from its data blocks, and copy them to filler
+	filler(buffer, ".", NULL, 0);
+	filler(buffer, "..", NULL, 0);
+
+	struct arena_pos scratch = arena_mark();
+	char *block = arena_alloc(BLOCK_SIZE);
+	char name[DIRENT_NAME_LEN];
+	int numChunks = dirChunks(&inode);
+	int lblk;
+	for(lblk = 0; lblk < numChunks; lblk++){
+		int chunkLen = dirReadChunk(&inode, lblk, block);
+
+		int recordOffset;
+		for(recordOffset = 0; recordOffset < chunkLen; recordOffset += ((struct dir_record *)(block + recordOffset))->rec_len){
+			struct dir_record *record = (struct dir_record *)(block + recordOffset);
+			if(record->rec_len == 0){
+				break;
+			}
+			if(record->valid){
+				memcpy(name, record->name, record->name_len);
+				name[record->name_len] = '\0';
+				filler(buffer, name, NULL, 0);
+			}
+		}
 	}
+	arena_release(scratch);
+	iunlock(locked);
 
 	return 0;
 }
 
 
-static int tfs_mkdir(const char *path, mode_t mode) {
-
-	// Step 1: Separate parent directory path and target directory name		
-	char *targetDirectory = "";
-	char targetDirectoryPath[100];		
-
-	//get target directory		
-	char *tkn;
-	char dirpath[100]; 	
-	char tmp[100];
+static int tfs_do_mkdir(const char *path, mode_t mode) {
 
-	const char delimiter[4] = "/";
-
-	strcpy(dirpath, path);
-
-	tkn = strtok(dirpath, delimiter); 	
-	
-	while (tkn != 0) {         
-		strcpy(tmp, tkn);
-		tkn = strtok(0, delimiter);
-	} 
-	strcpy(targetDirectory, tmp);
+	// Step 1: Separate parent directory path and target directory name, in place
+	struct path_split split;
+	if(path_split(path, DIRENT_NAME_LEN, &split) < 0){
+		return -ENAMETOOLONG;
+	}
 
-	//get target directory path
-	char *token;
-	char filepath[100]; 					
-	const char delim[4] = "/";
+	// Step 2: Call get_node_by_path() to get inode of parent directory, locked
+	// exclusively while its entries change
+	struct inode parentDirectoryInode;
+	struct inode *parentLock = get_locked_node_by_path(path, split.parent_len, 1, &parentDirectoryInode);
+	if(parentLock == NULL){
+		return -ENOENT;
+	}
+	if(parentDirectoryInode.type != TFS_DIR){
+		iunlock(parentLock);
+		return -ENOTDIR;
+	}
 
-	strcpy(filepath, path);
+	// Step 3: Call get_avail_ino() to get an available inode number, in a group of its own
+	int nextAvailableInode = get_avail_ino(parentDirectoryInode.ino, TFS_DIR);
+	if(nextAvailableInode < 0){
+		iunlock(parentLock);
+		return -ENOSPC;
+	}
 
-	token = strtok(filepath, delim); 	
-	
-	while (token != 0) {         
+	// Step 4: Set up the inode for target directory and call writei() to write it,
+	// before the new entry makes it reachable
+	struct inode targetDirectoryInode;
+	initInode(&targetDirectoryInode, nextAvailableInode, TFS_DIR, mode);
+	writei(nextAvailableInode, &targetDirectoryInode);
+
+	// Step 5: Call dir_add() to add directory entry of target directory to parent directory
+	int ret = dir_add(parentDirectoryInode, nextAvailableInode, split.name, split.name_len);
+	if(ret < 0){
+		targetDirectoryInode.valid = 0;
+		writei(nextAvailableInode, &targetDirectoryInode);
+		put_avail_ino(nextAvailableInode);
+	} else {
+		dcache_insert(parentDirectoryInode.ino, split.name, split.name_len, nextAvailableInode);
+	}
 
-		token = strtok(0, delim);		
+	iunlock(parentLock);
+	return ret;
+}
 
-		if(strcmp(token, targetDirectory) == 0){
-			break;
-		}
 
-		strcat(targetDirectoryPath, token);
-		strcat(targetDirectoryPath, "/");			
-	} 
+static int tfs_do_rmdir(const char *path) {
 
-	// Step 2: Call get_node_by_path() to get inode of parent directory
-	struct inode *parentDirectoryInode = malloc(sizeof(struct inode));
-	
-	get_node_by_path(targetDirectoryPath, 0, parentDirectoryInode);
+	// Step 1: Separate parent directory path and target directory name, in place
+	struct path_split split;
+	if(path_split(path, DIRENT_NAME_LEN, &split) < 0){
+		return -ENAMETOOLONG;
+	}
 
-	// Step 3: Call get_avail_ino() to get an available inode number
-	int nextAvailableInode = get_avail_ino();
-	struct inode *tempInode = malloc(sizeof(struct inode));
-	readi(nextAvailableInode, tempInode);
+	// Step 2: Call get_node_by_path() to get inode of parent directory and lock it,
+	// then look the target directory up in it and lock that too
+	struct inode parentDirectoryInode;
+	struct inode *parentLock = get_locked_node_by_path(path, split.parent_len, 1, &parentDirectoryInode);
+	if(parentLock == NULL){
+		return -ENOENT;
+	}
+	struct dirent entry;
+	if(dir_find(parentDirectoryInode.ino, split.name, split.name_len, &entry) < 0){
+		iunlock(parentLock);
+		return -ENOENT;
+	}
+	struct inode targetDirectoryInode;
+	struct inode *targetLock = ilock(entry.ino, 1);
+	if(targetLock == NULL){
+		iunlock(parentLock);
+		return -ENOENT;
+	}
+	readi(entry.ino, &targetDirectoryInode);
+
+	int ret = 0;
+	if(targetDirectoryInode.type != TFS_DIR){
+		ret = -ENOTDIR;
+	} else if(targetDirectoryInode.ino == 0){
+		ret = -EBUSY;
+	} else if(!dir_is_empty(&targetDirectoryInode)){
+		ret = -ENOTEMPTY;
+	} else if(dir_remove(parentDirectoryInode, split.name, split.name_len) < 0){
+		// Step 3: Call dir_remove() to remove directory entry of target directory in its parent directory
+		ret = -ENOENT;
+	} else {
+		dcache_insert(parentDirectoryInode.ino, split.name, split.name_len, DCACHE_NEGATIVE);
+		dcache_purge_dir(targetDirectoryInode.ino);
 
-	// Step 4: Call dir_add() to add directory entry of target directory to parent directory, 
-	// update inode for target directory
-	dir_add(*parentDirectoryInode, tempInode->ino, targetDirectory, 20);	
+		// Step 4: Clear data block bitmap of target directory
+		freeInodeBlocks(&targetDirectoryInode);
 
-	// Step 5: Call writei() to write inode to disk
-	writei(parentDirectoryInode->ino, parentDirectoryInode);
+		// Step 5: Clear inode bitmap and invalidate the inode
+		targetDirectoryInode.valid = 0;
+		writei(targetDirectoryInode.ino, &targetDirectoryInode);
+		put_avail_ino(targetDirectoryInode.ino);
+	}
 
-	return 0;
+	iunlock(targetLock);
+	iunlock(parentLock);
+	return ret;
 }
 
-static int tfs_rmdir(const char *path) {
-
-	// 1.) Separate parent directory path and target directory name
-	char *targetDirectoryName = "";
-	char targetDirectoryPath[100];		
-
-	//get target directory		
-	char *tkn;
-	char dirpath[100]; 	
-	char tmp[100];
 
-	const char delimiter[4] = "/";
-
-	strcpy(dirpath, path);
-
-	tkn = strtok(dirpath, delimiter); 	
-	
-	while (tkn != 0) {         
-		strcpy(tmp, tkn);
-		tkn = strtok(0, delimiter);
-	} 
-	strcpy(targetDirectoryName, tmp);
-
-	//get target directory path
-	char *token;
-	char filepath[100]; 					
-	const char delim[4] = "/";
+static int tfs_do_releasedir(const char *path, struct fuse_file_info *fi) {
+	struct tfs_file *file = (struct tfs_file *)(uintptr_t)fi->fh;
+	if(file != NULL){
+		closeFile(file);
+		fi->fh = 0;
+	}
+    return 0;
+}
 
-	strcpy(filepath, path);
+static int tfs_do_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
 
-	token = strtok(filepath, delim); 	
+	// Step 1: Separate parent directory path and target file name, in place
+	struct path_split split;
+	if(path_split(path, DIRENT_NAME_LEN, &split) < 0){
+		return -ENAMETOOLONG;
+	}
 	
-	while (token != 0) {         
-
-		token = strtok(0, delim);		
+	// Step 2: Call get_node_by_path() to get inode of parent directory, locked
+	// exclusively while its entries change
+	struct inode parentDirectory;
+	struct inode *parentLock = get_locked_node_by_path(path, split.parent_len, 1, &parentDirectory);
+	if(parentLock == NULL){
+		return -ENOENT;
+	}
+	if(parentDirectory.type != TFS_DIR){
+		iunlock(parentLock);
+		return -ENOTDIR;
+	}
 
-		if(strcmp(token, targetDirectoryName) == 0){
-			break;
-		}
+	// Step 3: Call get_avail_ino() to get an available inode number, near the parent
+	int nextAvailableInode = get_avail_ino(parentDirectory.ino, TFS_FILE);
+	if(nextAvailableInode < 0){
+		iunlock(parentLock);
+		return -ENOSPC;
+	}
 
-		strcat(targetDirectoryPath, token);
-		strcat(targetDirectoryPath, "/");			
-	} 
+	// Step 4: Set up the inode for target file and call writei() to write it,
+	// before the new entry makes it reachable
+	struct inode targetFileInode;
+	initInode(&targetFileInode, nextAvailableInode, TFS_FILE, mode);
+	writei(nextAvailableInode, &targetFileInode);
+
+	// Step 5: Call dir_add() to add directory entry of target file to parent directory
+	int ret = dir_add(parentDirectory, nextAvailableInode, split.name, split.name_len);
+	if(ret < 0){
+		targetFileInode.valid = 0;
+		writei(nextAvailableInode, &targetFileInode);
+		put_avail_ino(nextAvailableInode);
+	} else {
+		dcache_insert(parentDirectory.ino, split.name, split.name_len, nextAvailableInode);
+		fi->fh = (uint64_t)(uintptr_t)openFile(nextAvailableInode);
+	}
 
-	// Step 2: Call get_node_by_path() to get inode of target directory
-	struct inode *targetDirectoryInode = malloc(sizeof(struct inode));
-	get_node_by_path(path, 0, targetDirectoryInode);
+	iunlock(parentLock);
+	return ret;
+}
 
-	// Step 3: Clear data block bitmap of target directory	
-	unset_bitmap(data_bit_map, targetDirectoryInode->ino);
 
-	// Step 4: Clear inode bitmap and its data block
-	//NOTE: Inode num corresponds to it's index in the data block
-	unset_bitmap(inode_bit_map, targetDirectoryInode->ino);
+static int tfs_do_open(const char *path, struct fuse_file_info *fi) {
 
-	// Step 5: Call get_node_by_path() to get inode of parent directory
-	struct inode *parentDirectoryInode = malloc(sizeof(struct inode));
-	get_node_by_path(targetDirectoryPath, 0, parentDirectoryInode);
-	
-	// Step 6: Call dir_remove() to remove directory entry of target directory in its parent directory
-	dir_remove(*parentDirectoryInode, targetDirectoryName, 20);
+	// Step 1: Call get_node_by_path() to get inode from path
+	struct inode pathNode;
 
-	///rewrite bit maps to disk
-	bio_write(sb->i_bitmap_blk, inode_bit_map);
-	bio_write(sb->d_bitmap_blk, data_bit_map);
+	// Step 2: If not find, return -1
+	if(get_node_by_path(path, 0, &pathNode) < 0){
+		return -ENOENT;
+	}
 
+	// Step 3: Set up the per-open state release() frees. Reads and writes on it
+	// find the inode by number, so this is the only path walk they cost.
+	fi->fh = (uint64_t)(uintptr_t)openFile(pathNode.ino);
 	return 0;
 }
 
-static int tfs_releasedir(const char *path, struct fuse_file_info *fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
-}
 
-static int tfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+static int tfs_do_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+
+	// Step 1: Get the inode from the handle open() set up, without walking the
+	// path. Readers share the inode lock, writers and truncate take it exclusively.
+	struct inode inode;
+	struct inode *locked = get_locked_node_by_handle(path, fi, 0, &inode);
+	if(locked == NULL){
+		return -ENOENT;
+	}
+	if(inode.type == TFS_DIR){
+		iunlock(locked);
+		return -EISDIR;
+	}
 
-	// Step 1: Separate parent directory path and target file name
-		char *targetFileName = "";
-		char parentDirectoryPath[100];		
+	// Step 2: Clamp the request to the file size, buffered writes included
+	uint32_t fileSize = delalloc_size(&inode);
+	if(offset >= fileSize){
+		iunlock(locked);
+		return 0;
+	}
+	if(offset + size > fileSize){
+		size = fileSize - offset;
+	}
 
-		//get target file		
-		char *tkn;
-		char dirpath[100]; 	
-		char tmp[100];
+	// An inline file is already here, in the inode
+	if(inode.flags & INODE_INLINE){
+		memcpy(buffer, inode.inline_data + offset, size);
+		iunlock(locked);
+		return size;
+	}
 
-		const char delimiter[4] = "/";
+	// Step 3: Start reading ahead if this open file is being read sequentially
+	struct tfs_file *file = fi != NULL ? (struct tfs_file *)(uintptr_t)fi->fh : NULL;
+	uint32_t firstBlk = offset / BLOCK_SIZE;
+	uint32_t lastBlk = (offset + size - 1) / BLOCK_SIZE;
+	if(file != NULL){
+		readaheadInode(file, locked, &inode, firstBlk, lastBlk);
+	}
 
-		strcpy(dirpath, path);
-	
-		tkn = strtok(dirpath, delimiter); 	
-		
-		while (tkn != 0) {         
-			strcpy(tmp, tkn);
-			tkn = strtok(0, delimiter);
-		} 
-		strcpy(targetFileName, tmp);
-
-		//get target directory path
-		char *token;
-		char filepath[100]; 					
-		const char delim[4] = "/";
-
-		strcpy(filepath, path);
-	
-		token = strtok(filepath, delim); 	
-		
-		while (token != 0) {         
+	// Step 4: Based on size and offset, map its data blocks one extent at a time,
+	// through the handle's cached extent when there is one. Whole blocks are read
+	// straight into buffer, partial first/last blocks through bounce buffers;
+	// holes read as zeros.
+	uint32_t numBlocks = lastBlk - firstBlk + 1;
+	struct arena_pos scratch = arena_mark();
+	int *blockNums = arena_alloc(numBlocks * sizeof(int));
+	void **bufs = arena_alloc(numBlocks * sizeof(void *));
+	char *head = arena_alloc(BLOCK_SIZE);
+	char *tail = arena_alloc(BLOCK_SIZE);
+	int count = 0;
+
+	uint32_t lblk = firstBlk;
+	while(lblk <= lastBlk){
+		uint32_t runLen;
+		uint32_t pblk = file != NULL ? fileBmap(file, locked, &inode, lblk, lastBlk - lblk + 1, &runLen)
+			: bmap_run(&inode, lblk, lastBlk - lblk + 1, 0, &runLen);
+
+		// With the disk file mapped, copy the whole run straight from the mapping
+		char *mapped = pblk ? bio_map(pblk) : NULL;
+		if(mapped != NULL && bio_map(pblk + runLen - 1) != NULL){
+			off_t start = (off_t)lblk * BLOCK_SIZE > offset ? (off_t)lblk * BLOCK_SIZE : offset;
+			off_t end = (off_t)(lblk + runLen) * BLOCK_SIZE < offset + (off_t)size ? (off_t)(lblk + runLen) * BLOCK_SIZE : offset + (off_t)size;
+			if(runLen > 1){
+				bio_advise(pblk, runLen, BIO_ADVICE_WILLNEED);
+			}
+			memcpy(buffer + (start - offset), mapped + (start - (off_t)lblk * BLOCK_SIZE), end - start);
+			lblk += runLen;
+			continue;
+		}
 
-			token = strtok(0, delim);		
+		uint32_t j;
+		for(j = 0; j < runLen; j++, lblk++){
+			off_t start = (off_t)lblk * BLOCK_SIZE > offset ? (off_t)lblk * BLOCK_SIZE : offset;
+			off_t end = (off_t)(lblk + 1) * BLOCK_SIZE < offset + (off_t)size ? (off_t)(lblk + 1) * BLOCK_SIZE : offset + (off_t)size;
+			char *dest = buffer + (start - offset);
 
-			if(strcmp(token, targetFileName) == 0){
-				break;
+			if(pblk == 0){
+				memset(dest, 0, end - start);
+				continue;
 			}
+			blockNums[count] = pblk + j;
+			if(end - start < BLOCK_SIZE){
+				bufs[count] = (lblk == firstBlk) ? head : tail;
+			} else {
+				bufs[count] = dest;
+			}
+			count++;
+		}
+	}
 
-			strcat(parentDirectoryPath, token);
-			strcat(parentDirectoryPath, "/");			
-		} 
-	
-	// Step 2: Call get_node_by_path() to get inode of parent directory
-	struct inode *parentDirectory = malloc(sizeof(struct inode));
-	get_node_by_path(path, 0, parentDirectory);
+	// Step 5: Read the remaining blocks, adjacent ones in a single request
+	bio_readv(blockNums, bufs, count);
+
+	// Step 6: copy the correct amount of data from the partial blocks to buffer
+	int i;
+	for(i = 0; i < count; i++){
+		if(bufs[i] != head && bufs[i] != tail){
+			continue;
+		}
+		uint32_t partialBlk = (bufs[i] == head) ? firstBlk : lastBlk;
+		off_t start = (off_t)partialBlk * BLOCK_SIZE > offset ? (off_t)partialBlk * BLOCK_SIZE : offset;
+		off_t end = (off_t)(partialBlk + 1) * BLOCK_SIZE < offset + (off_t)size ? (off_t)(partialBlk + 1) * BLOCK_SIZE : offset + (off_t)size;
+		memcpy(buffer + (start - offset), (char *)bufs[i] + (start - (off_t)partialBlk * BLOCK_SIZE), end - start);
+	}
 
-	// Step 3: Call get_avail_ino() to get an available inode number
-	int nextAvailableInode = get_avail_ino();
+	// Step 7: Writes not flushed yet are newer than the disk
+	delalloc_read(&inode, buffer, size, offset);
 
-	// Step 4: Call dir_add() to add directory entry of target file to parent directory
-	dir_add(*parentDirectory, nextAvailableInode, targetFileName, 20);
-	
+	arena_release(scratch);
+	iunlock(locked);
 
-	return 0;
+	// Note: this function should return the amount of bytes you copied to buffer
+	return size;
 }
 
-static int tfs_open(const char *path, struct fuse_file_info *fi) {
 
-	// Step 1: Call get_node_by_path() to get inode from path
-	struct inode *pathNode = malloc(sizeof(struct inode));
-	get_node_by_path(path, 0, pathNode);
+static int tfs_do_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+	if(offset + size > UINT32_MAX){
+		return -EFBIG;
+	}
 
-	// Step 2: If not find, return -1
-	if(pathNode == NULL){
-		return -1;
+	// Step 1: Get the inode from the handle open() set up, locked exclusively
+	// until the new data and size are buffered
+	struct inode inode;
+	struct inode *locked = get_locked_node_by_handle(path, fi, 1, &inode);
+	if(locked == NULL){
+		return -ENOENT;
+	}
+	if(inode.type == TFS_DIR){
+		iunlock(locked);
+		return -EISDIR;
+	}
+	if(size == 0){
+		iunlock(locked);
+		return 0;
+	}
+
+	// Small files are written into the inode while they fit, and move to a
+	// data block once they don't. Bytes past size stay zero, so gaps read as zeros.
+	if(inode.flags & INODE_INLINE){
+		if(offset + size <= INODE_INLINE_MAX){
+			memcpy(inode.inline_data + offset, buffer, size);
+			if(offset + size > inode.size){
+				inode.size = offset + size;
+				inode.vstat.st_size = inode.size;
+			}
+			time(&inode.vstat.st_mtime);
+			writei(inode.ino, &inode);
+			iunlock(locked);
+			return size;
+		}
+		if(uninlineFile(&inode) < 0){
+			iunlock(locked);
+			return -ENOSPC;
+		}
+		writei(inode.ino, &inode);
 	}
 
+	// Step 2: Buffer the data in the file's dirty pages; its blocks are allocated
+	// and written when the file is flushed
+	int ret = delalloc_write(&inode, buffer, size, offset);
+	iunlock(locked);
 
-	return 0;
+	// Note: this function should return the amount of bytes you write to disk
+	return ret;
 }
 
-static int tfs_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
 
-	// Step 1: You could call get_node_by_path() to get inode from path
-	struct inode *inode = malloc(sizeof(struct inode));
-	get_node_by_path(path, 0, inode);
+static int tfs_do_unlink(const char *path) {
 
-	// Step 2: Based on size and offset, read its data blocks from disk
-	int i;	
-	for(i = offset; i < size; i++){
-		// Step 3: copy the correct amount of data from offset to buffer
-		//memcpy(buffer[i], (int)offset, sizeof(offset);
-		/*
+	// Step 1: Separate parent directory path and target file name, in place
+	struct path_split split;
+	if(path_split(path, DIRENT_NAME_LEN, &split) < 0){
+		return -ENAMETOOLONG;
+	}
 
+	// Step 2: Call get_node_by_path() to get inode of parent directory and lock it,
+	// then look the target file up in it and lock that too
+	struct inode parentDirectory;
+	struct inode *parentLock = get_locked_node_by_path(path, split.parent_len, 1, &parentDirectory);
+	if(parentLock == NULL){
+		return -ENOENT;
+	}
+	struct dirent entry;
+	if(dir_find(parentDirectory.ino, split.name, split.name_len, &entry) < 0){
+		iunlock(parentLock);
+		return -ENOENT;
+	}
+	struct inode targetFile;
+	struct inode *targetLock = ilock(entry.ino, 1);
+	if(targetLock == NULL){
+		iunlock(parentLock);
+		return -ENOENT;
+	}
+	readi(entry.ino, &targetFile);
+
+	int ret = 0;
+	if(targetFile.type == TFS_DIR){
+		ret = -EISDIR;
+	} else if(dir_remove(parentDirectory, split.name, split.name_len) < 0){
+		// Step 3: Call dir_remove() to remove directory entry of target file in its parent directory
+		ret = -ENOENT;
+	} else {
+		dcache_insert(parentDirectory.ino, split.name, split.name_len, DCACHE_NEGATIVE);
+		dcache_purge_dir(targetFile.ino);
 
-			TODO: Unsure how to implement
+		// Step 4: Clear data block bitmap of target file, and drop writes still buffered
+		delalloc_discard(targetFile.ino);
+		freeInodeBlocks(&targetFile);
 
-			
-		*/
-		
+		// Step 5: Clear inode bitmap and invalidate the inode
+		targetFile.valid = 0;
+		writei(targetFile.ino, &targetFile);
+		put_avail_ino(targetFile.ino);
 	}
-	
 
-	// Note: this function should return the amount of bytes you copied to buffer
-	return 0;
+	iunlock(targetLock);
+	iunlock(parentLock);
+	return ret;
 }
 
-static int tfs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
-	// Step 1: You could call get_node_by_path() to get inode from path
-	struct inode *inode = malloc(sizeof(struct inode));
-	get_node_by_path(path, 0, inode);
 
-	// Step 2: Based on size and offset, read its data blocks from disk
-	int i;	
-	for(i = offset; i < size; i++){
-		// Step 3: copy the correct amount of data from offset to buffer
-		//memcpy(buffer[i], (int)offset, sizeof(offset);
-		/*
+static int tfs_do_truncate(const char *path, off_t size) {
 
+	if(size > UINT32_MAX){
+		return -EFBIG;
+	}
 
-			TODO: Unsure how to implement
+	// Step 1: Call get_node_by_path() to get inode from path, locked exclusively
+	struct inode inode;
+	struct inode *locked = get_locked_node_by_path(path, PATH_WHOLE, 1, &inode);
+	if(locked == NULL){
+		return -ENOENT;
+	}
+	if(inode.type == TFS_DIR){
+		iunlock(locked);
+		return -EISDIR;
+	}
 
-			
-		*/
+	// Buffered writes past the new end are dropped, the rest get their blocks first
+	delalloc_trim(inode.ino, size);
+	if(delalloc_flush(&inode) < 0){
+		iunlock(locked);
+		return -ENOSPC;
+	}
 
-		
+	// Step 2: Release the blocks past the new end, and zero the tail of the last
+	// block so growing the file again reads zeros. An inline file only needs its
+	// tail zeroed, unless it grows past the inline area.
+	if((inode.flags & INODE_INLINE) && size > INODE_INLINE_MAX && uninlineFile(&inode) < 0){
+		iunlock(locked);
+		return -ENOSPC;
+	}
+	if(inode.flags & INODE_INLINE){
+		if(size < inode.size){
+			memset(inode.inline_data + size, 0, inode.size - size);
+		}
+	} else if(size < inode.size){
+		truncateInodeBlocks(&inode, (size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+		if(size % BLOCK_SIZE){
+			uint32_t len;
+			uint32_t pblk = bmap_run(&inode, size / BLOCK_SIZE, 1, 0, &len);
+			if(pblk != 0){
+				struct arena_pos scratch = arena_mark();
+				char *block = arena_alloc(BLOCK_SIZE);
+				bio_read(pblk, block);
+				memset(block + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+				bio_write(pblk, block);
+				arena_release(scratch);
+			}
+		}
 	}
-	// Step 3: Write the correct amount of data from offset to disk
-	
-	// Step 4: Update the inode info and write it to disk
 
-	// Note: this function should return the amount of bytes you write to disk
-	return size;
+	// Step 3: Update the inode info and write it to disk
+	inode.size = size;
+	inode.vstat.st_size = size;
+	time(&inode.vstat.st_mtime);
+	writei(inode.ino, &inode);
+	iunlock(locked);
+
+    return 0;
 }
 
-static int tfs_unlink(const char *path) {
 
-	// Step 1: Separate parent directory path and target file name
-	char *targetDirectory = "";
-	char targetDirectoryPath[100];		
+static int tfs_do_release(const char *path, struct fuse_file_info *fi) {
+	// Metadata reaches the disk through the journal: when a transaction is due,
+	// on fsync and at unmount
+	struct tfs_file *file = (struct tfs_file *)(uintptr_t)fi->fh;
+	int ret = 0;
+	if(file != NULL){
+		ret = delalloc_flush_ino(file->ino);
+		closeFile(file);
+		fi->fh = 0;
+	}
+	return ret;
+}
 
-	//get target directory		
-	char *tkn;
-	char dirpath[100]; 	
-	char tmp[100];
+static int tfs_do_flush(const char * path, struct fuse_file_info * fi) {
+	// Buffered writes get their blocks when the file is closed, see tfs_release()
+	struct tfs_file *file = (struct tfs_file *)(uintptr_t)fi->fh;
+	if(file == NULL){
+		return 0;
+	}
+	return delalloc_flush_ino(file->ino);
+}
 
-	const char delimiter[4] = "/";
+static int tfs_do_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	// Give the file's buffered writes their blocks, commit the metadata (shared
+	// with concurrent callers), then flush the block cache
+	struct tfs_file *file = fi != NULL ? (struct tfs_file *)(uintptr_t)fi->fh : NULL;
+	struct inode inode;
+	if(file != NULL){
+		inode.ino = file->ino;
+	} else if(get_node_by_path(path, 0, &inode) < 0){
+		return -ENOENT;
+	}
+	int ret = delalloc_flush_ino(inode.ino);
+	if(ret < 0){
+		return ret;
+	}
+	if(journal_commit() < 0){
+		return -EIO;
+	}
+	return bio_sync() < 0 ? -EIO : 0;
+}
 
-	strcpy(dirpath, path);
+static int tfs_do_statfs(const char *path, struct statvfs *stbuf) {
+	// Report capacity and free counts kept by the allocators
+	memset(stbuf, 0, sizeof(struct statvfs));
+	stbuf->f_bsize = BLOCK_SIZE;
+	stbuf->f_frsize = BLOCK_SIZE;
+	stbuf->f_blocks = sb->max_dnum;
+	uint32_t nfree = groups_nfree(1);
+	uint32_t reserved = delalloc_reserved();
+	stbuf->f_bfree = nfree > reserved ? nfree - reserved : 0;
+	stbuf->f_bavail = stbuf->f_bfree;
+	stbuf->f_files = sb->max_inum;
+	stbuf->f_ffree = groups_nfree(0);
+	stbuf->f_favail = stbuf->f_ffree;
+	stbuf->f_namemax = DIRENT_NAME_LEN - 1;
+	return 0;
+}
 
-	tkn = strtok(dirpath, delimiter); 	
-	
-	while (tkn != 0) {         
-		strcpy(tmp, tkn);
-		tkn = strtok(0, delimiter);
-	} 
-	strcpy(targetDirectory, tmp);
+static int tfs_do_utimens(const char *path, const struct timespec tv[2]) {
+	// For this project, you don't need to fill this function
+	// But DO NOT DELETE IT!
+    return 0;
+}
 
-	//get target directory path
-	char *token;
-	char filepath[100]; 					
-	const char delim[4] = "/";
 
-	strcpy(filepath, path);
+/*  ---------------------------------------------------------------------------
+ * FUSE entry points. Each one times its handler into op_stats and sends the
+ * statistics file to the stats_* handlers. Operations that change metadata
+ * also run inside a journal handle, so all of their block updates commit in
+ * the same transaction. Scratch memory the handler took from the thread's
+ * arena is given back in one step when it returns.
+  --------------------------------------------------------------------------- */
+static int tfs_getattr(const char *path, struct stat *stbuf) {
+	uint64_t start = stats_now();
+	int ret = is_stats_path(path) ? stats_getattr(stbuf) : tfs_do_getattr(path, stbuf);
+	arena_reset();
+	stats_record(&op_stats[OP_GETATTR], start, ret);
+	return ret;
+}
 
-	token = strtok(filepath, delim); 	
-	
-	while (token != 0) {         
+static int tfs_opendir(const char *path, struct fuse_file_info *fi) {
+	uint64_t start = stats_now();
+	int ret = is_stats_path(path) ? -ENOTDIR : tfs_do_opendir(path, fi);
+	arena_reset();
+	stats_record(&op_stats[OP_OPENDIR], start, ret);
+	return ret;
+}
 
-		token = strtok(0, delim);		
+static int tfs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+	uint64_t start = stats_now();
+	int ret = is_stats_path(path) ? -ENOTDIR : tfs_do_readdir(path, buffer, filler, offset, fi);
+	arena_reset();
+	stats_record(&op_stats[OP_READDIR], start, ret);
+	return ret;
+}
 
-		if(strcmp(token, targetDirectory) == 0){
-			break;
-		}
+static int tfs_releasedir(const char *path, struct fuse_file_info *fi) {
+	uint64_t start = stats_now();
+	int ret = tfs_do_releasedir(path, fi);
+	arena_reset();
+	stats_record(&op_stats[OP_RELEASEDIR], start, ret);
+	return ret;
+}
 
-		strcat(targetDirectoryPath, token);
-		strcat(targetDirectoryPath, "/");			
-	} 
+static int tfs_mkdir(const char *path, mode_t mode) {
+	if(is_stats_path(path)){
+		return -EEXIST;
+	}
+	uint64_t start = stats_now();
+	journal_start();
+	int ret = tfs_do_mkdir(path, mode);
+	journal_stop();
+	arena_reset();
+	stats_record(&op_stats[OP_MKDIR], start, ret);
+	return ret;
+}
 
-	// Step 2: Call get_node_by_path() to get inode of target file
-	struct inode *targetFile = malloc(sizeof(struct inode));
-	get_node_by_path(path, 0, targetFile);
+static int tfs_rmdir(const char *path) {
+	if(is_stats_path(path)){
+		return -ENOTDIR;
+	}
+	uint64_t start = stats_now();
+	journal_start();
+	int ret = tfs_do_rmdir(path);
+	journal_stop();
+	arena_reset();
+	stats_record(&op_stats[OP_RMDIR], start, ret);
+	return ret;
+}
 
-	// Step 3: Clear data block bitmap of target file
-	unset_bitmap(data_bit_map, targetFile->ino);
+static int tfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+	if(is_stats_path(path)){
+		return -EEXIST;
+	}
+	uint64_t start = stats_now();
+	journal_start();
+	int ret = tfs_do_create(path, mode, fi);
+	journal_stop();
+	arena_reset();
+	stats_record(&op_stats[OP_CREATE], start, ret);
+	return ret;
+}
 
-	// Step 4: Clear inode bitmap and its data block
-	unset_bitmap(inode_bit_map, targetFile->ino);
+static int tfs_open(const char *path, struct fuse_file_info *fi) {
+	uint64_t start = stats_now();
+	int ret = is_stats_path(path) ? stats_open(fi) : tfs_do_open(path, fi);
+	arena_reset();
+	stats_record(&op_stats[OP_OPEN], start, ret);
+	return ret;
+}
 
-	// Step 5: Call get_node_by_path() to get inode of parent directory
-	struct inode *parentDirectory = malloc(sizeof(struct inode));
-	get_node_by_path(targetDirectoryPath, 0, parentDirectory);
+static int tfs_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+	uint64_t start = stats_now();
+	int ret = is_stats_path(path) ? stats_read(buffer, size, offset, fi) : tfs_do_read(path, buffer, size, offset, fi);
+	arena_reset();
+	stats_record(&op_stats[OP_READ], start, ret);
+	return ret;
+}
 
-	// Step 6: Call dir_remove() to remove directory entry of target file in its parent directory
-	dir_remove(*parentDirectory, targetDirectory, 0);
+// Any write to the statistics file resets the counters
+static int tfs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+	if(is_stats_path(path)){
+		tfs_stats_reset();
+		return size;
+	}
+	uint64_t start = stats_now();
+	journal_start();
+	int ret = tfs_do_write(path, buffer, size, offset, fi);
+	journal_stop();
+	arena_reset();
+	stats_record(&op_stats[OP_WRITE], start, ret);
+	return ret;
+}
 
-	return 0;
+static int tfs_unlink(const char *path) {
+	if(is_stats_path(path)){
+		return -EPERM;
+	}
+	uint64_t start = stats_now();
+	journal_start();
+	int ret = tfs_do_unlink(path);
+	journal_stop();
+	arena_reset();
+	stats_record(&op_stats[OP_UNLINK], start, ret);
+	return ret;
 }
 
+// Lets "echo > /.tfs_stats" through; O_TRUNC arrives as a truncate first
 static int tfs_truncate(const char *path, off_t size) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+	if(is_stats_path(path)){
+		return 0;
+	}
+	uint64_t start = stats_now();
+	journal_start();
+	int ret = tfs_do_truncate(path, size);
+	journal_stop();
+	arena_reset();
+	stats_record(&op_stats[OP_TRUNCATE], start, ret);
+	return ret;
 }
 
 static int tfs_release(const char *path, struct fuse_file_info *fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-	return 0;
+	uint64_t start = stats_now();
+	int ret = is_stats_path(path) ? stats_release(fi) : tfs_do_release(path, fi);
+	arena_reset();
+	stats_record(&op_stats[OP_RELEASE], start, ret);
+	return ret;
 }
 
-static int tfs_flush(const char * path, struct fuse_file_info * fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+static int tfs_flush(const char *path, struct fuse_file_info *fi) {
+	uint64_t start = stats_now();
+	int ret = is_stats_path(path) ? 0 : tfs_do_flush(path, fi);
+	arena_reset();
+	stats_record(&op_stats[OP_FLUSH], start, ret);
+	return ret;
+}
+
+static int tfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	uint64_t start = stats_now();
+	int ret = is_stats_path(path) ? 0 : tfs_do_fsync(path, datasync, fi);
+	arena_reset();
+	stats_record(&op_stats[OP_FSYNC], start, ret);
+	return ret;
+}
+
+static int tfs_statfs(const char *path, struct statvfs *stbuf) {
+	uint64_t start = stats_now();
+	int ret = tfs_do_statfs(path, stbuf);
+	arena_reset();
+	stats_record(&op_stats[OP_STATFS], start, ret);
+	return ret;
 }
 
 static int tfs_utimens(const char *path, const struct timespec tv[2]) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+	uint64_t start = stats_now();
+	int ret = tfs_do_utimens(path, tv);
+	arena_reset();
+	stats_record(&op_stats[OP_UTIMENS], start, ret);
+	return ret;
 }
 
 
@@ -1022,8 +4190,10 @@ static struct fuse_operations tfs_ope = {
 	.write		= tfs_write,
 	.unlink		= tfs_unlink,
 
+	.statfs     = tfs_statfs,
 	.truncate   = tfs_truncate,
 	.flush      = tfs_flush,
+	.fsync      = tfs_fsync,
 	.utimens    = tfs_utimens,
 	.release	= tfs_release
 };
@@ -1031,12 +4201,30 @@ static struct fuse_operations tfs_ope = {
 
 int main(int argc, char *argv[]) {
 	int fuse_stat;
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
 	getcwd(diskfile_path, PATH_MAX);
 	strcat(diskfile_path, "/DISKFILE");
+
+	if (fuse_opt_parse(&args, &tfs_config, tfs_opts, NULL) == -1) {
+		return 1;
+	}
+
+	// Format the disk file without mounting it
+	if (tfs_config.mkfs_only) {
+		fuse_opt_free_args(&args);
+		if (tfs_mkfs((uint64_t)tfs_config.disk_mb * 1024 * 1024, tfs_config.inodes) < 0) {
+			return 1;
+		}
+		printf("%s: %u blocks, %u inodes, %u data blocks in %u groups of %u blocks\n", disk_path,
+			sb->nblocks, sb->max_inum, sb->max_dnum, sb->ngroups, sb->blocks_per_group);
+		tfs_destroy(NULL);
+		return 0;
+	}
 	
-	fuse_stat = fuse_main(argc, argv, &tfs_ope, NULL);
+	fuse_stat = fuse_main(args.argc, args.argv, &tfs_ope, NULL);
 
+	fuse_opt_free_args(&args);
 	return fuse_stat;
 }
 
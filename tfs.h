@@ -16,36 +16,157 @@
 #ifndef _TFS_H
 #define _TFS_H
 
-#define MAGIC_NUM 0x5C3A
-#define MAX_INUM 1024
-#define MAX_DNUM 16384
+#define MAGIC_NUM 0x5C3D
+#define DEFAULT_INUM 1024
+#define JOURNAL_BLOCKS 1024
+#define DEFAULT_DIRTY_MB 8
 
-// [superblock] [inode bitmap] [data bitmap] [inode][inode].. [data][data]..
+/* block numbers are 32-bit on disk and int in memory */
+#define MAX_DISK_BLOCKS	0x7FFFFFFFULL
+
+/* bits held by one bitmap block, and blocks needed for a bitmap of n bits */
+#define BITS_PER_BLOCK		(BLOCK_SIZE * 8)
+#define BITMAP_BLOCKS(n)	(((uint64_t)(n) + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK)
+
+/* inode types */
+#define TFS_FILE 1
+#define TFS_DIR 2
+
+#define DIRENT_NAME_LEN 252
+
+// [superblock] [group descriptors].. [journal].. [group 0] [group 1] ..
+//
+// group: [inode bitmap] [data bitmap] [inode][inode].. [data][data]..
+//
+// The disk after the journal is cut into allocation groups of
+// blocks_per_group blocks; the last one may be shorter. Each group has
+// one-block inode and data bitmaps, inodes_per_group inodes (inode number ino
+// lives in group ino / inodes_per_group) and the data blocks after them.
+// mkfs writes only the superblock, the group descriptors, the root's inode
+// bitmap and inode table blocks and the journal superblock; everything else
+// starts out as zeros.
 struct superblock {
 	uint32_t	magic_num;			/* magic number */
-	uint16_t	max_inum;			/* maximum inode number */
-	uint16_t	max_dnum;			/* maximum data block number */
-	uint32_t	i_bitmap_blk;		/* start address of inode bitmap */
-	uint32_t	d_bitmap_blk;		/* start address of data block bitmap */
-	uint32_t	i_start_blk;		/* start address of inode region */
-	uint32_t	d_start_blk;		/* start address of data block region */
+	uint32_t	max_inum;			/* maximum inode number */
+	uint32_t	max_dnum;			/* number of data blocks in all groups */
+	uint32_t	nblocks;			/* size of the file system in blocks */
+	uint32_t	gd_blk;				/* start address of the group descriptors */
+	uint32_t	j_start_blk;		/* start address of the metadata journal */
+	uint32_t	j_blocks;			/* size of the journal in blocks */
+	uint32_t	g_start_blk;		/* start address of group 0 */
+	uint32_t	ngroups;			/* number of allocation groups */
+	uint32_t	blocks_per_group;	/* disk blocks in every group but the last */
+	uint32_t	inodes_per_group;	/* a multiple of INODES_PER_BLOCK */
 };
 
+/* where one group's parts are, packed GROUP_DESCS_PER_BLOCK to a block from gd_blk on */
+struct group_desc {
+	uint32_t	i_bitmap_blk;		/* start address of its inode bitmap */
+	uint32_t	d_bitmap_blk;		/* start address of its data block bitmap */
+	uint32_t	i_start_blk;		/* start address of its inode table */
+	uint32_t	d_start_blk;		/* start address of its data blocks */
+	uint32_t	d_blocks;			/* number of data blocks */
+	uint32_t	i_init_blks;		/* inode table blocks written so far, the rest hold only free inodes */
+};
+
+#define GROUP_DESCS_PER_BLOCK	(BLOCK_SIZE / sizeof(struct group_desc))
+
+/* group sizing: a group's bitmaps are one block each, so it holds at most
+ * BITS_PER_BLOCK blocks. Smaller disks are still cut into GROUP_MIN_COUNT
+ * groups, as long as each keeps GROUP_MIN_BLOCKS blocks. */
+#define GROUP_MAX_BLOCKS	BITS_PER_BLOCK
+#define GROUP_MIN_BLOCKS	256
+#define GROUP_MIN_COUNT		8
+
+/* a run of len data blocks starting at disk block pblk, mapped at file block lblk */
+struct extent {
+	uint32_t	lblk;				/* first logical block */
+	uint32_t	pblk;				/* first disk block */
+	uint32_t	len;				/* number of blocks */
+};
+
+/* extents held in the inode itself; beyond that they all move to ext_blk */
+#define INODE_EXTENTS 7
+
+/* on-disk inode size, and the bytes of file or directory data it can hold
+ * in place of the extent map */
+#define INODE_SIZE			1024
+#define INODE_INLINE_MAX	(INODE_SIZE - 168)
+
+/* inode flags */
+#define INODE_INLINE	0x1			/* data lives in inline_data, no blocks are mapped */
+#define INODE_EXT_INDEX	0x2			/* ext_blk is an extent index block over leaf blocks */
+
 struct inode {
-	uint16_t	ino;				/* inode number */
+	uint32_t	ino;				/* inode number */
 	uint16_t	valid;				/* validity of the inode */
+	uint16_t	nextents;			/* extents mapping the file, sorted by lblk; leaves with INODE_EXT_INDEX */
 	uint32_t	size;				/* size of the file */
 	uint32_t	type;				/* type of the file */
 	uint32_t	link;				/* link count */
-	int			direct_ptr[16];		/* direct pointer to data block */
-	int			indirect_ptr[8];	/* indirect pointer to data block */
+	uint32_t	flags;				/* INODE_INLINE, INODE_EXT_INDEX */
 	struct stat	vstat;				/* inode stat */
+	union {
+		struct {
+			uint32_t	ext_blk;	/* extent block once nextents > INODE_EXTENTS */
+			struct extent extents[INODE_EXTENTS];	/* inline extents */
+		};
+		char	inline_data[INODE_INLINE_MAX];	/* the first size bytes are the data */
+	};
 };
 
+_Static_assert(sizeof(struct inode) == INODE_SIZE, "struct inode must fill INODE_SIZE");
+
+/* extent tree block: a sorted leaf of extents, referenced by inode->ext_blk or an index entry */
+#define EXTENT_MAGIC 0x45585431
+struct extent_block {
+	uint32_t	magic;				/* EXTENT_MAGIC */
+	uint32_t	count;				/* extents in use */
+	struct extent extents[];
+};
+
+#define EXTENTS_PER_BLOCK	((BLOCK_SIZE - sizeof(struct extent_block)) / sizeof(struct extent))
+
+/* extent index block: once one leaf can't hold the extents, ext_blk points here
+ * and entry i points to the leaf mapping logical blocks from its lblk up to the
+ * next entry's. The first entry starts at 0. */
+#define EXTENT_INDEX_MAGIC 0x45585849
+struct extent_index {
+	uint32_t	lblk;				/* first logical block the leaf maps */
+	uint32_t	blk;				/* leaf block */
+};
+
+struct extent_index_block {
+	uint32_t	magic;				/* EXTENT_INDEX_MAGIC */
+	uint32_t	count;				/* entries in use */
+	struct extent_index entries[];
+};
+
+#define INDEX_PER_BLOCK	((BLOCK_SIZE - sizeof(struct extent_index_block)) / sizeof(struct extent_index))
+
+/* inodes are packed back to back in each group's inode table, so inode number
+ * ino lives in block i_start_blk + (ino % inodes_per_group) / INODES_PER_BLOCK
+ * of its group */
+#define INODES_PER_BLOCK	(BLOCK_SIZE / sizeof(struct inode))
+
+/* on-disk directory record, packed back to back in a directory's data blocks.
+ * rec_len spans the record and any free space after it up to the next record */
+struct dir_record {
+	uint32_t	ino;				/* inode number of the entry */
+	uint16_t	rec_len;			/* bytes from this record to the next one */
+	uint8_t		name_len;			/* length of name, not NUL terminated */
+	uint8_t		valid;				/* 0 for a freed record */
+	char		name[];				/* name of the entry */
+};
+
+/* space taken by a record holding a name of n bytes, 4-byte aligned */
+#define DIR_REC_LEN(n)	((sizeof(struct dir_record) + (n) + 3) & ~3)
+
+/* in-memory directory entry */
 struct dirent {
-	uint16_t ino;					/* inode number of the directory entry */
+	uint32_t ino;					/* inode number of the directory entry */
 	uint16_t valid;					/* validity of the directory entry */
-	char name[252];					/* name of the directory entry */
+	char name[DIRENT_NAME_LEN];		/* name of the directory entry */
 };
 
 
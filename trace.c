@@ -0,0 +1,135 @@
+/*
+ *	Tiny File System
+ *
+ *	File:	trace.c
+ *
+ *	Binary event tracing, see trace.h
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+//One thread's events. Only the owning thread writes it; head counts every
+//event ever recorded, so ev[head % TRACE_RING_EVENTS] is the next slot.
+struct trace_ring {
+	struct trace_event	ev[TRACE_RING_EVENTS];
+	uint64_t			head;
+	uint32_t			tid;
+	struct trace_ring	*next;
+};
+
+static struct trace_ring *trace_rings;	/* every ring ever created, pushed lock-free */
+static __thread struct trace_ring *trace_mine;
+
+static const char *trace_names[TR_COUNT] = {
+	[TR_INO_ALLOC] = "ino_alloc",
+	[TR_INO_FREE] = "ino_free",
+	[TR_BLK_ALLOC] = "blk_alloc",
+	[TR_BLK_FREE] = "blk_free",
+	[TR_BLK_DEFER] = "blk_defer",
+	[TR_NOSPC] = "nospc",
+	[TR_DIR_ADD] = "dir_add",
+	[TR_DIR_EXISTS] = "dir_exists",
+	[TR_DIR_REMOVE] = "dir_remove",
+	[TR_DIR_NOENT] = "dir_noent",
+	[TR_ICACHE_MISS] = "icache_miss",
+	[TR_JOURNAL_COMMIT] = "journal_commit",
+	[TR_JOURNAL_CHECKPOINT] = "journal_checkpoint",
+	[TR_DELALLOC_FLUSH] = "delalloc_flush",
+};
+
+const char *trace_name(int id) {
+	if (id < 0 || id >= TR_COUNT || trace_names[id] == NULL) {
+		return "unknown";
+	}
+	return trace_names[id];
+}
+
+//FNV-1a, lets a trace identify names without storing them
+uint32_t trace_hash(const char *name, size_t len) {
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h = (h ^ (unsigned char)name[i]) * 16777619u;
+	}
+	return h;
+}
+
+//The calling thread's ring, created and published on its first event
+static struct trace_ring *trace_ring_get() {
+	struct trace_ring *ring = trace_mine;
+
+	if (ring != NULL) {
+		return ring;
+	}
+	ring = calloc(1, sizeof(struct trace_ring));
+	if (ring == NULL) {
+		return NULL;
+	}
+	ring->tid = (uint32_t)syscall(SYS_gettid);
+	ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	trace_mine = ring;
+	return ring;
+}
+
+void trace_record(int level, int id, uint64_t a, uint64_t b) {
+	struct trace_ring *ring = trace_ring_get();
+	struct timespec ts;
+
+	if (ring == NULL) {
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	struct trace_event *ev = &ring->ev[ring->head & (TRACE_RING_EVENTS - 1)];
+	ev->ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	ev->tid = ring->tid;
+	ev->id = id;
+	ev->level = level;
+	ev->arg[0] = a;
+	ev->arg[1] = b;
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+//Write the events still held in every ring to path, each ring oldest first.
+//Meant for when the file system is idle, such as at unmount: events recorded
+//while it runs may come out torn.
+int trace_dump(const char *path) {
+	struct trace_header hdr = { TRACE_MAGIC, TRACE_VERSION, sizeof(struct trace_event), 0 };
+	struct trace_ring *ring;
+	FILE *out = fopen(path, "w");
+
+	if (out == NULL) {
+		return -1;
+	}
+
+	// Step 1: Leave room for the header; the event count is known at the end
+	fwrite(&hdr, sizeof(hdr), 1, out);
+
+	// Step 2: Each ring's live part, which wraps around when the ring is full
+	for (ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		uint64_t first = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+		uint64_t i;
+
+		for (i = first; i < head; i++) {
+			fwrite(&ring->ev[i & (TRACE_RING_EVENTS - 1)], sizeof(struct trace_event), 1, out);
+		}
+		hdr.nevents += head - first;
+	}
+
+	// Step 3: Fill in the count
+	rewind(out);
+	fwrite(&hdr, sizeof(hdr), 1, out);
+	return fclose(out) == 0 ? 0 : -1;
+}
@@ -0,0 +1,86 @@
+/*
+ *	Tiny File System
+ *
+ *	File:	trace.h
+ *
+ *	Binary event tracing
+ *
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+/*
+ * Build with TFS_TRACE set to a level ("make TRACE=2") to record events up to
+ * that level. With TFS_TRACE 0, the default, every TRACE() compiles to nothing.
+ *
+ * Each thread records into its own ring of TRACE_RING_EVENTS fixed-size
+ * events, so recording takes no lock and never blocks; once a ring is full
+ * the oldest events are overwritten. trace_dump() writes all rings to a file
+ * that tracedump decodes offline.
+ */
+#ifndef TFS_TRACE
+#define TFS_TRACE	0
+#endif
+
+#define TRACE_ERR	1	/* failed operations */
+#define TRACE_INFO	2	/* allocation, namespace and journal events */
+#define TRACE_DEBUG	3	/* cache misses and other high-volume events */
+
+#define TRACE_RING_EVENTS	4096	/* per thread, a power of two */
+#define TRACE_MAGIC		0x54465354	/* "TFST" */
+#define TRACE_VERSION	1
+#define TRACE_FILE		"./tfs.trace"
+
+enum trace_id {
+	TR_INO_ALLOC,		/* ino, allocation group */
+	TR_INO_FREE,		/* ino */
+	TR_BLK_ALLOC,		/* blkno, run length */
+	TR_BLK_FREE,		/* blkno */
+	TR_BLK_DEFER,		/* blkno, freed after the next checkpoint */
+	TR_NOSPC,			/* 0 for inodes, 1 for data blocks */
+	TR_DIR_ADD,			/* directory ino, child ino */
+	TR_DIR_EXISTS,		/* directory ino, name hash */
+	TR_DIR_REMOVE,		/* directory ino, name hash */
+	TR_DIR_NOENT,		/* directory ino, name hash */
+	TR_ICACHE_MISS,		/* ino */
+	TR_JOURNAL_COMMIT,	/* transaction id, blocks */
+	TR_JOURNAL_CHECKPOINT,	/* blocks written home */
+	TR_DELALLOC_FLUSH,	/* ino, pages written */
+	TR_COUNT
+};
+
+// One event, two per cache line
+struct trace_event {
+	uint64_t	ns;		/* CLOCK_MONOTONIC */
+	uint32_t	tid;	/* recording thread */
+	uint16_t	id;		/* enum trace_id */
+	uint16_t	level;
+	uint64_t	arg[2];
+};
+
+// File header written by trace_dump(), followed by nevents events
+struct trace_header {
+	uint32_t	magic;
+	uint16_t	version;
+	uint16_t	event_size;
+	uint64_t	nevents;
+};
+
+#if TFS_TRACE
+#define TRACE(level, id, a, b) do { \
+		if ((level) <= TFS_TRACE) \
+			trace_record((level), (id), (uint64_t)(a), (uint64_t)(b)); \
+	} while (0)
+#else
+#define TRACE(level, id, a, b) do { } while (0)
+#endif
+
+void trace_record(int level, int id, uint64_t a, uint64_t b);
+int trace_dump(const char *path);
+const char *trace_name(int id);
+uint32_t trace_hash(const char *name, size_t len);
+
+#endif
@@ -0,0 +1,85 @@
+/*
+ *	Tiny File System
+ *
+ *	File:	tracedump.c
+ *
+ *	Decode a trace written by a tfs built with TRACE=N
+ *
+ *	usage: ./tracedump [-l level] [tracefile]
+ *
+ *	Events from all threads are merged in time order, one per line: time in us
+ *	since the first event, thread id, level, event name and its arguments.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+static const char *level_names[] = { "-", "err", "info", "debug" };
+
+static int event_cmp(const void *a, const void *b) {
+	const struct trace_event *x = a, *y = b;
+	return x->ns < y->ns ? -1 : x->ns > y->ns;
+}
+
+int main(int argc, char *argv[]) {
+	struct trace_header hdr;
+	const char *path = TRACE_FILE;
+	int maxLevel = TRACE_DEBUG;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "l:")) != -1) {
+		if (opt == 'l') {
+			maxLevel = atoi(optarg);
+		} else {
+			fprintf(stderr, "usage: %s [-l level] [tracefile]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind < argc) {
+		path = argv[optind];
+	}
+
+	// Step 1: Check the header
+	FILE *in = fopen(path, "r");
+	if (in == NULL) {
+		perror(path);
+		return 1;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, in) != 1 || hdr.magic != TRACE_MAGIC) {
+		fprintf(stderr, "%s: not a tfs trace\n", path);
+		return 1;
+	}
+	if (hdr.version != TRACE_VERSION || hdr.event_size != sizeof(struct trace_event)) {
+		fprintf(stderr, "%s: trace version %u with %u byte events, expected %u with %zu\n", path,
+			hdr.version, hdr.event_size, TRACE_VERSION, sizeof(struct trace_event));
+		return 1;
+	}
+
+	// Step 2: Read every event and merge the threads by time
+	struct trace_event *ev = malloc((hdr.nevents ? hdr.nevents : 1) * sizeof(struct trace_event));
+	size_t n = fread(ev, sizeof(struct trace_event), hdr.nevents, in);
+	fclose(in);
+	if (n != hdr.nevents) {
+		fprintf(stderr, "%s: truncated, %zu of %llu events\n", path, n, (unsigned long long)hdr.nevents);
+	}
+	qsort(ev, n, sizeof(struct trace_event), event_cmp);
+
+	// Step 3: Print them
+	size_t i;
+	for (i = 0; i < n; i++) {
+		if (ev[i].level > maxLevel) {
+			continue;
+		}
+		printf("%14.3f %7u %-5s %-20s %llu %llu\n", (ev[i].ns - ev[0].ns) / 1000.0, ev[i].tid,
+			ev[i].level <= TRACE_DEBUG ? level_names[ev[i].level] : "?", trace_name(ev[i].id),
+			(unsigned long long)ev[i].arg[0], (unsigned long long)ev[i].arg[1]);
+	}
+
+	free(ev);
+	return 0;
+}